@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Measures the cold start latency of each vpnhelper subcommand. Every run is
+# a fresh process working on a scratch preferences file, so the live network
+# configuration is left alone. The connection it creates is deleted again,
+# which also removes its keychain items.
+#
+# usage: sudo Scripts/startup_benchmark.sh [path/to/vpnhelper] [runs]
+
+VPNHELPER=${1:-./vpnhelper}
+RUNS=${2:-10}
+
+SCRATCH=$(mktemp -d /tmp/vpnhelper-bench.XXXXXX) || exit 1
+PREFS="$SCRATCH/preferences.plist"
+trap 'rm -rf "$SCRATCH"' EXIT
+
+now_ms() {
+    perl -MTime::HiRes=time -e 'printf "%.3f\n", time * 1000'
+}
+
+# Runs a command once, adding its wall time to the total for the label.
+measure() {
+    label=$1
+    shift
+    start=$(now_ms)
+    "$VPNHELPER" -P "$PREFS" "$@" > "$SCRATCH/out" 2>&1 || {
+        echo "$label failed:" >&2
+        cat "$SCRATCH/out" >&2
+        exit 1
+    }
+    end=$(now_ms)
+    echo "$label $(echo "$end - $start" | bc)" >> "$SCRATCH/times"
+}
+
+for run in $(seq "$RUNS"); do
+    measure create create -n "Benchmark $run" -a vpn.example.com -u user -p password -s secret
+    id=$(sed -n 's/^Service ID: //p' "$SCRATCH/out")
+    
+    measure edit-address edit -i "$id" -a vpn2.example.com
+    measure edit-password edit -i "$id" -p password2
+    measure show show -i "$id"
+    measure list list
+    measure delete delete -i "$id"
+done
+
+printf "%-16s %10s %10s %10s\n" "command" "mean ms" "min ms" "max ms"
+awk '
+    { sum[$1] += $2; n[$1]++
+      if (!($1 in min) || $2 < min[$1]) min[$1] = $2
+      if (!($1 in max) || $2 > max[$1]) max[$1] = $2
+      if (!($1 in order)) order[$1] = NR }
+    END { for (c in sum) printf "%d %-16s %10.1f %10.1f %10.1f\n", order[c], c, sum[c] / n[c], min[c], max[c] }
+' "$SCRATCH/times" | sort -n | cut -d" " -f2-
@@ -0,0 +1,721 @@
+#include "archive.h"
+#include "arena.h"
+#include "trace.h"
+#include "vpn.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <CommonCrypto/CommonCryptor.h>
+#include <CommonCrypto/CommonHMAC.h>
+#include <CommonCrypto/CommonKeyDerivation.h>
+
+/* An archive starts with "VPNX", a version byte and a flags byte. If
+ * ARCHIVE_FLAG_SECRETS is set, the key derivation salt, the number of PBKDF2
+ * rounds and a check value follow, so a wrong passphrase is caught before
+ * anything is created. Each entry is a kind byte followed by its fields,
+ * each a tag byte, a two-byte length and the value, and ends with
+ * ARCHIVE_TAG_END. The archive ends with ARCHIVE_KIND_END and the number of
+ * entries, so a truncated file is never imported. Integers are big-endian.
+ *
+ * In an archive with secrets, every entry and the end marker are followed
+ * by an HMAC of their position in the archive and all of their bytes, so
+ * names, addresses and secrets can't be changed, moved between fields or
+ * entries, reordered or dropped without the passphrase. */
+#define ARCHIVE_MAGIC "VPNX"
+#define ARCHIVE_MAGIC_LENGTH 4
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_FLAG_SECRETS 0x01
+
+#define ARCHIVE_KIND_SERVICE 'S'
+#define ARCHIVE_KIND_END 'E'
+
+#define ARCHIVE_TAG_END 0
+#define ARCHIVE_TAG_NAME 1
+#define ARCHIVE_TAG_ADDRESS 2
+#define ARCHIVE_TAG_USERNAME 3
+#define ARCHIVE_TAG_SEND_ALL_TRAFFIC 4
+#define ARCHIVE_TAG_PASSWORD 5
+#define ARCHIVE_TAG_SHARED_SECRET 6
+
+#define ARCHIVE_MAX_FIELD_LENGTH 0xFFFF
+#define ARCHIVE_SALT_LENGTH 16
+#define ARCHIVE_PBKDF2_ROUNDS 100000
+#define ARCHIVE_MIN_PBKDF2_ROUNDS 10000
+#define ARCHIVE_MAX_PBKDF2_ROUNDS 10000000
+#define ARCHIVE_MAC_LENGTH CC_SHA256_DIGEST_LENGTH
+#define MAX_PASSPHRASE_LENGTH 1024
+
+typedef struct {
+    uint8_t encryption_key[kCCKeySizeAES256];
+    uint8_t mac_key[CC_SHA256_DIGEST_LENGTH];
+} ArchiveKeys;
+
+/* An archive being written or read. */
+typedef struct {
+    FILE *file;
+    
+    /* The keys for the secrets, or NULL if the archive has none. */
+    const ArchiveKeys *keys;
+    
+    /* The MAC of the current record, which every byte written or read is
+     * added to between begin_archive_record() and end_archive_record(). */
+    CCHmacContext mac;
+    Boolean in_record;
+} ArchiveStream;
+
+/* Reads the first line of a file, without stdio buffering a copy of it. */
+const char *
+read_passphrase(Arena *arena, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    setvbuf(file, NULL, _IONBF, 0);
+    
+    char *passphrase = arena_alloc(arena, MAX_PASSPHRASE_LENGTH);
+    const char *result = NULL;
+    if (fgets(passphrase, MAX_PASSPHRASE_LENGTH, file) != NULL) {
+        passphrase[strcspn(passphrase, "\r\n")] = '\0';
+        if (passphrase[0] != '\0') {
+            result = passphrase;
+        }
+    }
+    
+    if (result == NULL) {
+        fprintf(stderr, "No passphrase in %s\n", path);
+    }
+    
+    fclose(file);
+    return result;
+}
+
+/* Derives the keys for an archive, and the value used to check them. */
+Boolean
+derive_archive_keys(const char *passphrase, const uint8_t *salt, uint32_t rounds, ArchiveKeys *keys, uint8_t *check)
+{
+    uint64_t start_time = trace_begin();
+    int status = CCKeyDerivationPBKDF(
+        kCCPBKDF2,
+        passphrase,
+        strlen(passphrase),
+        salt,
+        ARCHIVE_SALT_LENGTH,
+        kCCPRFHmacAlgSHA256,
+        rounds,
+        (uint8_t *)keys,
+        sizeof(*keys)
+    );
+    trace_end("CCKeyDerivationPBKDF", start_time);
+    
+    if (status != kCCSuccess) {
+        fprintf(stderr, "Failed to derive the archive key: %d\n", status);
+        return FALSE;
+    }
+    
+    CCHmac(kCCHmacAlgSHA256, keys->mac_key, sizeof(keys->mac_key), ARCHIVE_MAGIC, ARCHIVE_MAGIC_LENGTH, check);
+    return TRUE;
+}
+
+/* Encrypts a secret as IV, ciphertext and MAC, in memory from the arena. */
+Boolean
+seal_secret(Arena *arena, const ArchiveKeys *keys, const char *secret, uint8_t **sealed, size_t *sealed_length)
+{
+    size_t length = strlen(secret);
+    size_t capacity = kCCBlockSizeAES128 + length + kCCBlockSizeAES128 + ARCHIVE_MAC_LENGTH;
+    if (capacity > ARCHIVE_MAX_FIELD_LENGTH) {
+        fprintf(stderr, "Secret is too long to export\n");
+        return FALSE;
+    }
+    
+    uint8_t *buffer = arena_alloc(arena, capacity);
+    arc4random_buf(buffer, kCCBlockSizeAES128);
+    
+    size_t ciphertext_length;
+    CCCryptorStatus status = CCCrypt(
+        kCCEncrypt,
+        kCCAlgorithmAES,
+        kCCOptionPKCS7Padding,
+        keys->encryption_key,
+        sizeof(keys->encryption_key),
+        buffer,
+        secret,
+        length,
+        buffer + kCCBlockSizeAES128,
+        length + kCCBlockSizeAES128,
+        &ciphertext_length
+    );
+    if (status != kCCSuccess) {
+        fprintf(stderr, "Failed to encrypt secret: %d\n", status);
+        return FALSE;
+    }
+    
+    size_t mac_offset = kCCBlockSizeAES128 + ciphertext_length;
+    CCHmac(kCCHmacAlgSHA256, keys->mac_key, sizeof(keys->mac_key), buffer, mac_offset, buffer + mac_offset);
+    
+    *sealed = buffer;
+    *sealed_length = mac_offset + ARCHIVE_MAC_LENGTH;
+    return TRUE;
+}
+
+/* Checks and decrypts a secret written by seal_secret(). */
+CFStringRef
+create_opened_secret(Arena *arena, const ArchiveKeys *keys, const uint8_t *sealed, size_t sealed_length)
+{
+    if (sealed_length < 2 * kCCBlockSizeAES128 + ARCHIVE_MAC_LENGTH) {
+        return NULL;
+    }
+    
+    size_t mac_offset = sealed_length - ARCHIVE_MAC_LENGTH;
+    uint8_t mac[ARCHIVE_MAC_LENGTH];
+    CCHmac(kCCHmacAlgSHA256, keys->mac_key, sizeof(keys->mac_key), sealed, mac_offset, mac);
+    if (timingsafe_bcmp(mac, sealed + mac_offset, ARCHIVE_MAC_LENGTH) != 0) {
+        return NULL;
+    }
+    
+    size_t ciphertext_length = mac_offset - kCCBlockSizeAES128;
+    uint8_t *plaintext = arena_alloc(arena, ciphertext_length);
+    size_t plaintext_length;
+    CCCryptorStatus status = CCCrypt(
+        kCCDecrypt,
+        kCCAlgorithmAES,
+        kCCOptionPKCS7Padding,
+        keys->encryption_key,
+        sizeof(keys->encryption_key),
+        sealed,
+        sealed + kCCBlockSizeAES128,
+        ciphertext_length,
+        plaintext,
+        ciphertext_length,
+        &plaintext_length
+    );
+    if (status != kCCSuccess) {
+        return NULL;
+    }
+    
+    return CFStringCreateWithBytes(NULL, plaintext, plaintext_length, kCFStringEncodingUTF8, FALSE);
+}
+
+/* Starts the MAC of an entry or the end marker, if the archive has
+ * secrets. Its index binds it to its place in the archive. */
+void
+begin_archive_record(ArchiveStream *archive, uint32_t index)
+{
+    if (archive->keys == NULL) {
+        return;
+    }
+    
+    uint8_t index_bytes[4] = {index >> 24, index >> 16, index >> 8, index};
+    CCHmacInit(&archive->mac, kCCHmacAlgSHA256, archive->keys->mac_key, sizeof(archive->keys->mac_key));
+    CCHmacUpdate(&archive->mac, index_bytes, sizeof(index_bytes));
+    archive->in_record = TRUE;
+}
+
+void
+write_archive_bytes(ArchiveStream *archive, const void *bytes, size_t length)
+{
+    fwrite(bytes, 1, length, archive->file);
+    if (archive->in_record) {
+        CCHmacUpdate(&archive->mac, bytes, length);
+    }
+}
+
+/* Writes the MAC of the current record, if the archive has secrets. */
+void
+write_archive_mac(ArchiveStream *archive)
+{
+    if (!archive->in_record) {
+        return;
+    }
+    
+    uint8_t mac[ARCHIVE_MAC_LENGTH];
+    CCHmacFinal(&archive->mac, mac);
+    archive->in_record = FALSE;
+    fwrite(mac, 1, sizeof(mac), archive->file);
+}
+
+void
+write_uint32(ArchiveStream *archive, uint32_t value)
+{
+    uint8_t bytes[4] = {value >> 24, value >> 16, value >> 8, value};
+    write_archive_bytes(archive, bytes, sizeof(bytes));
+}
+
+Boolean
+write_field(ArchiveStream *archive, uint8_t tag, const void *value, size_t length)
+{
+    if (length > ARCHIVE_MAX_FIELD_LENGTH) {
+        fprintf(stderr, "Value is too long to export\n");
+        return FALSE;
+    }
+    
+    uint8_t header[3] = {tag, length >> 8, length};
+    write_archive_bytes(archive, header, sizeof(header));
+    write_archive_bytes(archive, value, length);
+    return TRUE;
+}
+
+Boolean
+write_string_field(Arena *arena, ArchiveStream *archive, uint8_t tag, CFTypeRef value)
+{
+    if (value == NULL || CFGetTypeID(value) != CFStringGetTypeID()) {
+        return TRUE;
+    }
+    
+    const char *chars = arena_copy_utf8_chars(arena, value);
+    return chars != NULL && write_field(archive, tag, chars, strlen(chars));
+}
+
+Boolean
+write_secret_field(Arena *arena, ArchiveStream *archive, uint8_t tag, CFStringRef secret)
+{
+    if (secret == NULL) {
+        return TRUE;
+    }
+    
+    const char *chars = arena_copy_utf8_chars(arena, secret);
+    uint8_t *sealed;
+    size_t sealed_length;
+    return chars != NULL && seal_secret(arena, archive->keys, chars, &sealed, &sealed_length) &&
+        write_field(archive, tag, sealed, sealed_length);
+}
+
+/* Writes one connection, as described by copy_vpn_list(). Secrets are read
+ * from the keychain only if the archive has keys. */
+Boolean
+write_archive_entry(ArchiveStream *archive, uint32_t index, CFDictionaryRef description)
+{
+    Boolean success = FALSE;
+    CFStringRef password = NULL;
+    CFStringRef shared_secret = NULL;
+    
+    Arena arena;
+    init_arena(&arena);
+    
+    begin_archive_record(archive, index);
+    
+    uint8_t kind = ARCHIVE_KIND_SERVICE;
+    write_archive_bytes(archive, &kind, sizeof(kind));
+    
+    if (!write_string_field(&arena, archive, ARCHIVE_TAG_NAME, CFDictionaryGetValue(description, CFSTR("name"))) ||
+        !write_string_field(&arena, archive, ARCHIVE_TAG_ADDRESS, CFDictionaryGetValue(description, CFSTR("address"))) ||
+        !write_string_field(&arena, archive, ARCHIVE_TAG_USERNAME, CFDictionaryGetValue(description, CFSTR("username")))) {
+        goto exit;
+    }
+    
+    CFTypeRef send_all_traffic = CFDictionaryGetValue(description, CFSTR("send_all_traffic"));
+    if (send_all_traffic != NULL && CFGetTypeID(send_all_traffic) == CFBooleanGetTypeID()) {
+        uint8_t value = CFBooleanGetValue(send_all_traffic);
+        write_field(archive, ARCHIVE_TAG_SEND_ALL_TRAFFIC, &value, sizeof(value));
+    }
+    
+    if (archive->keys != NULL) {
+        copy_vpn_secrets(CFDictionaryGetValue(description, CFSTR("id")), &password, &shared_secret);
+        if (!write_secret_field(&arena, archive, ARCHIVE_TAG_PASSWORD, password) ||
+            !write_secret_field(&arena, archive, ARCHIVE_TAG_SHARED_SECRET, shared_secret)) {
+            goto exit;
+        }
+    }
+    
+    uint8_t end = ARCHIVE_TAG_END;
+    write_archive_bytes(archive, &end, sizeof(end));
+    write_archive_mac(archive);
+    success = TRUE;
+    
+exit:
+    if (password != NULL) {
+        CFRelease(password);
+    }
+    if (shared_secret != NULL) {
+        CFRelease(shared_secret);
+    }
+    release_arena(&arena);
+    return success;
+}
+
+int
+run_export(const char *path, const char *passphrase_path)
+{
+    int err = 1;
+    Boolean to_stdout = (strcmp(path, "-") == 0);
+    
+    ArchiveKeys keys;
+    uint8_t salt[ARCHIVE_SALT_LENGTH];
+    uint8_t check[ARCHIVE_MAC_LENGTH];
+    
+    Arena arena;
+    init_arena(&arena);
+    
+    if (passphrase_path != NULL) {
+        const char *passphrase = read_passphrase(&arena, passphrase_path);
+        if (passphrase == NULL) {
+            goto release_arena;
+        }
+        
+        arc4random_buf(salt, sizeof(salt));
+        if (!derive_archive_keys(passphrase, salt, ARCHIVE_PBKDF2_ROUNDS, &keys, check)) {
+            goto release_arena;
+        }
+    }
+    
+    CFArrayRef vpn_list = copy_vpn_list();
+    if (vpn_list == NULL) {
+        fprintf(stderr, "Failed to read VPN connections\n");
+        goto release_arena;
+    }
+    
+    FILE *file = stdout;
+    if (!to_stdout) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        file = (fd < 0) ? NULL : fdopen(fd, "w");
+        if (file == NULL) {
+            fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            goto release_list;
+        }
+    }
+    
+    ArchiveStream archive = {
+        .file = file,
+        .keys = (passphrase_path != NULL) ? &keys : NULL,
+        .in_record = FALSE
+    };
+    
+    uint8_t header[ARCHIVE_MAGIC_LENGTH + 2] = {'V', 'P', 'N', 'X', ARCHIVE_VERSION, 0};
+    if (passphrase_path != NULL) {
+        header[ARCHIVE_MAGIC_LENGTH + 1] |= ARCHIVE_FLAG_SECRETS;
+    }
+    write_archive_bytes(&archive, header, sizeof(header));
+    
+    if (passphrase_path != NULL) {
+        write_archive_bytes(&archive, salt, sizeof(salt));
+        write_uint32(&archive, ARCHIVE_PBKDF2_ROUNDS);
+        write_archive_bytes(&archive, check, sizeof(check));
+    }
+    
+    CFIndex count = CFArrayGetCount(vpn_list);
+    for (CFIndex i = 0; i < count; ++i) {
+        if (!write_archive_entry(&archive, (uint32_t)i, CFArrayGetValueAtIndex(vpn_list, i))) {
+            fprintf(stderr, "Failed to export entry %ld\n", i);
+            goto close_file;
+        }
+    }
+    
+    begin_archive_record(&archive, (uint32_t)count);
+    uint8_t kind = ARCHIVE_KIND_END;
+    write_archive_bytes(&archive, &kind, sizeof(kind));
+    write_uint32(&archive, (uint32_t)count);
+    write_archive_mac(&archive);
+    
+    if (fflush(file) != 0 || ferror(file)) {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    } else {
+        fprintf(stderr, "Exported %ld VPN connections\n", count);
+        err = 0;
+    }
+    
+close_file:
+    if (!to_stdout) {
+        if (fclose(file) != 0) {
+            err = 1;
+        }
+        if (err) {
+            unlink(path);
+        }
+    }
+release_list:
+    CFRelease(vpn_list);
+release_arena:
+    memset_s(&keys, sizeof(keys), 0, sizeof(keys));
+    release_arena(&arena);
+    return err;
+}
+
+Boolean
+read_bytes(ArchiveStream *archive, void *buffer, size_t length)
+{
+    if (fread(buffer, 1, length, archive->file) != length) {
+        return FALSE;
+    }
+    
+    if (archive->in_record) {
+        CCHmacUpdate(&archive->mac, buffer, length);
+    }
+    return TRUE;
+}
+
+/* Reads the MAC of the current record, if the archive has secrets, and
+ * checks it against what was read. */
+Boolean
+check_archive_mac(ArchiveStream *archive)
+{
+    if (!archive->in_record) {
+        return TRUE;
+    }
+    
+    uint8_t mac[ARCHIVE_MAC_LENGTH];
+    uint8_t stored_mac[ARCHIVE_MAC_LENGTH];
+    CCHmacFinal(&archive->mac, mac);
+    archive->in_record = FALSE;
+    
+    return read_bytes(archive, stored_mac, sizeof(stored_mac)) &&
+        timingsafe_bcmp(mac, stored_mac, sizeof(mac)) == 0;
+}
+
+Boolean
+read_uint32(ArchiveStream *archive, uint32_t *value)
+{
+    uint8_t bytes[4];
+    if (!read_bytes(archive, bytes, sizeof(bytes))) {
+        return FALSE;
+    }
+    
+    *value = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+    return TRUE;
+}
+
+/* Reads the header of an archive and, if it contains secrets, derives and
+ * checks the keys, and sets them on the archive. */
+Boolean
+read_archive_header(ArchiveStream *archive, const char *passphrase_path, ArchiveKeys *keys)
+{
+    uint8_t header[ARCHIVE_MAGIC_LENGTH + 2];
+    if (!read_bytes(archive, header, sizeof(header)) || memcmp(header, ARCHIVE_MAGIC, ARCHIVE_MAGIC_LENGTH) != 0) {
+        fprintf(stderr, "Not a VPN archive\n");
+        return FALSE;
+    }
+    
+    if (header[ARCHIVE_MAGIC_LENGTH] != ARCHIVE_VERSION) {
+        fprintf(stderr, "Unsupported archive version %u\n", header[ARCHIVE_MAGIC_LENGTH]);
+        return FALSE;
+    }
+    
+    if (!(header[ARCHIVE_MAGIC_LENGTH + 1] & ARCHIVE_FLAG_SECRETS)) {
+        return TRUE;
+    }
+    
+    uint8_t salt[ARCHIVE_SALT_LENGTH];
+    uint32_t rounds;
+    uint8_t stored_check[ARCHIVE_MAC_LENGTH];
+    if (!read_bytes(archive, salt, sizeof(salt)) || !read_uint32(archive, &rounds) ||
+        !read_bytes(archive, stored_check, sizeof(stored_check))) {
+        fprintf(stderr, "Archive is truncated\n");
+        return FALSE;
+    }
+    
+    /* The count comes from the file, and a huge one would hang the import */
+    if (rounds < ARCHIVE_MIN_PBKDF2_ROUNDS || rounds > ARCHIVE_MAX_PBKDF2_ROUNDS) {
+        fprintf(stderr, "Archive has an invalid key derivation round count %u\n", rounds);
+        return FALSE;
+    }
+    
+    if (passphrase_path == NULL) {
+        fprintf(stderr, "Archive contains secrets, must specify passphrase file (-k)\n");
+        return FALSE;
+    }
+    
+    Arena arena;
+    init_arena(&arena);
+    
+    Boolean success = FALSE;
+    uint8_t check[ARCHIVE_MAC_LENGTH];
+    const char *passphrase = read_passphrase(&arena, passphrase_path);
+    if (passphrase != NULL && derive_archive_keys(passphrase, salt, rounds, keys, check)) {
+        success = (timingsafe_bcmp(check, stored_check, sizeof(check)) == 0);
+        if (!success) {
+            fprintf(stderr, "Wrong passphrase for archive\n");
+        }
+    }
+    
+    if (success) {
+        archive->keys = keys;
+    }
+    
+    release_arena(&arena);
+    return success;
+}
+
+/* Replaces a configuration field, releasing the value it held. */
+void
+set_config_field(CFTypeRef *field, CFTypeRef value)
+{
+    if (*field != NULL) {
+        CFRelease(*field);
+    }
+    *field = value;
+}
+
+/* Reads the fields of one entry into a configuration, after its kind
+ * byte. The buffer must hold ARCHIVE_MAX_FIELD_LENGTH bytes, and is reused
+ * for every field so memory use doesn't depend on the archive. Nothing read
+ * is trusted until the entry's MAC has been checked. */
+Boolean
+read_archive_entry(ArchiveStream *archive, uint8_t *buffer, L2TPConfig *config)
+{
+    Boolean success = FALSE;
+    const ArchiveKeys *keys = archive->keys;
+    
+    Arena arena;
+    init_arena(&arena);
+    
+    for (;;) {
+        uint8_t tag;
+        if (!read_bytes(archive, &tag, sizeof(tag))) {
+            goto exit;
+        }
+        if (tag == ARCHIVE_TAG_END) {
+            break;
+        }
+        
+        uint8_t length_bytes[2];
+        if (!read_bytes(archive, length_bytes, sizeof(length_bytes))) {
+            goto exit;
+        }
+        
+        size_t length = ((size_t)length_bytes[0] << 8) | length_bytes[1];
+        if (!read_bytes(archive, buffer, length)) {
+            goto exit;
+        }
+        
+        CFTypeRef *field;
+        switch (tag) {
+            case ARCHIVE_TAG_NAME:
+                field = (CFTypeRef *)&config->service_name;
+                break;
+            case ARCHIVE_TAG_ADDRESS:
+                field = (CFTypeRef *)&config->server_address;
+                break;
+            case ARCHIVE_TAG_USERNAME:
+                field = (CFTypeRef *)&config->username;
+                break;
+            case ARCHIVE_TAG_SEND_ALL_TRAFFIC:
+                field = (CFTypeRef *)&config->send_all_traffic;
+                break;
+            case ARCHIVE_TAG_PASSWORD:
+                field = (CFTypeRef *)&config->password;
+                break;
+            case ARCHIVE_TAG_SHARED_SECRET:
+                field = (CFTypeRef *)&config->shared_secret;
+                break;
+            default:
+                /* Fields added by later writers of the same version are skipped */
+                continue;
+        }
+        
+        CFTypeRef value;
+        if (tag == ARCHIVE_TAG_SEND_ALL_TRAFFIC) {
+            if (length != 1) {
+                goto exit;
+            }
+            value = CFRetain(buffer[0] ? kCFBooleanTrue : kCFBooleanFalse);
+        } else if (tag == ARCHIVE_TAG_PASSWORD || tag == ARCHIVE_TAG_SHARED_SECRET) {
+            if (keys == NULL) {
+                goto exit;
+            }
+            value = create_opened_secret(&arena, keys, buffer, length);
+        } else {
+            value = CFStringCreateWithBytes(NULL, buffer, length, kCFStringEncodingUTF8, FALSE);
+        }
+        
+        if (value == NULL) {
+            goto exit;
+        }
+        set_config_field(field, value);
+    }
+    
+    success = check_archive_mac(archive) && config->service_name != NULL && config->server_address != NULL;
+    
+exit:
+    memset_s(buffer, ARCHIVE_MAX_FIELD_LENGTH, 0, ARCHIVE_MAX_FIELD_LENGTH);
+    release_arena(&arena);
+    return success;
+}
+
+int
+run_import(const char *path, const char *passphrase_path)
+{
+    int err = 1;
+    Boolean from_stdin = (strcmp(path, "-") == 0);
+    
+    ArchiveKeys keys;
+    
+    FILE *file = from_stdin ? stdin : fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    
+    ArchiveStream archive = {
+        .file = file,
+        .keys = NULL,
+        .in_record = FALSE
+    };
+    
+    uint8_t *buffer = malloc(ARCHIVE_MAX_FIELD_LENGTH);
+    
+    if (!read_archive_header(&archive, passphrase_path, &keys)) {
+        goto free_buffer;
+    }
+    
+    VPNTransactionRef transaction = begin_vpn_transaction();
+    if (transaction == NULL) {
+        goto free_buffer;
+    }
+    
+    CFIndex count = 0;
+    for (;;) {
+        begin_archive_record(&archive, (uint32_t)count);
+        
+        uint8_t kind;
+        Boolean has_kind = read_bytes(&archive, &kind, sizeof(kind));
+        if (has_kind && kind == ARCHIVE_KIND_END) {
+            break;
+        }
+        
+        if (!has_kind || kind != ARCHIVE_KIND_SERVICE) {
+            fprintf(stderr, "Archive is truncated or corrupt after entry %ld\n", count);
+            goto end_transaction;
+        }
+        
+        L2TPConfig config = {NULL, NULL, NULL, NULL, NULL, NULL};
+        Boolean success = read_archive_entry(&archive, buffer, &config);
+        if (success) {
+            success = create_vpn_in_transaction(transaction, NULL, &config);
+        }
+        release_l2tp_config(&config);
+        
+        if (!success) {
+            fprintf(stderr, "Invalid archive entry at index %ld\n", count);
+            goto end_transaction;
+        }
+        
+        ++count;
+    }
+    
+    uint32_t stored_count;
+    if (!read_uint32(&archive, &stored_count) || !check_archive_mac(&archive) || stored_count != count) {
+        fprintf(stderr, "Archive is truncated or corrupt\n");
+        goto end_transaction;
+    }
+    
+    if (commit_vpn_transaction(transaction)) {
+        printf("Imported %ld VPN connections\n", count);
+        err = 0;
+    }
+    
+end_transaction:
+    end_vpn_transaction(transaction);
+free_buffer:
+    memset_s(&keys, sizeof(keys), 0, sizeof(keys));
+    free(buffer);
+    if (!from_stdin) {
+        fclose(file);
+    }
+    return err;
+}
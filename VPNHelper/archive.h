@@ -0,0 +1,24 @@
+#ifndef VPNHELPER_ARCHIVE_H
+#define VPNHELPER_ARCHIVE_H
+
+/* Writes every L2TP VPN connection to an archive that can be imported on
+ * another machine. Service IDs are not kept, since importing creates new
+ * services.
+ * @param path The path of the archive, or "-" to write to stdout.
+ * @param passphrase_path The path of a file whose first line is used to
+ *     encrypt the passwords and shared secrets, or NULL to leave the
+ *     secrets out of the archive.
+ * @result 0 if the archive was written, or 1 if anything failed.
+ */
+int run_export(const char *path, const char *passphrase_path);
+
+/* Creates a VPN connection for every entry in an archive, in a single
+ * transaction. The archive is read one entry at a time.
+ * @param path The path of the archive, or "-" to read from stdin.
+ * @param passphrase_path The path of a file whose first line is used to
+ *     decrypt the secrets. Required if the archive contains secrets.
+ * @result 0 if every connection was created, or 1 if anything failed.
+ */
+int run_import(const char *path, const char *passphrase_path);
+
+#endif
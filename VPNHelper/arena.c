@@ -0,0 +1,88 @@
+#define __STDC_WANT_LIB_EXT1__ 1
+#include "arena.h"
+#include <string.h>
+
+/* Allocations are aligned well enough for any type. */
+#define ARENA_ALIGNMENT 16
+
+/* The minimum size of a chunk allocated once the inline buffer is full. */
+#define ARENA_CHUNK_SIZE 4096
+
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t size;
+    char bytes[] __attribute__((aligned(ARENA_ALIGNMENT)));
+};
+
+void
+init_arena(Arena *arena)
+{
+    arena->chunks = NULL;
+    arena->base = arena->inline_bytes;
+    arena->size = ARENA_INLINE_SIZE;
+    arena->used = 0;
+}
+
+void *
+arena_alloc(Arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    
+    if (arena->size - arena->used < size) {
+        size_t chunk_size = (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE;
+        ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+        chunk->next = arena->chunks;
+        chunk->size = chunk_size;
+        arena->chunks = chunk;
+        
+        arena->base = chunk->bytes;
+        arena->size = chunk_size;
+        arena->used = 0;
+    }
+    
+    void *memory = arena->base + arena->used;
+    arena->used += size;
+    return memory;
+}
+
+const char *
+arena_copy_utf8_chars(Arena *arena, CFStringRef str)
+{
+    if (str == NULL) {
+        return NULL;
+    }
+    
+    const char *chars = CFStringGetCStringPtr(str, kCFStringEncodingUTF8);
+    if (chars != NULL) {
+        return chars;
+    }
+    
+    /* Measure the string first rather than allocating for the worst case,
+     * which is several times larger */
+    CFRange range = CFRangeMake(0, CFStringGetLength(str));
+    CFIndex length;
+    CFStringGetBytes(str, range, kCFStringEncodingUTF8, 0, FALSE, NULL, 0, &length);
+    
+    char *buffer = arena_alloc(arena, length + 1);
+    CFStringGetBytes(str, range, kCFStringEncodingUTF8, 0, FALSE, (UInt8 *)buffer, length, NULL);
+    buffer[length] = '\0';
+    return buffer;
+}
+
+void
+release_arena(Arena *arena)
+{
+    /* memset_s can't be optimized away, unlike a memset of memory that is
+     * about to be freed */
+    memset_s(arena->inline_bytes, ARENA_INLINE_SIZE, 0, ARENA_INLINE_SIZE);
+    
+    ArenaChunk *chunk = arena->chunks;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        memset_s(chunk->bytes, chunk->size, 0, chunk->size);
+        free(chunk);
+        chunk = next;
+    }
+    
+    init_arena(arena);
+}
@@ -0,0 +1,55 @@
+#ifndef VPNHELPER_ARENA_H
+#define VPNHELPER_ARENA_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/* The size of the buffer embedded in an arena. A keychain operation's
+ * strings and attributes normally fit in it, so no memory is allocated. */
+#define ARENA_INLINE_SIZE 1024
+
+typedef struct ArenaChunk ArenaChunk;
+
+/* Scratch memory for a single operation. Arenas are usually declared on the
+ * stack, and everything allocated from one is wiped and freed together by
+ * release_arena(), so buffers holding secrets don't need to be tracked. */
+typedef struct {
+    /* Chunks allocated once the inline buffer is full, newest first. */
+    ArenaChunk *chunks;
+    
+    /* The block currently being allocated from. */
+    char *base;
+    size_t size;
+    size_t used;
+    
+    char inline_bytes[ARENA_INLINE_SIZE] __attribute__((aligned(16)));
+} Arena;
+
+/* Prepares an arena for use.
+ * @param arena The arena to initialize.
+ */
+void init_arena(Arena *arena);
+
+/* Allocates memory from an arena. The memory is valid until the arena is
+ * released, and must not be freed on its own.
+ * @param arena The arena to allocate from.
+ * @param size The number of bytes to allocate.
+ * @result The allocated memory.
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/* Gets the UTF-8 contents of a string as a C string. If the string already
+ * stores them that way, they are returned without copying.
+ * @param arena The arena to allocate from if the string must be converted.
+ * @param str The string to convert. May be NULL.
+ * @result The C string, or NULL if str is NULL. It is valid until both the
+ *     arena and the string are released.
+ */
+const char *arena_copy_utf8_chars(Arena *arena, CFStringRef str);
+
+/* Zeroes everything allocated from an arena and frees its chunks. The arena
+ * may be used again afterwards.
+ * @param arena The arena to release.
+ */
+void release_arena(Arena *arena);
+
+#endif
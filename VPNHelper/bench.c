@@ -0,0 +1,446 @@
+#include "bench.h"
+#include "json.h"
+#include "snapshot.h"
+#include "trace.h"
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <mach/mach_time.h>
+#include <SystemConfiguration/SystemConfiguration.h>
+
+/* The size of each TCP write, and of the UDP server's receive buffer. */
+#define BENCH_BUFFER_SIZE 65536
+
+/* How long to wait for each UDP reply before counting it as lost. */
+#define BENCH_REPLY_TIMEOUT_MS 1000
+
+typedef struct {
+    uint32_t sequence;
+    uint64_t send_time;
+} BenchProbe;
+
+/* Looks up the interface a VPN connection is currently using, such as
+ * ppp0. Returns NULL if the connection isn't up. */
+char *
+copy_service_interface_name(CFStringRef service_id)
+{
+    char *name = NULL;
+    
+    SCDynamicStoreRef store = SCDynamicStoreCreate(NULL, CFSTR("VPNHelper"), NULL, NULL);
+    if (store == NULL) {
+        goto exit;
+    }
+    
+    CFStringRef key = SCDynamicStoreKeyCreateNetworkServiceEntity(NULL, kSCDynamicStoreDomainState, service_id, kSCEntNetIPv4);
+    CFDictionaryRef ipv4_state = SCDynamicStoreCopyValue(store, key);
+    CFRelease(key);
+    
+    if (ipv4_state == NULL) {
+        goto release_store;
+    }
+    
+    CFTypeRef interface_name = CFDictionaryGetValue(ipv4_state, kSCPropInterfaceName);
+    if (interface_name != NULL && CFGetTypeID(interface_name) == CFStringGetTypeID()) {
+        name = malloc(IFNAMSIZ);
+        if (!CFStringGetCString(interface_name, name, IFNAMSIZ, kCFStringEncodingUTF8)) {
+            free(name);
+            name = NULL;
+        }
+    }
+    
+    CFRelease(ipv4_state);
+release_store:
+    CFRelease(store);
+exit:
+    return name;
+}
+
+/* Opens a socket that is connected to the target and can only send
+ * through the given interface. A send that blocks for longer than the
+ * bench duration fails with EAGAIN, and writing to a closed connection
+ * fails with EPIPE instead of raising SIGPIPE. Returns -1 on failure. */
+int
+open_bench_socket(const BenchOptions *options, int type, unsigned int interface_index)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = type
+    };
+    
+    struct addrinfo *addresses;
+    int status = getaddrinfo(options->host, options->port, &hints, &addresses);
+    if (status != 0) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", options->host, gai_strerror(status));
+        return -1;
+    }
+    
+    int fd = -1;
+    for (struct addrinfo *address = addresses; address != NULL; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        
+        /* Binding to the interface makes the traffic take the tunnel even
+         * when it isn't the default route */
+        int bound;
+        if (address->ai_family == AF_INET6) {
+            bound = setsockopt(fd, IPPROTO_IPV6, IPV6_BOUND_IF, &interface_index, sizeof(interface_index));
+        } else {
+            bound = setsockopt(fd, IPPROTO_IP, IP_BOUND_IF, &interface_index, sizeof(interface_index));
+        }
+        
+        if (bound == 0 && connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+            int on = 1;
+            struct timeval timeout = {(time_t)ceil(options->duration), 0};
+            if (timeout.tv_sec < 1) {
+                timeout.tv_sec = 1;
+            }
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            break;
+        }
+        
+        close(fd);
+        fd = -1;
+    }
+    
+    if (fd < 0) {
+        perror("Failed to connect to bench target");
+    }
+    
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+/* Sends as much as possible for the configured duration, then waits for
+ * the server to say how much arrived. */
+Boolean
+run_tcp_bench(const BenchOptions *options, unsigned int interface_index, uint64_t *received, double *elapsed_ms)
+{
+    int fd = open_bench_socket(options, SOCK_STREAM, interface_index);
+    if (fd < 0) {
+        return FALSE;
+    }
+    
+    Boolean success = FALSE;
+    char *buffer = calloc(1, BENCH_BUFFER_SIZE);
+    uint64_t start_time = mach_absolute_time();
+    
+    while (mach_time_to_ms(mach_absolute_time() - start_time) < options->duration * 1000) {
+        ssize_t count = send(fd, buffer, BENCH_BUFFER_SIZE, 0);
+        if (count < 0 && errno == EPIPE) {
+            fprintf(stderr, "Bench server closed the connection\n");
+            goto close_socket;
+        }
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            fprintf(stderr, "Bench server stopped reading\n");
+            goto close_socket;
+        }
+        if (count < 0 && errno != EINTR) {
+            perror("Failed to send bench data");
+            goto close_socket;
+        }
+    }
+    
+    /* Data can still be in flight, so the clock runs until the server has
+     * acknowledged all of it */
+    shutdown(fd, SHUT_WR);
+    
+    uint8_t count_bytes[8];
+    size_t length = 0;
+    while (length < sizeof(count_bytes)) {
+        ssize_t count = recv(fd, count_bytes + length, sizeof(count_bytes) - length, 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            fprintf(stderr, "Bench server didn't report the amount received\n");
+            goto close_socket;
+        }
+        length += count;
+    }
+    
+    *elapsed_ms = mach_time_to_ms(mach_absolute_time() - start_time);
+    *received = 0;
+    for (int i = 0; i < 8; ++i) {
+        *received = (*received << 8) | count_bytes[i];
+    }
+    success = TRUE;
+    
+close_socket:
+    free(buffer);
+    close(fd);
+    return success;
+}
+
+/* Times request/response round trips one at a time. Replies that arrive
+ * after their timeout are ignored. Returns the number of replies. */
+int
+run_udp_bench(const BenchOptions *options, unsigned int interface_index, double *rtts)
+{
+    int fd = open_bench_socket(options, SOCK_DGRAM, interface_index);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    int replies = 0;
+    for (int i = 0; i < options->packets; ++i) {
+        BenchProbe probe = {
+            .sequence = (uint32_t)i,
+            .send_time = mach_absolute_time()
+        };
+        
+        if (send(fd, &probe, sizeof(probe), 0) < 0) {
+            perror("Failed to send bench probe");
+            continue;
+        }
+        
+        while (TRUE) {
+            double waited = mach_time_to_ms(mach_absolute_time() - probe.send_time);
+            if (waited >= BENCH_REPLY_TIMEOUT_MS) {
+                break;
+            }
+            
+            struct pollfd poll_fd = {fd, POLLIN, 0};
+            if (poll(&poll_fd, 1, (int)(BENCH_REPLY_TIMEOUT_MS - waited) + 1) <= 0) {
+                continue;
+            }
+            
+            BenchProbe reply;
+            if (recv(fd, &reply, sizeof(reply), 0) == sizeof(reply) && reply.sequence == probe.sequence) {
+                rtts[replies++] = mach_time_to_ms(mach_absolute_time() - probe.send_time);
+                break;
+            }
+        }
+    }
+    
+    close(fd);
+    return replies;
+}
+
+int
+compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Uses the nearest-rank method, so the result is always a measured value. */
+double
+get_percentile(const double *sorted, int count, double percentile)
+{
+    int rank = (int)ceil(percentile * count);
+    return sorted[(rank > 0) ? rank - 1 : 0];
+}
+
+void
+set_bench_number(CFMutableDictionaryRef results, CFStringRef key, double value)
+{
+    CFNumberRef number = CFNumberCreate(NULL, kCFNumberDoubleType, &value);
+    CFDictionarySetValue(results, key, number);
+    CFRelease(number);
+}
+
+int
+run_bench(const BenchOptions *options, CFStringRef service_id)
+{
+    int err = 1;
+    
+    char *interface = (options->interface != NULL) ? strdup(options->interface) : copy_service_interface_name(service_id);
+    if (interface == NULL) {
+        fprintf(stderr, "VPN service is not connected\n");
+        goto exit;
+    }
+    
+    unsigned int interface_index = if_nametoindex(interface);
+    if (interface_index == 0) {
+        fprintf(stderr, "No such interface: %s\n", interface);
+        goto free_interface;
+    }
+    
+    uint64_t received;
+    double elapsed_ms;
+    if (!run_tcp_bench(options, interface_index, &received, &elapsed_ms)) {
+        goto free_interface;
+    }
+    
+    double *rtts = calloc(options->packets + 1, sizeof(double));
+    int replies = run_udp_bench(options, interface_index, rtts);
+    if (replies < 0) {
+        goto free_rtts;
+    }
+    
+    CFMutableDictionaryRef results = CFDictionaryCreateMutable(
+        NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+    );
+    
+    CFStringRef interface_str = CFStringCreateWithCString(NULL, interface, kCFStringEncodingUTF8);
+    CFDictionarySetValue(results, CFSTR("interface"), interface_str);
+    CFRelease(interface_str);
+    
+    /* Include the settings that affect the results, so runs can be compared */
+    if (service_id != NULL) {
+        CFDictionarySetValue(results, CFSTR("id"), service_id);
+        
+        CFArrayRef vpn_list = copy_vpn_snapshot();
+        CFDictionaryRef description = (vpn_list == NULL) ? NULL : find_vpn_description(vpn_list, service_id);
+        CFTypeRef send_all_traffic = (description == NULL) ? NULL : CFDictionaryGetValue(description, CFSTR("send_all_traffic"));
+        if (send_all_traffic != NULL) {
+            CFDictionarySetValue(results, CFSTR("send_all_traffic"), send_all_traffic);
+        }
+        if (vpn_list != NULL) {
+            CFRelease(vpn_list);
+        }
+    }
+    
+    set_bench_number(results, CFSTR("tcp_bytes"), (double)received);
+    set_bench_number(results, CFSTR("tcp_mbps"), received * 8 / (elapsed_ms * 1000));
+    set_bench_number(results, CFSTR("udp_loss"), 1 - (double)replies / options->packets);
+    
+    if (replies > 0) {
+        /* Jitter is the mean difference between consecutive round trips,
+         * so it has to be taken before sorting */
+        double jitter = 0;
+        for (int i = 1; i < replies; ++i) {
+            jitter += fabs(rtts[i] - rtts[i - 1]);
+        }
+        if (replies > 1) {
+            jitter /= replies - 1;
+        }
+        
+        qsort(rtts, replies, sizeof(double), compare_doubles);
+        set_bench_number(results, CFSTR("rtt_p50_ms"), get_percentile(rtts, replies, 0.5));
+        set_bench_number(results, CFSTR("rtt_p99_ms"), get_percentile(rtts, replies, 0.99));
+        set_bench_number(results, CFSTR("jitter_ms"), jitter);
+    }
+    
+    write_json_value(stdout, results);
+    printf("\n");
+    CFRelease(results);
+    err = 0;
+    
+free_rtts:
+    free(rtts);
+free_interface:
+    free(interface);
+exit:
+    return err;
+}
+
+/* Opens a socket listening on every address. Returns -1 on failure. */
+int
+open_bench_server_socket(const char *port, int type)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_INET6,
+        .ai_socktype = type,
+        .ai_flags = AI_PASSIVE
+    };
+    
+    struct addrinfo *address;
+    int status = getaddrinfo(NULL, port, &hints, &address);
+    if (status != 0) {
+        fprintf(stderr, "Invalid port %s: %s\n", port, gai_strerror(status));
+        return -1;
+    }
+    
+    int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd < 0) {
+        perror("socket");
+        goto free_address;
+    }
+    
+    /* Accept IPv4 clients too, through mapped addresses */
+    int off = 0;
+    int on = 1;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    
+    if (bind(fd, address->ai_addr, address->ai_addrlen) < 0 || (type == SOCK_STREAM && listen(fd, 4) < 0)) {
+        perror("Failed to listen");
+        close(fd);
+        fd = -1;
+    }
+    
+free_address:
+    freeaddrinfo(address);
+    return fd;
+}
+
+int
+run_bench_server(const char *port)
+{
+    int tcp_fd = open_bench_server_socket(port, SOCK_STREAM);
+    int udp_fd = open_bench_server_socket(port, SOCK_DGRAM);
+    if (tcp_fd < 0 || udp_fd < 0) {
+        return 1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    char *buffer = malloc(BENCH_BUFFER_SIZE);
+    
+    /* Clients are served one at a time, so a UDP run never competes with
+     * another client's bulk transfer */
+    int client_fd = -1;
+    uint64_t received = 0;
+    
+    while (TRUE) {
+        struct pollfd poll_fds[2] = {
+            {udp_fd, POLLIN, 0},
+            {(client_fd >= 0) ? client_fd : tcp_fd, POLLIN, 0}
+        };
+        
+        if (poll(poll_fds, 2, -1) < 0) {
+            continue;
+        }
+        
+        if (poll_fds[0].revents & POLLIN) {
+            struct sockaddr_storage from;
+            socklen_t from_length = sizeof(from);
+            ssize_t count = recvfrom(udp_fd, buffer, BENCH_BUFFER_SIZE, 0, (struct sockaddr *)&from, &from_length);
+            if (count > 0) {
+                sendto(udp_fd, buffer, count, 0, (struct sockaddr *)&from, from_length);
+            }
+        }
+        
+        if (!(poll_fds[1].revents & (POLLIN | POLLHUP))) {
+            continue;
+        }
+        
+        if (client_fd < 0) {
+            client_fd = accept(tcp_fd, NULL, NULL);
+            received = 0;
+            continue;
+        }
+        
+        ssize_t count = recv(client_fd, buffer, BENCH_BUFFER_SIZE, 0);
+        if (count > 0) {
+            received += count;
+            continue;
+        }
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        
+        /* The client has finished sending, so tell it how much arrived */
+        if (count == 0) {
+            uint8_t count_bytes[8];
+            for (int i = 0; i < 8; ++i) {
+                count_bytes[i] = (uint8_t)(received >> (56 - 8 * i));
+            }
+            send(client_fd, count_bytes, sizeof(count_bytes), 0);
+        }
+        
+        close(client_fd);
+        client_fd = -1;
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef VPNHELPER_BENCH_H
+#define VPNHELPER_BENCH_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/* The port that bench and bench-server use if none is given. */
+#define DEFAULT_BENCH_PORT "5201"
+
+typedef struct {
+    /* The host running bench-server, and its port. */
+    const char *host;
+    const char *port;
+    
+    /* The interface to send through, or NULL to use the interface of the
+     * VPN connection being measured. */
+    const char *interface;
+    
+    /* How long to send bulk TCP data for, in seconds. */
+    double duration;
+    
+    /* How many UDP round trips to time. */
+    int packets;
+} BenchOptions;
+
+/* Measures a tunnel by sending traffic through its interface to a host
+ * running bench-server: TCP bulk throughput, then the round trip time,
+ * jitter and loss of UDP requests. The results are printed as a JSON
+ * object. UDP timing works against any UDP echo service, but throughput
+ * needs bench-server, which reports how much data actually arrived.
+ * @param options What to measure, and how.
+ * @param service_id The service ID of a connected VPN connection whose
+ *     interface to use, or NULL if options names one.
+ * @result Nonzero on failure.
+ */
+int run_bench(const BenchOptions *options, CFStringRef service_id);
+
+/* Orders doubles from smallest to largest, for qsort(). */
+int compare_doubles(const void *a, const void *b);
+
+/* Gets a percentile of a set of samples using the nearest-rank method, so
+ * the result is always one of the samples.
+ * @param sorted The samples, from smallest to largest.
+ * @param count The number of samples. Must be positive.
+ * @param percentile The percentile, between 0 and 1.
+ * @result The sample at that rank.
+ */
+double get_percentile(const double *sorted, int count, double percentile);
+
+/* Stores a number in a dictionary of results.
+ * @param results The dictionary to store it in.
+ * @param key The key to store it under.
+ * @param value The number.
+ */
+void set_bench_number(CFMutableDictionaryRef results, CFStringRef key, double value);
+
+/* Runs the other end of run_bench(): a TCP sink that reports how many bytes
+ * it received, and a UDP echo service, both on the same port. Does not
+ * return unless the sockets could not be set up.
+ * @param port The port to listen on.
+ * @result Nonzero on failure.
+ */
+int run_bench_server(const char *port);
+
+#endif
@@ -0,0 +1,103 @@
+#include "cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+
+void
+make_cache_path(const char *name, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%s", CACHE_DIRECTORY, name);
+}
+
+CFPropertyListRef
+copy_cache(const char *name)
+{
+    char path[PATH_MAX];
+    make_cache_path(name, path, sizeof(path));
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    CFPropertyListRef value = NULL;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        goto close_file;
+    }
+    
+    CFMutableDataRef data = CFDataCreateMutable(NULL, st.st_size);
+    CFDataSetLength(data, st.st_size);
+    
+    if (read(fd, CFDataGetMutableBytePtr(data), st.st_size) == st.st_size) {
+        value = CFPropertyListCreateWithData(NULL, data, kCFPropertyListImmutable, NULL, NULL);
+    }
+    
+    CFRelease(data);
+close_file:
+    close(fd);
+    return value;
+}
+
+Boolean
+write_cache(const char *name, CFPropertyListRef value)
+{
+    Boolean success = FALSE;
+    
+    if (mkdir(CACHE_DIRECTORY, 0700) != 0 && errno != EEXIST) {
+        perror(CACHE_DIRECTORY);
+        goto exit;
+    }
+    
+    CFDataRef data = CFPropertyListCreateData(NULL, value, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+    if (data == NULL) {
+        fprintf(stderr, "Failed to serialize cache %s\n", name);
+        goto exit;
+    }
+    
+    char path[PATH_MAX];
+    char temp_path[PATH_MAX];
+    make_cache_path(name, path, sizeof(path));
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+    
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        perror(temp_path);
+        goto release_data;
+    }
+    
+    CFIndex length = CFDataGetLength(data);
+    Boolean written = (write(fd, CFDataGetBytePtr(data), length) == length);
+    close(fd);
+    
+    if (!written || rename(temp_path, path) != 0) {
+        perror(path);
+        unlink(temp_path);
+        goto release_data;
+    }
+    
+    success = TRUE;
+    
+release_data:
+    CFRelease(data);
+exit:
+    return success;
+}
+
+CFStringRef
+copy_os_build_version(void)
+{
+    char version[64];
+    size_t size = sizeof(version);
+    
+    if (sysctlbyname("kern.osversion", version, &size, NULL, 0) != 0) {
+        return CFRetain(CFSTR("unknown"));
+    }
+    
+    return CFStringCreateWithCString(NULL, version, kCFStringEncodingUTF8);
+}
@@ -0,0 +1,32 @@
+#ifndef VPNHELPER_CACHE_H
+#define VPNHELPER_CACHE_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/* The directory that on-disk caches are kept in. Only root may read it,
+ * since some caches describe the keychain. */
+#define CACHE_DIRECTORY "/var/db/VPNHelper"
+
+/* Loads a property list previously stored with write_cache().
+ * @param name The file name of the cache within CACHE_DIRECTORY.
+ * @result The cached value, or NULL if there is no usable cache. The caller
+ *     is responsible for releasing the value.
+ */
+CFPropertyListRef copy_cache(const char *name);
+
+/* Stores a property list in a cache file. The file is replaced atomically,
+ * so concurrent readers see either the old or the new contents.
+ * @param name The file name of the cache within CACHE_DIRECTORY.
+ * @param value The value to store.
+ * @result TRUE if the operation is successful; FALSE otherwise.
+ */
+Boolean write_cache(const char *name, CFPropertyListRef value);
+
+/* Gets the build version of the running operating system, which changes
+ * with every OS update.
+ * @result The build version, e.g. "14F27". The caller is responsible for
+ *     releasing it.
+ */
+CFStringRef copy_os_build_version(void);
+
+#endif
@@ -0,0 +1,441 @@
+#include "coalesce.h"
+#include "json.h"
+#include "trace.h"
+#include "vpn.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+/* Queue files are named after the process that queued the operation and a
+ * counter. An operation is queued as NAME.req, renamed to NAME.work when a
+ * leader claims it, and its result is written to NAME.res. Files are
+ * written under a temporary name and renamed, so a partial one is never
+ * read. */
+#define COALESCE_LOCK_NAME "leader.lock"
+#define REQUEST_SUFFIX ".req"
+#define CLAIMED_SUFFIX ".work"
+#define RESULT_SUFFIX ".res"
+#define MAX_QUEUE_NAME_LENGTH 64
+
+/* The most operations a leader performs in one transaction. */
+#define COALESCE_MAX_BATCH 256
+
+unsigned int queued_operation_count = 0;
+
+void
+make_queue_path(const char *name, const char *suffix, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%s%s", COALESCE_DIRECTORY, name, suffix);
+}
+
+/* Creates the queue directory, and checks that nobody but root could have
+ * put operations in it, since they are performed with our privileges. */
+Boolean
+prepare_queue_directory(void)
+{
+    if (mkdir(COALESCE_DIRECTORY, 0700) != 0 && errno != EEXIST) {
+        perror(COALESCE_DIRECTORY);
+        return FALSE;
+    }
+    
+    struct stat st;
+    if (lstat(COALESCE_DIRECTORY, &st) != 0) {
+        perror(COALESCE_DIRECTORY);
+        return FALSE;
+    }
+    
+    if (!S_ISDIR(st.st_mode) || st.st_uid != 0 || (st.st_mode & 077) != 0) {
+        fprintf(stderr, "%s must be a directory that only root can access\n", COALESCE_DIRECTORY);
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+Boolean
+write_queue_file(const char *name, const char *suffix, CFTypeRef value)
+{
+    char path[PATH_MAX];
+    char temp_path[PATH_MAX];
+    make_queue_path(name, suffix, path, sizeof(path));
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    
+    FILE *file = fopen(temp_path, "w");
+    if (file == NULL) {
+        perror(temp_path);
+        return FALSE;
+    }
+    
+    write_json_value(file, value);
+    fputc('\n', file);
+    
+    Boolean written = !ferror(file);
+    if (fclose(file) != 0) {
+        written = FALSE;
+    }
+    
+    if (!written || rename(temp_path, path) != 0) {
+        perror(path);
+        unlink(temp_path);
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+Boolean
+has_suffix(const char *str, const char *suffix)
+{
+    size_t length = strlen(str);
+    size_t suffix_length = strlen(suffix);
+    return length > suffix_length && strcmp(str + length - suffix_length, suffix) == 0;
+}
+
+/* Removes operations claimed by a leader that exited before finishing
+ * them, and the files of processes that are no longer waiting. Only call
+ * this while holding the lock. */
+void
+remove_abandoned_queue_files(void)
+{
+    DIR *dir = opendir(COALESCE_DIRECTORY);
+    if (dir == NULL) {
+        return;
+    }
+    
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || strcmp(entry->d_name, COALESCE_LOCK_NAME) == 0) {
+            continue;
+        }
+        
+        pid_t owner = (pid_t)atoi(entry->d_name);
+        Boolean owner_exited = (owner > 0 && kill(owner, 0) != 0 && errno == ESRCH);
+        
+        if (has_suffix(entry->d_name, CLAIMED_SUFFIX) || owner_exited) {
+            char path[PATH_MAX];
+            make_queue_path(entry->d_name, "", path, sizeof(path));
+            unlink(path);
+        }
+    }
+    
+    closedir(dir);
+}
+
+int
+compare_queue_names(const void *a, const void *b)
+{
+    return strcmp(a, b);
+}
+
+/* Lists up to COALESCE_MAX_BATCH queued operations, without their suffix. */
+CFIndex
+list_queued_operations(char names[][MAX_QUEUE_NAME_LENGTH])
+{
+    DIR *dir = opendir(COALESCE_DIRECTORY);
+    if (dir == NULL) {
+        perror(COALESCE_DIRECTORY);
+        return 0;
+    }
+    
+    CFIndex count = 0;
+    struct dirent *entry;
+    while (count < COALESCE_MAX_BATCH && (entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name) - strlen(REQUEST_SUFFIX);
+        if (has_suffix(entry->d_name, REQUEST_SUFFIX) && length < MAX_QUEUE_NAME_LENGTH) {
+            memcpy(names[count], entry->d_name, length);
+            names[count][length] = '\0';
+            count++;
+        }
+    }
+    
+    closedir(dir);
+    
+    qsort(names, count, MAX_QUEUE_NAME_LENGTH, compare_queue_names);
+    return count;
+}
+
+/* A queued request from one process: one or more operations that succeed
+ * or fail together. */
+typedef struct {
+    /* The parsed request file, which owns the operations' strings. */
+    CFTypeRef object;
+    
+    VPNOperation *operations;
+    CFIndex count;
+    
+    /* Whether the request was claimed and could be read. */
+    Boolean valid;
+    
+    Boolean succeeded;
+    
+    /* The IDs handed to the shared transaction, and the results. */
+    CFStringRef *staged_ids;
+    CFStringRef *result_ids;
+} QueuedRequest;
+
+/* Reads a request file, which holds a JSON array of operations as accepted
+ * by read_vpn_operation(). */
+Boolean
+read_queued_request(const char *path, QueuedRequest *request)
+{
+    request->object = create_json_value_from_file(path);
+    if (request->object == NULL || CFGetTypeID(request->object) != CFArrayGetTypeID()) {
+        return FALSE;
+    }
+    
+    CFIndex count = CFArrayGetCount(request->object);
+    if (count == 0) {
+        return FALSE;
+    }
+    
+    request->operations = calloc(count, sizeof(VPNOperation));
+    request->staged_ids = calloc(count, sizeof(CFStringRef));
+    request->result_ids = calloc(count, sizeof(CFStringRef));
+    request->count = count;
+    
+    for (CFIndex i = 0; i < count; ++i) {
+        CFTypeRef object = CFArrayGetValueAtIndex(request->object, i);
+        if (CFGetTypeID(object) != CFDictionaryGetTypeID() || !read_vpn_operation(object, &request->operations[i])) {
+            return FALSE;
+        }
+    }
+    
+    return TRUE;
+}
+
+void
+write_queued_result(const char *name, QueuedRequest *request)
+{
+    CFMutableArrayRef ids = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    for (CFIndex i = 0; i < request->count; ++i) {
+        CFStringRef result_id = request->result_ids[i];
+        CFArrayAppendValue(ids, (request->succeeded && result_id != NULL) ? (CFTypeRef)result_id : kCFNull);
+    }
+    
+    const void *keys[2] = {CFSTR("ok"), CFSTR("ids")};
+    const void *values[2] = {request->succeeded ? kCFBooleanTrue : kCFBooleanFalse, ids};
+    CFDictionaryRef result = CFDictionaryCreate(NULL, keys, values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    write_queue_file(name, RESULT_SUFFIX, result);
+    CFRelease(result);
+    CFRelease(ids);
+}
+
+void
+release_queued_request(QueuedRequest *request)
+{
+    for (CFIndex i = 0; i < request->count; ++i) {
+        if (request->result_ids[i] != NULL) {
+            CFRelease(request->result_ids[i]);
+        }
+        
+        /* IDs of new services were created for us; edited IDs are borrowed */
+        if (request->operations[i].type == VPNOperationCreate && request->staged_ids[i] != NULL) {
+            CFRelease(request->staged_ids[i]);
+        }
+    }
+    
+    free(request->result_ids);
+    free(request->staged_ids);
+    free(request->operations);
+    if (request->object != NULL) {
+        CFRelease(request->object);
+    }
+}
+
+/* Claims a batch of queued requests, performs them in a single transaction
+ * and writes their results. Only call this while holding the lock.
+ * @result The number of requests claimed. */
+CFIndex
+perform_queued_operations(void)
+{
+    char (*names)[MAX_QUEUE_NAME_LENGTH] = calloc(COALESCE_MAX_BATCH, MAX_QUEUE_NAME_LENGTH);
+    CFIndex count = list_queued_operations(names);
+    
+    QueuedRequest *requests = calloc(count + 1, sizeof(QueuedRequest));
+    CFIndex claimed_count = 0;
+    CFIndex valid_count = 0;
+    
+    /* Claiming a request before performing it means it is never performed
+     * twice, even if this process exits partway through */
+    for (CFIndex i = 0; i < count; ++i) {
+        char request_path[PATH_MAX];
+        char claimed_path[PATH_MAX];
+        make_queue_path(names[i], REQUEST_SUFFIX, request_path, sizeof(request_path));
+        make_queue_path(names[i], CLAIMED_SUFFIX, claimed_path, sizeof(claimed_path));
+        
+        if (rename(request_path, claimed_path) != 0) {
+            perror(request_path);
+            names[i][0] = '\0';
+            continue;
+        }
+        claimed_count++;
+        
+        requests[i].valid = read_queued_request(claimed_path, &requests[i]);
+        if (requests[i].valid) {
+            valid_count++;
+        }
+    }
+    
+    if (valid_count > 0) {
+        Boolean committed = FALSE;
+        Boolean store_changed = FALSE;
+        
+        VPNTransactionRef transaction = begin_vpn_transaction();
+        if (transaction != NULL) {
+            for (CFIndex i = 0; i < count; ++i) {
+                QueuedRequest *request = &requests[i];
+                for (CFIndex j = 0; request->valid && j < request->count; ++j) {
+                    VPNOperation *operation = &request->operations[j];
+                    request->staged_ids[j] = operation->service_id;
+                    if (operation->type == VPNOperationDelete) {
+                        delete_vpn_in_transaction(transaction, request->staged_ids[j]);
+                    } else {
+                        create_vpn_in_transaction(transaction, &request->staged_ids[j], &operation->config);
+                    }
+                }
+            }
+            
+            committed = commit_vpn_transaction(transaction);
+            store_changed = is_vpn_transaction_committed(transaction);
+            end_vpn_transaction(transaction);
+        }
+        
+        for (CFIndex i = 0; i < count; ++i) {
+            QueuedRequest *request = &requests[i];
+            if (!request->valid) {
+                continue;
+            }
+            
+            if (committed) {
+                request->succeeded = TRUE;
+                for (CFIndex j = 0; j < request->count; ++j) {
+                    request->result_ids[j] = (request->staged_ids[j] != NULL) ? CFRetain(request->staged_ids[j]) : NULL;
+                }
+            } else if (!store_changed && valid_count > 1) {
+                /* Nothing was committed, so find out which requests
+                 * actually fail. Once something has been committed,
+                 * retrying could create services twice, so the whole batch
+                 * fails instead. */
+                request->succeeded = perform_vpn_operations(request->operations, request->count, request->result_ids);
+            }
+        }
+    }
+    
+    for (CFIndex i = 0; i < count; ++i) {
+        if (names[i][0] == '\0') {
+            continue;
+        }
+        
+        write_queued_result(names[i], &requests[i]);
+        
+        char claimed_path[PATH_MAX];
+        make_queue_path(names[i], CLAIMED_SUFFIX, claimed_path, sizeof(claimed_path));
+        unlink(claimed_path);
+        
+        release_queued_request(&requests[i]);
+    }
+    
+    free(requests);
+    free(names);
+    return claimed_count;
+}
+
+Boolean
+perform_coalesced_vpn_operations(const VPNOperation *operations, CFIndex count, CFStringRef *service_ids)
+{
+    Boolean success = FALSE;
+    
+    if (service_ids != NULL) {
+        for (CFIndex i = 0; i < count; ++i) {
+            service_ids[i] = NULL;
+        }
+    }
+    
+    if (!prepare_queue_directory()) {
+        goto exit;
+    }
+    
+    char name[MAX_QUEUE_NAME_LENGTH];
+    snprintf(name, sizeof(name), "%d-%u", getpid(), queued_operation_count++);
+    
+    char request_path[PATH_MAX];
+    char result_path[PATH_MAX];
+    char lock_path[PATH_MAX];
+    make_queue_path(name, REQUEST_SUFFIX, request_path, sizeof(request_path));
+    make_queue_path(name, RESULT_SUFFIX, result_path, sizeof(result_path));
+    make_queue_path(COALESCE_LOCK_NAME, "", lock_path, sizeof(lock_path));
+    
+    CFMutableArrayRef objects = CFArrayCreateMutable(NULL, count, &kCFTypeArrayCallBacks);
+    for (CFIndex i = 0; i < count; ++i) {
+        CFDictionaryRef object = create_vpn_operation_object(&operations[i]);
+        CFArrayAppendValue(objects, object);
+        CFRelease(object);
+    }
+    Boolean queued = write_queue_file(name, REQUEST_SUFFIX, objects);
+    CFRelease(objects);
+    
+    if (!queued) {
+        goto exit;
+    }
+    
+    /* Blocks for as long as another process is leading */
+    uint64_t start_time = trace_begin();
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT, 0600);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0) {
+        perror(lock_path);
+        unlink(request_path);
+        goto close_lock;
+    }
+    trace_end("coalesce_wait", start_time);
+    
+    /* Whoever led while we waited has usually performed it already */
+    if (access(result_path, F_OK) != 0) {
+        if (access(request_path, F_OK) != 0) {
+            fprintf(stderr, "Queued operation was claimed by a process that exited before finishing it\n");
+            goto close_lock;
+        }
+        
+        start_time = trace_begin();
+        remove_abandoned_queue_files();
+        while (perform_queued_operations() > 0) {
+        }
+        trace_end("coalesce_lead", start_time);
+    }
+    
+    CFTypeRef result = create_json_value_from_file(result_path);
+    unlink(result_path);
+    if (result == NULL) {
+        goto close_lock;
+    }
+    
+    if (CFGetTypeID(result) == CFDictionaryGetTypeID()) {
+        success = (CFDictionaryGetValue(result, CFSTR("ok")) == kCFBooleanTrue);
+        
+        CFTypeRef result_ids = CFDictionaryGetValue(result, CFSTR("ids"));
+        if (success && service_ids != NULL && result_ids != NULL && CFGetTypeID(result_ids) == CFArrayGetTypeID()) {
+            for (CFIndex i = 0; i < count && i < CFArrayGetCount(result_ids); ++i) {
+                CFTypeRef result_id = CFArrayGetValueAtIndex(result_ids, i);
+                if (CFGetTypeID(result_id) == CFStringGetTypeID()) {
+                    service_ids[i] = CFRetain(result_id);
+                }
+            }
+        }
+    }
+    
+    CFRelease(result);
+    
+close_lock:
+    if (lock_fd >= 0) {
+        close(lock_fd);
+    }
+exit:
+    return success;
+}
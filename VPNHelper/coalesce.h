@@ -0,0 +1,32 @@
+#ifndef VPNHELPER_COALESCE_H
+#define VPNHELPER_COALESCE_H
+
+#include "manifest.h"
+#include <CoreFoundation/CoreFoundation.h>
+
+/* The directory that concurrent invocations queue operations in. It is
+ * cleared when the machine restarts. */
+#define COALESCE_DIRECTORY "/var/run/VPNHelper"
+
+/* Performs operations together with those of other processes running at
+ * the same time. The operations are queued as one JSON file (an array of
+ * the objects read by read_vpn_operation()), then the process waits for a
+ * lock file. Whichever process holds the lock is the leader: it performs
+ * every queued operation in a single transaction, writes each file's
+ * result back to the queue, and keeps going until the queue is empty. A
+ * process that gets the lock and finds its result already written just
+ * reads it. If the shared transaction fails without committing anything,
+ * the leader retries each file's operations in a transaction of their own,
+ * so one bad request doesn't fail the others; if it fails after committing,
+ * every request in it fails. The operations of one call succeed or fail
+ * together.
+ * @param operations The operations to perform.
+ * @param count The number of operations.
+ * @param service_ids Receives the service ID of the VPN connection that each
+ *     operation created, modified or deleted, or NULL. May be NULL. The
+ *     caller is responsible for releasing them.
+ * @result TRUE if every operation is successful; FALSE otherwise.
+ */
+Boolean perform_coalesced_vpn_operations(const VPNOperation *operations, CFIndex count, CFStringRef *service_ids);
+
+#endif
@@ -0,0 +1,256 @@
+#include "connection.h"
+#include "trace.h"
+#include <stdio.h>
+#include <mach/mach_time.h>
+#include <SystemConfiguration/SystemConfiguration.h>
+
+typedef enum {
+    ConnectionPending,
+    ConnectionSucceeded,
+    ConnectionFailed
+} ConnectionResult;
+
+typedef struct {
+    /* The service ID of the VPN connection. */
+    CFStringRef service_id;
+    
+    /* The connection, once it has been started. */
+    SCNetworkConnectionRef connection;
+    
+    /* Whether we are connecting or disconnecting. */
+    Boolean connect;
+    
+    /* Whether the request has been made. */
+    Boolean entered;
+    
+    /* Whether the connection has left its initial state yet. */
+    Boolean started;
+    
+    /* The outcome, which stays pending until the final status arrives. */
+    ConnectionResult result;
+    
+    /* The status that decided the outcome. */
+    SCNetworkConnectionStatus final_status;
+    
+    /* When the request was made and when it finished, in mach time units. */
+    uint64_t start_time;
+    uint64_t end_time;
+    
+    /* Signalled when the outcome is known. */
+    dispatch_group_t group;
+    dispatch_semaphore_t slots;
+} ConnectionTask;
+
+void
+finish_connection_task(ConnectionTask *task, ConnectionResult result, SCNetworkConnectionStatus status)
+{
+    if (task->result != ConnectionPending) {
+        return;
+    }
+    
+    task->result = result;
+    task->final_status = status;
+    task->end_time = mach_absolute_time();
+    
+    dispatch_semaphore_signal(task->slots);
+    dispatch_group_leave(task->group);
+}
+
+void
+connection_status_changed(SCNetworkConnectionRef connection, SCNetworkConnectionStatus status, void *info)
+{
+    ConnectionTask *task = info;
+    
+    if (task->connect) {
+        if (status == kSCNetworkConnectionConnected) {
+            finish_connection_task(task, ConnectionSucceeded, status);
+        } else if (status == kSCNetworkConnectionConnecting) {
+            task->started = TRUE;
+        } else if (status == kSCNetworkConnectionDisconnected && task->started) {
+            finish_connection_task(task, ConnectionFailed, status);
+        } else if (status == kSCNetworkConnectionInvalid) {
+            finish_connection_task(task, ConnectionFailed, status);
+        }
+    } else {
+        if (status == kSCNetworkConnectionDisconnected) {
+            finish_connection_task(task, ConnectionSucceeded, status);
+        } else if (status == kSCNetworkConnectionInvalid) {
+            finish_connection_task(task, ConnectionFailed, status);
+        }
+    }
+}
+
+/* Runs on the callback queue so that it can't race with status callbacks. */
+void
+start_connection_task(void *info)
+{
+    ConnectionTask *task = info;
+    
+    SCNetworkConnectionStatus status = SCNetworkConnectionGetStatus(task->connection);
+    if (task->connect && status == kSCNetworkConnectionConnected) {
+        finish_connection_task(task, ConnectionSucceeded, status);
+        return;
+    }
+    if (!task->connect && status == kSCNetworkConnectionDisconnected) {
+        finish_connection_task(task, ConnectionSucceeded, status);
+        return;
+    }
+    
+    Boolean success;
+    if (task->connect) {
+        /* Linger so the tunnel outlives this process */
+        success = SCNetworkConnectionStart(task->connection, NULL, TRUE);
+    } else {
+        success = SCNetworkConnectionStop(task->connection, TRUE);
+    }
+    
+    if (success) {
+        task->started = TRUE;
+    } else {
+        fprintf(stderr, "Failed to %s VPN: %s (%d)\n", task->connect ? "start" : "stop", SCErrorString(SCError()), SCError());
+        finish_connection_task(task, ConnectionFailed, status);
+    }
+}
+
+/* Runs on the callback queue once we have stopped waiting. */
+void
+detach_connection_task(void *info)
+{
+    ConnectionTask *task = info;
+    SCNetworkConnectionSetDispatchQueue(task->connection, NULL);
+}
+
+int
+get_connection_last_cause(SCNetworkConnectionRef connection)
+{
+    int last_cause = 0;
+    
+    CFDictionaryRef status = SCNetworkConnectionCopyExtendedStatus(connection);
+    if (status == NULL) {
+        return last_cause;
+    }
+    
+    CFTypeRef ppp_status = CFDictionaryGetValue(status, kSCEntNetPPP);
+    if (ppp_status != NULL && CFGetTypeID(ppp_status) == CFDictionaryGetTypeID()) {
+        CFTypeRef cause = CFDictionaryGetValue(ppp_status, kSCPropNetPPPLastCause);
+        if (cause != NULL && CFGetTypeID(cause) == CFNumberGetTypeID()) {
+            CFNumberGetValue(cause, kCFNumberIntType, &last_cause);
+        }
+    }
+    
+    CFRelease(status);
+    return last_cause;
+}
+
+void
+print_connection_task(ConnectionTask *task)
+{
+    char service_id[256];
+    if (!CFStringGetCString(task->service_id, service_id, sizeof(service_id), kCFStringEncodingUTF8)) {
+        service_id[0] = '\0';
+    }
+    
+    const char *state = task->connect ? "connected" : "disconnected";
+    
+    switch (task->result) {
+        case ConnectionSucceeded:
+            printf("%s: %s in %.0f ms\n", service_id, state, mach_time_to_ms(task->end_time - task->start_time));
+            break;
+        case ConnectionFailed:
+            if (task->connection != NULL) {
+                printf("%s: failed with status %d (last cause %d)\n", service_id, task->final_status, get_connection_last_cause(task->connection));
+            } else {
+                printf("%s: failed\n", service_id);
+            }
+            break;
+        case ConnectionPending:
+            printf("%s: timed out\n", service_id);
+            break;
+    }
+}
+
+Boolean
+change_vpn_connections(CFArrayRef service_ids, Boolean connect, int max_concurrent, double timeout)
+{
+    CFIndex count = CFArrayGetCount(service_ids);
+    if (max_concurrent <= 0 || max_concurrent > count) {
+        max_concurrent = (int)count;
+    }
+    
+    dispatch_queue_t queue = dispatch_queue_create("VPNHelper.connection", DISPATCH_QUEUE_SERIAL);
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_semaphore_t slots = dispatch_semaphore_create(max_concurrent);
+    dispatch_time_t deadline = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC));
+    
+    ConnectionTask *tasks = calloc(count + 1, sizeof(ConnectionTask));
+    for (CFIndex i = 0; i < count; ++i) {
+        tasks[i].service_id = CFArrayGetValueAtIndex(service_ids, i);
+        tasks[i].connect = connect;
+        tasks[i].result = ConnectionPending;
+        tasks[i].group = group;
+        tasks[i].slots = slots;
+    }
+    
+    for (CFIndex i = 0; i < count; ++i) {
+        ConnectionTask *task = &tasks[i];
+        
+        /* Don't start more than the limit at once; the rest wait for one of
+         * the running ones to finish */
+        if (dispatch_semaphore_wait(slots, deadline) != 0) {
+            break;
+        }
+        
+        dispatch_group_enter(group);
+        task->entered = TRUE;
+        task->start_time = mach_absolute_time();
+        
+        SCNetworkConnectionContext context = {0, task, NULL, NULL, NULL};
+        task->connection = SCNetworkConnectionCreateWithServiceID(NULL, task->service_id, connection_status_changed, &context);
+        if (task->connection == NULL) {
+            fprintf(stderr, "Failed to create connection: %s (%d)\n", SCErrorString(SCError()), SCError());
+            finish_connection_task(task, ConnectionFailed, kSCNetworkConnectionInvalid);
+            continue;
+        }
+        
+        if (!SCNetworkConnectionSetDispatchQueue(task->connection, queue)) {
+            fprintf(stderr, "Failed to watch connection: %s (%d)\n", SCErrorString(SCError()), SCError());
+            finish_connection_task(task, ConnectionFailed, kSCNetworkConnectionInvalid);
+            continue;
+        }
+        
+        dispatch_async_f(queue, task, start_connection_task);
+    }
+    
+    dispatch_group_wait(group, deadline);
+    
+    Boolean success = TRUE;
+    for (CFIndex i = 0; i < count; ++i) {
+        ConnectionTask *task = &tasks[i];
+        
+        if (task->connection != NULL) {
+            dispatch_sync_f(queue, task, detach_connection_task);
+        }
+        
+        print_connection_task(task);
+        
+        /* Balance the group and semaphore for tasks that timed out, since
+         * libdispatch won't free them while they are still in use */
+        if (task->entered && task->result == ConnectionPending) {
+            dispatch_semaphore_signal(slots);
+            dispatch_group_leave(group);
+        }
+        
+        if (task->result != ConnectionSucceeded) {
+            success = FALSE;
+        }
+        if (task->connection != NULL) {
+            CFRelease(task->connection);
+        }
+    }
+    
+    free(tasks);
+    dispatch_release(slots);
+    dispatch_release(group);
+    dispatch_release(queue);
+    return success;
+}
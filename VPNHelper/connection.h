@@ -0,0 +1,26 @@
+#ifndef VPNHELPER_CONNECTION_H
+#define VPNHELPER_CONNECTION_H
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <SystemConfiguration/SystemConfiguration.h>
+
+/* Connects or disconnects several VPN connections concurrently, and prints
+ * how long each one took to reach the requested state. Connections stay up
+ * after the process exits.
+ * @param service_ids The service IDs of the VPN connections.
+ * @param connect TRUE to connect, FALSE to disconnect.
+ * @param max_concurrent The maximum number of connections that may be
+ *     changing state at the same time, or 0 for no limit.
+ * @param timeout How long to wait for all connections, in seconds.
+ * @result TRUE if every connection reached the requested state; FALSE
+ *     otherwise.
+ */
+Boolean change_vpn_connections(CFArrayRef service_ids, Boolean connect, int max_concurrent, double timeout);
+
+/* Gets the reason a VPN connection last went down.
+ * @param connection The connection.
+ * @result The PPP last cause code, or 0 if there is none.
+ */
+int get_connection_last_cause(SCNetworkConnectionRef connection);
+
+#endif
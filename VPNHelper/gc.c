@@ -0,0 +1,281 @@
+#include "gc.h"
+#include "keychain.h"
+#include "vpn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <SystemConfiguration/SystemConfiguration.h>
+
+/* Bits recording which keychain items a connection has. */
+#define HAS_PASSWORD_ITEM 1
+#define HAS_SHARED_SECRET_ITEM 2
+
+typedef struct {
+    CFIndex count;
+    CFIndex bytes;
+} ReclaimedSpace;
+
+CFIndex
+get_size_value(CFDictionaryRef dictionary, CFStringRef key)
+{
+    CFIndex size = 0;
+    CFNumberRef number = CFDictionaryGetValue(dictionary, key);
+    if (number != NULL) {
+        CFNumberGetValue(number, kCFNumberCFIndexType, &size);
+    }
+    return size;
+}
+
+void
+print_gc_entry(const char *kind, CFStringRef identifier, CFTypeRef name, CFIndex bytes)
+{
+    char identifier_chars[256];
+    char name_chars[256] = "";
+    CFStringGetCString(identifier, identifier_chars, sizeof(identifier_chars), kCFStringEncodingUTF8);
+    if (name != NULL && CFGetTypeID(name) == CFStringGetTypeID()) {
+        CFStringGetCString(name, name_chars, sizeof(name_chars), kCFStringEncodingUTF8);
+    }
+    
+    printf("%-26s %-40s %8ld bytes  %s\n", kind, identifier_chars, bytes, name_chars);
+}
+
+Boolean
+is_vpn_connection_active(CFStringRef service_id)
+{
+    SCNetworkConnectionRef connection = SCNetworkConnectionCreateWithServiceID(NULL, service_id, NULL, NULL);
+    if (connection == NULL) {
+        return FALSE;
+    }
+    
+    SCNetworkConnectionStatus status = SCNetworkConnectionGetStatus(connection);
+    CFRelease(connection);
+    return status != kSCNetworkConnectionDisconnected && status != kSCNetworkConnectionInvalid;
+}
+
+/* Ranks which of a set of duplicate connections to keep: one that is in
+ * use first, then one whose keychain items are both present. */
+int
+get_keep_rank(CFDictionaryRef description, CFDictionaryRef item_owners)
+{
+    CFStringRef service_id = CFDictionaryGetValue(description, CFSTR("id"));
+    
+    int rank = 0;
+    if (is_vpn_connection_active(service_id)) {
+        rank += 2;
+    }
+    
+    int items = 0;
+    CFNumberRef items_number = CFDictionaryGetValue(item_owners, service_id);
+    if (items_number != NULL) {
+        CFNumberGetValue(items_number, kCFNumberIntType, &items);
+    }
+    if (items == (HAS_PASSWORD_ITEM | HAS_SHARED_SECRET_ITEM)) {
+        rank += 1;
+    }
+    
+    return rank;
+}
+
+/* Groups keychain items by their service name, and records which items
+ * each service ID has. */
+void
+index_keychain_items(CFArrayRef keychain_items, CFMutableDictionaryRef items_by_service, CFMutableDictionaryRef item_owners)
+{
+    for (CFIndex i = 0; i < CFArrayGetCount(keychain_items); ++i) {
+        CFDictionaryRef entry = CFArrayGetValueAtIndex(keychain_items, i);
+        CFStringRef service = CFDictionaryGetValue(entry, CFSTR("service"));
+        
+        CFMutableArrayRef entries = (CFMutableArrayRef)CFDictionaryGetValue(items_by_service, service);
+        if (entries == NULL) {
+            entries = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+            CFDictionarySetValue(items_by_service, service, entries);
+            CFRelease(entries);
+        }
+        CFArrayAppendValue(entries, entry);
+        
+        CFStringRef owner = create_service_id_for_keychain_service(service);
+        int items = 0;
+        CFNumberRef items_number = CFDictionaryGetValue(item_owners, owner);
+        if (items_number != NULL) {
+            CFNumberGetValue(items_number, kCFNumberIntType, &items);
+        }
+        items |= CFEqual(owner, service) ? HAS_PASSWORD_ITEM : HAS_SHARED_SECRET_ITEM;
+        
+        items_number = CFNumberCreate(NULL, kCFNumberIntType, &items);
+        CFDictionarySetValue(item_owners, owner, items_number);
+        CFRelease(items_number);
+        CFRelease(owner);
+    }
+}
+
+/* Picks the connections to delete: every duplicate except the best one. */
+void
+find_duplicate_vpns(CFArrayRef vpn_list, CFDictionaryRef item_owners, CFDictionaryRef service_sizes,
+                    CFMutableArrayRef doomed_ids, ReclaimedSpace *reclaimed)
+{
+    CFMutableDictionaryRef kept = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+    
+    for (CFIndex i = 0; i < CFArrayGetCount(vpn_list); ++i) {
+        CFDictionaryRef description = CFArrayGetValueAtIndex(vpn_list, i);
+        CFStringRef key = CFStringCreateWithFormat(
+            NULL, NULL, CFSTR("%@\n%@\n%@"),
+            CFDictionaryGetValue(description, CFSTR("name")),
+            CFDictionaryGetValue(description, CFSTR("address")),
+            CFDictionaryGetValue(description, CFSTR("username"))
+        );
+        
+        CFDictionaryRef kept_description = CFDictionaryGetValue(kept, key);
+        if (kept_description == NULL) {
+            CFDictionarySetValue(kept, key, description);
+            CFRelease(key);
+            continue;
+        }
+        
+        CFDictionaryRef duplicate = description;
+        if (get_keep_rank(description, item_owners) > get_keep_rank(kept_description, item_owners)) {
+            duplicate = kept_description;
+            CFDictionarySetValue(kept, key, description);
+        }
+        CFRelease(key);
+        
+        CFStringRef duplicate_id = CFDictionaryGetValue(duplicate, CFSTR("id"));
+        CFTypeRef name = CFDictionaryGetValue(duplicate, CFSTR("name"));
+        if (is_vpn_connection_active(duplicate_id)) {
+            print_gc_entry("Keeping active duplicate", duplicate_id, name, 0);
+            continue;
+        }
+        
+        CFIndex bytes = get_size_value(service_sizes, duplicate_id);
+        print_gc_entry("Duplicate connection", duplicate_id, name, bytes);
+        CFArrayAppendValue(doomed_ids, duplicate_id);
+        reclaimed->count++;
+        reclaimed->bytes += bytes;
+    }
+    
+    CFRelease(kept);
+}
+
+/* Picks the keychain items to delete: those of no network service, and
+ * all but the one in use of those that share a service name. Items of
+ * doomed connections are only counted, since deleting the connection
+ * removes them. */
+void
+find_orphaned_keychain_items(CFDictionaryRef items_by_service, CFDictionaryRef service_sizes, CFArrayRef doomed_ids,
+                             CFMutableArrayRef doomed_items, ReclaimedSpace *reclaimed)
+{
+    CFIndex count = CFDictionaryGetCount(items_by_service);
+    const void **services = malloc((count + 1) * sizeof(void *));
+    const void **groups = malloc((count + 1) * sizeof(void *));
+    CFDictionaryGetKeysAndValues(items_by_service, services, groups);
+    
+    for (CFIndex i = 0; i < count; ++i) {
+        CFStringRef service = services[i];
+        CFArrayRef entries = groups[i];
+        CFIndex entry_count = CFArrayGetCount(entries);
+        
+        CFStringRef owner = create_service_id_for_keychain_service(service);
+        Boolean owner_doomed = CFArrayContainsValue(doomed_ids, CFRangeMake(0, CFArrayGetCount(doomed_ids)), owner);
+        Boolean orphaned = !CFDictionaryContainsKey(service_sizes, owner);
+        CFRelease(owner);
+        
+        CFTypeRef item_in_use = NULL;
+        if (!owner_doomed && !orphaned && entry_count > 1) {
+            item_in_use = copy_keychain_item(service);
+        }
+        
+        for (CFIndex j = 0; j < entry_count; ++j) {
+            CFDictionaryRef entry = CFArrayGetValueAtIndex(entries, j);
+            CFTypeRef item = CFDictionaryGetValue(entry, CFSTR("item"));
+            CFIndex bytes = get_size_value(entry, CFSTR("size"));
+            
+            if (owner_doomed) {
+                reclaimed->count++;
+                reclaimed->bytes += bytes;
+            } else if (orphaned) {
+                print_gc_entry("Orphaned keychain item", service, CFDictionaryGetValue(entry, CFSTR("description")), bytes);
+                CFArrayAppendValue(doomed_items, item);
+                reclaimed->count++;
+                reclaimed->bytes += bytes;
+            } else if (item_in_use != NULL && !CFEqual(item, item_in_use)) {
+                print_gc_entry("Duplicate keychain item", service, CFDictionaryGetValue(entry, CFSTR("description")), bytes);
+                CFArrayAppendValue(doomed_items, item);
+                reclaimed->count++;
+                reclaimed->bytes += bytes;
+            }
+        }
+        
+        if (item_in_use != NULL) {
+            CFRelease(item_in_use);
+        }
+    }
+    
+    free(groups);
+    free(services);
+}
+
+int
+run_gc(Boolean dry_run, Boolean include_keychain)
+{
+    int err = 1;
+    
+    /* Keychain items are listed before the services are read. Connections
+     * are committed before their items are written, so every item seen
+     * belongs to a service that the later read will find, and a connection
+     * created in between can't have its secrets mistaken for orphans */
+    CFArrayRef keychain_items = include_keychain ? copy_vpn_keychain_items() : CFArrayCreate(NULL, NULL, 0, &kCFTypeArrayCallBacks);
+    CFArrayRef vpn_list = copy_vpn_list();
+    CFDictionaryRef service_sizes = copy_network_service_sizes();
+    
+    CFMutableDictionaryRef items_by_service = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFMutableDictionaryRef item_owners = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFMutableArrayRef doomed_ids = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    CFMutableArrayRef doomed_items = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    ReclaimedSpace services = {0, 0};
+    ReclaimedSpace items = {0, 0};
+    
+    if (vpn_list == NULL || service_sizes == NULL || keychain_items == NULL) {
+        fprintf(stderr, "Failed to read VPN connections and keychain items\n");
+        goto release;
+    }
+    
+    index_keychain_items(keychain_items, items_by_service, item_owners);
+    find_duplicate_vpns(vpn_list, item_owners, service_sizes, doomed_ids, &services);
+    find_orphaned_keychain_items(items_by_service, service_sizes, doomed_ids, doomed_items, &items);
+    
+    if (dry_run) {
+        printf("Would remove %ld connections (%ld bytes of preferences) and %ld keychain items (%ld bytes of attributes)\n",
+               services.count, services.bytes, items.count, items.bytes);
+        err = 0;
+        goto release;
+    }
+    
+    /* Deleting the connections also deletes their keychain items, once the
+     * preferences have been committed */
+    if (CFArrayGetCount(doomed_ids) > 0 && !delete_vpns(doomed_ids)) {
+        goto release;
+    }
+    
+    Boolean success = TRUE;
+    for (CFIndex i = 0; i < CFArrayGetCount(doomed_items); ++i) {
+        success = delete_keychain_item(CFArrayGetValueAtIndex(doomed_items, i)) && success;
+    }
+    
+    printf("Removed %ld connections (%ld bytes of preferences) and %ld keychain items (%ld bytes of attributes)\n",
+           services.count, services.bytes, items.count, items.bytes);
+    err = success ? 0 : 1;
+    
+release:
+    CFRelease(doomed_items);
+    CFRelease(doomed_ids);
+    CFRelease(item_owners);
+    CFRelease(items_by_service);
+    if (keychain_items != NULL) {
+        CFRelease(keychain_items);
+    }
+    if (service_sizes != NULL) {
+        CFRelease(service_sizes);
+    }
+    if (vpn_list != NULL) {
+        CFRelease(vpn_list);
+    }
+    return err;
+}
@@ -0,0 +1,23 @@
+#ifndef VPNHELPER_GC_H
+#define VPNHELPER_GC_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/* Removes L2TP VPN connections that duplicate another one's name, server
+ * address and username, and VPN keychain items that belong to no network
+ * service or duplicate another item for the same one. Of a set of
+ * duplicate connections, the one that is connected or has both of its
+ * keychain items is kept. Services are deleted in a single transaction,
+ * which also removes their keychain items. This is also how duplicate
+ * keychain items are cleaned up after an edit, which only updates the
+ * first item found for a service.
+ * @param dry_run TRUE to only report what would be removed.
+ * @param include_keychain TRUE to look for orphaned keychain items. Should
+ *     be FALSE when working on a preferences file other than the system's,
+ *     since the keychain items of the system's connections would all look
+ *     orphaned.
+ * @result Nonzero on failure.
+ */
+int run_gc(Boolean dry_run, Boolean include_keychain);
+
+#endif
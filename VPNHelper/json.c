@@ -0,0 +1,508 @@
+#include "json.h"
+#include <stdio.h>
+
+typedef struct {
+    /* The next character to be parsed. */
+    const char *pos;
+    
+    /* One past the last character of the document. */
+    const char *end;
+} JSONParser;
+
+CFTypeRef parse_json_value(JSONParser *parser);
+
+void
+print_json_error(JSONParser *parser, const char *message)
+{
+    fprintf(stderr, "Invalid JSON: %s\n", message);
+}
+
+void
+skip_json_whitespace(JSONParser *parser)
+{
+    while (parser->pos < parser->end) {
+        char c = *parser->pos;
+        if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+            break;
+        }
+        parser->pos++;
+    }
+}
+
+Boolean
+consume_json_literal(JSONParser *parser, const char *literal)
+{
+    size_t length = strlen(literal);
+    if ((size_t)(parser->end - parser->pos) < length || memcmp(parser->pos, literal, length) != 0) {
+        return FALSE;
+    }
+    parser->pos += length;
+    return TRUE;
+}
+
+int
+parse_json_hex4(JSONParser *parser)
+{
+    if (parser->end - parser->pos < 4) {
+        return -1;
+    }
+    
+    int value = 0;
+    for (int i = 0; i < 4; ++i) {
+        char c = *parser->pos++;
+        value <<= 4;
+        if (c >= '0' && c <= '9') {
+            value |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            value |= c - 'A' + 10;
+        } else {
+            return -1;
+        }
+    }
+    return value;
+}
+
+size_t
+encode_utf8(UInt32 code_point, char *out)
+{
+    if (code_point < 0x80) {
+        out[0] = (char)code_point;
+        return 1;
+    } else if (code_point < 0x800) {
+        out[0] = (char)(0xC0 | (code_point >> 6));
+        out[1] = (char)(0x80 | (code_point & 0x3F));
+        return 2;
+    } else if (code_point < 0x10000) {
+        out[0] = (char)(0xE0 | (code_point >> 12));
+        out[1] = (char)(0x80 | ((code_point >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (code_point & 0x3F));
+        return 3;
+    } else {
+        out[0] = (char)(0xF0 | (code_point >> 18));
+        out[1] = (char)(0x80 | ((code_point >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((code_point >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (code_point & 0x3F));
+        return 4;
+    }
+}
+
+CFStringRef
+parse_json_string(JSONParser *parser)
+{
+    /* Skip the opening quote */
+    parser->pos++;
+    
+    /* Escapes never make the decoded string longer than the source text,
+     * so the remaining document length is a safe upper bound. */
+    const char *start = parser->pos;
+    const char *close = start;
+    while (close < parser->end && *close != '"') {
+        close += (*close == '\\') ? 2 : 1;
+    }
+    if (close >= parser->end) {
+        print_json_error(parser, "unterminated string");
+        return NULL;
+    }
+    
+    char *buffer = malloc((size_t)(close - start) + 1);
+    size_t length = 0;
+    
+    while (parser->pos < close) {
+        char c = *parser->pos++;
+        if ((unsigned char)c < 0x20) {
+            print_json_error(parser, "control character in string");
+            goto free_buffer;
+        }
+        
+        if (c != '\\') {
+            buffer[length++] = c;
+            continue;
+        }
+        
+        c = *parser->pos++;
+        switch (c) {
+            case '"':  buffer[length++] = '"';  break;
+            case '\\': buffer[length++] = '\\'; break;
+            case '/':  buffer[length++] = '/';  break;
+            case 'b':  buffer[length++] = '\b'; break;
+            case 'f':  buffer[length++] = '\f'; break;
+            case 'n':  buffer[length++] = '\n'; break;
+            case 'r':  buffer[length++] = '\r'; break;
+            case 't':  buffer[length++] = '\t'; break;
+            case 'u': {
+                int unit = parse_json_hex4(parser);
+                if (unit < 0) {
+                    print_json_error(parser, "invalid \\u escape");
+                    goto free_buffer;
+                }
+                
+                UInt32 code_point = (UInt32)unit;
+                if (unit >= 0xD800 && unit <= 0xDBFF) {
+                    if (!consume_json_literal(parser, "\\u")) {
+                        print_json_error(parser, "unpaired surrogate");
+                        goto free_buffer;
+                    }
+                    int low = parse_json_hex4(parser);
+                    if (low < 0xDC00 || low > 0xDFFF) {
+                        print_json_error(parser, "unpaired surrogate");
+                        goto free_buffer;
+                    }
+                    code_point = 0x10000 + (((UInt32)unit - 0xD800) << 10) + ((UInt32)low - 0xDC00);
+                }
+                
+                /* Six bytes of escape always cover up to four bytes of UTF-8 */
+                length += encode_utf8(code_point, buffer + length);
+                break;
+            }
+            default:
+                print_json_error(parser, "invalid escape sequence");
+                goto free_buffer;
+        }
+    }
+    
+    /* Skip the closing quote */
+    parser->pos++;
+    
+    CFStringRef str = CFStringCreateWithBytes(NULL, (const UInt8 *)buffer, (CFIndex)length, kCFStringEncodingUTF8, FALSE);
+    if (str == NULL) {
+        print_json_error(parser, "string is not valid UTF-8");
+    }
+    free(buffer);
+    return str;
+    
+free_buffer:
+    free(buffer);
+    return NULL;
+}
+
+CFNumberRef
+parse_json_number(JSONParser *parser)
+{
+    const char *start = parser->pos;
+    Boolean is_float = FALSE;
+    
+    while (parser->pos < parser->end) {
+        char c = *parser->pos;
+        if (c == '.' || c == 'e' || c == 'E') {
+            is_float = TRUE;
+        } else if (!(c >= '0' && c <= '9') && c != '-' && c != '+') {
+            break;
+        }
+        parser->pos++;
+    }
+    
+    char text[64];
+    size_t length = (size_t)(parser->pos - start);
+    if (length == 0 || length >= sizeof(text)) {
+        print_json_error(parser, "invalid number");
+        return NULL;
+    }
+    memcpy(text, start, length);
+    text[length] = '\0';
+    
+    char *text_end;
+    if (is_float) {
+        double value = strtod(text, &text_end);
+        if (*text_end != '\0') {
+            print_json_error(parser, "invalid number");
+            return NULL;
+        }
+        return CFNumberCreate(NULL, kCFNumberDoubleType, &value);
+    } else {
+        long long value = strtoll(text, &text_end, 10);
+        if (*text_end != '\0') {
+            print_json_error(parser, "invalid number");
+            return NULL;
+        }
+        return CFNumberCreate(NULL, kCFNumberLongLongType, &value);
+    }
+}
+
+CFArrayRef
+parse_json_array(JSONParser *parser)
+{
+    /* Skip the opening bracket */
+    parser->pos++;
+    
+    CFMutableArrayRef array = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    
+    skip_json_whitespace(parser);
+    if (consume_json_literal(parser, "]")) {
+        return array;
+    }
+    
+    while (TRUE) {
+        CFTypeRef value = parse_json_value(parser);
+        if (value == NULL) {
+            goto release_array;
+        }
+        CFArrayAppendValue(array, value);
+        CFRelease(value);
+        
+        skip_json_whitespace(parser);
+        if (consume_json_literal(parser, "]")) {
+            return array;
+        }
+        if (!consume_json_literal(parser, ",")) {
+            print_json_error(parser, "expected ',' or ']' in array");
+            goto release_array;
+        }
+    }
+    
+release_array:
+    CFRelease(array);
+    return NULL;
+}
+
+CFDictionaryRef
+parse_json_object(JSONParser *parser)
+{
+    /* Skip the opening brace */
+    parser->pos++;
+    
+    CFMutableDictionaryRef object = CFDictionaryCreateMutable(
+        NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+    );
+    
+    skip_json_whitespace(parser);
+    if (consume_json_literal(parser, "}")) {
+        return object;
+    }
+    
+    while (TRUE) {
+        skip_json_whitespace(parser);
+        if (parser->pos >= parser->end || *parser->pos != '"') {
+            print_json_error(parser, "expected string key in object");
+            goto release_object;
+        }
+        
+        CFStringRef key = parse_json_string(parser);
+        if (key == NULL) {
+            goto release_object;
+        }
+        
+        skip_json_whitespace(parser);
+        if (!consume_json_literal(parser, ":")) {
+            print_json_error(parser, "expected ':' in object");
+            CFRelease(key);
+            goto release_object;
+        }
+        
+        CFTypeRef value = parse_json_value(parser);
+        if (value == NULL) {
+            CFRelease(key);
+            goto release_object;
+        }
+        CFDictionarySetValue(object, key, value);
+        CFRelease(value);
+        CFRelease(key);
+        
+        skip_json_whitespace(parser);
+        if (consume_json_literal(parser, "}")) {
+            return object;
+        }
+        if (!consume_json_literal(parser, ",")) {
+            print_json_error(parser, "expected ',' or '}' in object");
+            goto release_object;
+        }
+    }
+    
+release_object:
+    CFRelease(object);
+    return NULL;
+}
+
+CFTypeRef
+parse_json_value(JSONParser *parser)
+{
+    skip_json_whitespace(parser);
+    if (parser->pos >= parser->end) {
+        print_json_error(parser, "unexpected end of document");
+        return NULL;
+    }
+    
+    char c = *parser->pos;
+    if (c == '{') {
+        return parse_json_object(parser);
+    } else if (c == '[') {
+        return parse_json_array(parser);
+    } else if (c == '"') {
+        return parse_json_string(parser);
+    } else if (c == '-' || (c >= '0' && c <= '9')) {
+        return parse_json_number(parser);
+    } else if (consume_json_literal(parser, "true")) {
+        return CFRetain(kCFBooleanTrue);
+    } else if (consume_json_literal(parser, "false")) {
+        return CFRetain(kCFBooleanFalse);
+    } else if (consume_json_literal(parser, "null")) {
+        return CFRetain(kCFNull);
+    }
+    
+    print_json_error(parser, "unexpected character");
+    return NULL;
+}
+
+CFTypeRef
+create_json_value(const char *bytes, size_t length)
+{
+    JSONParser parser = {bytes, bytes + length};
+    
+    CFTypeRef value = parse_json_value(&parser);
+    if (value == NULL) {
+        return NULL;
+    }
+    
+    skip_json_whitespace(&parser);
+    if (parser.pos != parser.end) {
+        print_json_error(&parser, "trailing characters after document");
+        CFRelease(value);
+        return NULL;
+    }
+    
+    return value;
+}
+
+CFTypeRef
+create_json_value_from_file(const char *path)
+{
+    FILE *file = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+    
+    size_t capacity = 4096;
+    size_t length = 0;
+    char *buffer = malloc(capacity);
+    
+    while (TRUE) {
+        length += fread(buffer + length, 1, capacity - length, file);
+        if (length < capacity) {
+            break;
+        }
+        capacity *= 2;
+        buffer = realloc(buffer, capacity);
+    }
+    
+    CFTypeRef value = NULL;
+    if (ferror(file)) {
+        perror(path);
+    } else {
+        value = create_json_value(buffer, length);
+    }
+    
+    free(buffer);
+    if (file != stdin) {
+        fclose(file);
+    }
+    return value;
+}
+
+void
+write_json_string(FILE *file, CFStringRef str)
+{
+    if (str == NULL) {
+        fputs("null", file);
+        return;
+    }
+    
+    CFIndex max_length = CFStringGetMaximumSizeForEncoding(CFStringGetLength(str), kCFStringEncodingUTF8) + 1;
+    const char *chars = CFStringGetCStringPtr(str, kCFStringEncodingUTF8);
+    char *buffer = NULL;
+    if (chars == NULL) {
+        buffer = malloc(max_length);
+        assert(CFStringGetCString(str, buffer, max_length, kCFStringEncodingUTF8));
+        chars = buffer;
+    }
+    
+    fputc('"', file);
+    for (const char *p = chars; *p != '\0'; ++p) {
+        unsigned char c = (unsigned char)*p;
+        switch (c) {
+            case '"':  fputs("\\\"", file); break;
+            case '\\': fputs("\\\\", file); break;
+            case '\n': fputs("\\n", file);  break;
+            case '\r': fputs("\\r", file);  break;
+            case '\t': fputs("\\t", file);  break;
+            default:
+                if (c < 0x20) {
+                    fprintf(file, "\\u%04x", c);
+                } else {
+                    fputc(c, file);
+                }
+                break;
+        }
+    }
+    fputc('"', file);
+    
+    free(buffer);
+}
+
+CFComparisonResult
+compare_json_keys(const void *a, const void *b, void *context)
+{
+    return CFStringCompare((CFStringRef)a, (CFStringRef)b, 0);
+}
+
+void
+write_json_value(FILE *file, CFTypeRef value)
+{
+    CFTypeID type = CFGetTypeID(value);
+    
+    if (type == CFDictionaryGetTypeID()) {
+        CFDictionaryRef object = (CFDictionaryRef)value;
+        CFIndex count = CFDictionaryGetCount(object);
+        const void **keys = malloc(sizeof(void *) * (count + 1));
+        CFDictionaryGetKeysAndValues(object, keys, NULL);
+        
+        CFMutableArrayRef sorted_keys = CFArrayCreateMutable(NULL, count, NULL);
+        for (CFIndex i = 0; i < count; ++i) {
+            CFArrayAppendValue(sorted_keys, keys[i]);
+        }
+        CFArraySortValues(sorted_keys, CFRangeMake(0, count), compare_json_keys, NULL);
+        
+        fputc('{', file);
+        for (CFIndex i = 0; i < count; ++i) {
+            CFStringRef key = CFArrayGetValueAtIndex(sorted_keys, i);
+            if (i > 0) {
+                fputc(',', file);
+            }
+            write_json_string(file, key);
+            fputc(':', file);
+            write_json_value(file, CFDictionaryGetValue(object, key));
+        }
+        fputc('}', file);
+        
+        CFRelease(sorted_keys);
+        free(keys);
+    } else if (type == CFArrayGetTypeID()) {
+        CFArrayRef array = (CFArrayRef)value;
+        fputc('[', file);
+        for (CFIndex i = 0; i < CFArrayGetCount(array); ++i) {
+            if (i > 0) {
+                fputc(',', file);
+            }
+            write_json_value(file, CFArrayGetValueAtIndex(array, i));
+        }
+        fputc(']', file);
+    } else if (type == CFStringGetTypeID()) {
+        write_json_string(file, (CFStringRef)value);
+    } else if (type == CFBooleanGetTypeID()) {
+        fputs(CFBooleanGetValue((CFBooleanRef)value) ? "true" : "false", file);
+    } else if (type == CFNumberGetTypeID()) {
+        CFNumberRef number = (CFNumberRef)value;
+        if (CFNumberIsFloatType(number)) {
+            double d;
+            CFNumberGetValue(number, kCFNumberDoubleType, &d);
+            fprintf(file, "%.17g", d);
+        } else {
+            long long ll;
+            CFNumberGetValue(number, kCFNumberLongLongType, &ll);
+            fprintf(file, "%lld", ll);
+        }
+    } else {
+        fputs("null", file);
+    }
+}
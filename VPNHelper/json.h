@@ -0,0 +1,39 @@
+#ifndef VPNHELPER_JSON_H
+#define VPNHELPER_JSON_H
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdio.h>
+
+/* Parses a JSON document into the equivalent property list.
+ * Objects become dictionaries, arrays become arrays, strings become
+ * strings, numbers become numbers, booleans become booleans, and null
+ * becomes kCFNull.
+ * @param bytes The UTF-8 encoded JSON text.
+ * @param length The length of the text, in bytes.
+ * @result The parsed value, or NULL if the text is not valid JSON. The
+ *     caller is responsible for releasing the value.
+ */
+CFTypeRef create_json_value(const char *bytes, size_t length);
+
+/* Reads and parses a JSON document from a file.
+ * @param path The path of the file, or "-" to read from stdin.
+ * @result The parsed value, or NULL if the file could not be read or
+ *     is not valid JSON. The caller is responsible for releasing the value.
+ */
+CFTypeRef create_json_value_from_file(const char *path);
+
+/* Writes a property list as compact JSON. Dictionary keys are written in
+ * sorted order so that the output is stable between runs.
+ * @param file The file to write to.
+ * @param value The value to write. Must be composed only of the types
+ *     produced by create_json_value().
+ */
+void write_json_value(FILE *file, CFTypeRef value);
+
+/* Writes a string as a quoted, escaped JSON string.
+ * @param file The file to write to.
+ * @param str The string to write. If NULL, writes null instead.
+ */
+void write_json_string(FILE *file, CFStringRef str);
+
+#endif
@@ -1,32 +1,120 @@
 #include "keychain.h"
+#include "arena.h"
+#include "cache.h"
+#include "metrics.h"
+#include "trace.h"
 #include <stdio.h>
+#include <sys/stat.h>
 #include <Security/Security.h>
 
 void
 print_osstatus(const char *message, OSStatus status)
 {
     fprintf(stderr, "%s: %d\n", message, status);
+    record_metrics_failure("OSStatus", status);
 }
 
-char *
-copy_utf8_chars(CFStringRef str)
+/* Hashing the trusted binaries is one of the slowest parts of writing to the
+ * keychain, so the resulting application data is kept on disk. An entry is
+ * only reused if the binary's inode and modification time are unchanged and
+ * the OS hasn't been updated since it was written. */
+#define TRUSTED_APP_CACHE_NAME "trusted_apps.plist"
+
+/* The descriptions of the items written for a VPN connection, which are
+ * also what the system uses for the connections it creates. */
+#define VPN_PASSWORD_DESCRIPTION "VPN Password"
+#define SHARED_SECRET_DESCRIPTION "IPSec Shared Secret"
+
+unsigned int trusted_app_cache_hits = 0;
+unsigned int trusted_app_cache_misses = 0;
+
+Boolean
+trusted_app_cache_entry_matches(CFDictionaryRef entry, const struct stat *st)
 {
-    if (str == NULL) {
-        return NULL;
+    CFNumberRef inode = CFDictionaryGetValue(entry, CFSTR("inode"));
+    CFNumberRef mtime_sec = CFDictionaryGetValue(entry, CFSTR("mtime_sec"));
+    CFNumberRef mtime_nsec = CFDictionaryGetValue(entry, CFSTR("mtime_nsec"));
+    if (inode == NULL || mtime_sec == NULL || mtime_nsec == NULL) {
+        return FALSE;
     }
-    CFIndex utf16_length = CFStringGetLength(str);
-    CFIndex max_utf8_length = CFStringGetMaximumSizeForEncoding(utf16_length, kCFStringEncodingUTF8) + 1;
-    char *buffer = malloc(max_utf8_length);
-    assert(CFStringGetCString(str, buffer, max_utf8_length, kCFStringEncodingUTF8));
-    return buffer;
+    
+    SInt64 cached_inode, cached_sec, cached_nsec;
+    CFNumberGetValue(inode, kCFNumberSInt64Type, &cached_inode);
+    CFNumberGetValue(mtime_sec, kCFNumberSInt64Type, &cached_sec);
+    CFNumberGetValue(mtime_nsec, kCFNumberSInt64Type, &cached_nsec);
+    
+    return cached_inode == (SInt64)st->st_ino &&
+        cached_sec == (SInt64)st->st_mtimespec.tv_sec &&
+        cached_nsec == (SInt64)st->st_mtimespec.tv_nsec;
+}
+
+CFDictionaryRef
+create_trusted_app_cache_entry(const struct stat *st, CFDataRef data)
+{
+    SInt64 inode = (SInt64)st->st_ino;
+    SInt64 mtime_sec = (SInt64)st->st_mtimespec.tv_sec;
+    SInt64 mtime_nsec = (SInt64)st->st_mtimespec.tv_nsec;
+    
+    CFNumberRef numbers[3] = {
+        CFNumberCreate(NULL, kCFNumberSInt64Type, &inode),
+        CFNumberCreate(NULL, kCFNumberSInt64Type, &mtime_sec),
+        CFNumberCreate(NULL, kCFNumberSInt64Type, &mtime_nsec)
+    };
+    
+    const void *keys[4] = {CFSTR("inode"), CFSTR("mtime_sec"), CFSTR("mtime_nsec"), CFSTR("data")};
+    const void *values[4] = {numbers[0], numbers[1], numbers[2], data};
+    
+    CFDictionaryRef entry = CFDictionaryCreate(NULL, keys, values, 4, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    
+    for (int i = 0; i < 3; ++i) {
+        CFRelease(numbers[i]);
+    }
+    return entry;
 }
 
 SecTrustedApplicationRef
-create_trusted_app(const char *path)
+create_trusted_app(const char *path, CFDictionaryRef cached_apps, CFMutableDictionaryRef new_cached_apps)
 {
     SecTrustedApplicationRef app;
-    OSStatus result = SecTrustedApplicationCreateFromPath(path, &app);
+    OSStatus result;
+    
+    CFStringRef key = CFStringCreateWithCString(NULL, path, kCFStringEncodingUTF8);
+    CFDictionaryRef entry = (cached_apps == NULL) ? NULL : CFDictionaryGetValue(cached_apps, key);
+    
+    struct stat st;
+    Boolean have_stat = (stat(path, &st) == 0);
+    
+    if (have_stat && entry != NULL && trusted_app_cache_entry_matches(entry, &st)) {
+        /* Creating from a NULL path refers to ourselves, which is cheap; the
+         * cached data then replaces our own identity with the binary's. */
+        CFDataRef data = CFDictionaryGetValue(entry, CFSTR("data"));
+        if (data != NULL && SecTrustedApplicationCreateFromPath(NULL, &app) == errSecSuccess) {
+            if (SecTrustedApplicationSetData(app, data) == errSecSuccess) {
+                trusted_app_cache_hits++;
+                CFDictionarySetValue(new_cached_apps, key, entry);
+                CFRelease(key);
+                return app;
+            }
+            CFRelease(app);
+        }
+    }
+    
+    trusted_app_cache_misses++;
+    
+    uint64_t start_time = trace_begin();
+    result = SecTrustedApplicationCreateFromPath(path, &app);
+    trace_end("SecTrustedApplicationCreateFromPath", start_time);
     assert(result == errSecSuccess);
+    
+    CFDataRef data;
+    if (have_stat && SecTrustedApplicationCopyData(app, &data) == errSecSuccess) {
+        CFDictionaryRef new_entry = create_trusted_app_cache_entry(&st, data);
+        CFDictionarySetValue(new_cached_apps, key, new_entry);
+        CFRelease(new_entry);
+        CFRelease(data);
+    }
+    
+    CFRelease(key);
     return app;
 }
 
@@ -36,37 +124,177 @@ get_trusted_app_list()
     static CFArrayRef trusted_apps;
     static dispatch_once_t once;
     dispatch_once(&once, ^{
+        uint64_t start_time = trace_begin();
+        CFStringRef os_build = copy_os_build_version();
+        
+        /* Everything is rehashed after an OS update, since the binaries'
+         * signatures may change even if their metadata looks the same */
+        CFDictionaryRef cached_apps = NULL;
+        CFDictionaryRef cache = copy_cache(TRUSTED_APP_CACHE_NAME);
+        if (cache != NULL && CFGetTypeID(cache) == CFDictionaryGetTypeID()) {
+            CFTypeRef cached_os_build = CFDictionaryGetValue(cache, CFSTR("os_build"));
+            if (cached_os_build != NULL && CFEqual(cached_os_build, os_build)) {
+                cached_apps = CFDictionaryGetValue(cache, CFSTR("apps"));
+            }
+        }
+        
+        CFMutableDictionaryRef new_cached_apps = CFDictionaryCreateMutable(
+            NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+        );
+        
         const void *trusted_apps_raw[7] = {
-            create_trusted_app("/System/Library/Frameworks/SystemConfiguration.framework/Versions/A/Helpers/SCHelper"),
-            create_trusted_app("/System/Library/PreferencePanes/Network.prefPane/Contents/XPCServices/com.apple.preference.network.remoteservice.xpc"),
-            create_trusted_app("/usr/sbin/pppd"),
-            create_trusted_app("/usr/sbin/racoon"),
-            create_trusted_app("/usr/libexec/nehelper"),
-            create_trusted_app("/usr/libexec/nesessionmanager"),
-            create_trusted_app("/usr/libexec/neagent")
+            create_trusted_app("/System/Library/Frameworks/SystemConfiguration.framework/Versions/A/Helpers/SCHelper", cached_apps, new_cached_apps),
+            create_trusted_app("/System/Library/PreferencePanes/Network.prefPane/Contents/XPCServices/com.apple.preference.network.remoteservice.xpc", cached_apps, new_cached_apps),
+            create_trusted_app("/usr/sbin/pppd", cached_apps, new_cached_apps),
+            create_trusted_app("/usr/sbin/racoon", cached_apps, new_cached_apps),
+            create_trusted_app("/usr/libexec/nehelper", cached_apps, new_cached_apps),
+            create_trusted_app("/usr/libexec/nesessionmanager", cached_apps, new_cached_apps),
+            create_trusted_app("/usr/libexec/neagent", cached_apps, new_cached_apps)
         };
         trusted_apps = CFArrayCreate(NULL, trusted_apps_raw, 7, NULL);
+        
+        if (trusted_app_cache_misses > 0) {
+            const void *keys[2] = {CFSTR("os_build"), CFSTR("apps")};
+            const void *values[2] = {os_build, new_cached_apps};
+            CFDictionaryRef new_cache = CFDictionaryCreate(NULL, keys, values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+            write_cache(TRUSTED_APP_CACHE_NAME, new_cache);
+            CFRelease(new_cache);
+        }
+        
+        CFRelease(new_cached_apps);
+        if (cache != NULL) {
+            CFRelease(cache);
+        }
+        CFRelease(os_build);
+        trace_end("get_trusted_app_list", start_time);
     });
     return trusted_apps;
 }
 
+void
+get_trusted_app_cache_stats(unsigned int *hits, unsigned int *misses)
+{
+    *hits = trusted_app_cache_hits;
+    *misses = trusted_app_cache_misses;
+}
+
+OSStatus
+copy_system_keychain(SecKeychainRef *keychain)
+{
+    uint64_t start_time = trace_begin();
+    OSStatus status = SecKeychainCopyDomainDefault(kSecPreferencesDomainSystem, keychain);
+    trace_end("SecKeychainCopyDomainDefault", start_time);
+    return status;
+}
+
+OSStatus
+create_system_access(SecAccessRef *access)
+{
+    CFArrayRef trusted_apps = get_trusted_app_list();
+    
+    uint64_t start_time = trace_begin();
+    OSStatus status = SecAccessCreate(CFSTR("VPNHelper"), trusted_apps, access);
+    trace_end("SecAccessCreate", start_time);
+    return status;
+}
+
+OSStatus
+find_system_keychain_item(SecKeychainRef keychain, const char *service, UInt32 *length, void **data, SecKeychainItemRef *item)
+{
+    uint64_t start_time = trace_begin();
+    OSStatus status = SecKeychainFindGenericPassword(
+        keychain,
+        (UInt32)strlen(service),
+        service,
+        0,
+        NULL,
+        length,
+        data,
+        item
+    );
+    trace_end("SecKeychainFindGenericPassword", start_time);
+    return status;
+}
+
+void
+free_system_keychain_data(void *data)
+{
+    SecKeychainItemFreeContent(NULL, data);
+}
+
+OSStatus
+list_system_keychain_items(SecKeychainRef keychain, CFArrayRef *items)
+{
+    CFArrayRef search_list = CFArrayCreate(NULL, (const void **)&keychain, 1, &kCFTypeArrayCallBacks);
+    const void *keys[5] = {kSecClass, kSecMatchSearchList, kSecMatchLimit, kSecReturnAttributes, kSecReturnRef};
+    const void *values[5] = {kSecClassGenericPassword, search_list, kSecMatchLimitAll, kCFBooleanTrue, kCFBooleanTrue};
+    CFDictionaryRef query = CFDictionaryCreate(NULL, keys, values, 5, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFRelease(search_list);
+    
+    *items = NULL;
+    uint64_t start_time = trace_begin();
+    OSStatus status = SecItemCopyMatching(query, (CFTypeRef *)items);
+    trace_end("SecItemCopyMatching", start_time);
+    CFRelease(query);
+    return status;
+}
+
+OSStatus
+modify_system_keychain_item(SecKeychainItemRef item, const SecKeychainAttributeList *attributes, UInt32 length, const void *data)
+{
+    uint64_t start_time = trace_begin();
+    OSStatus status = SecKeychainItemModifyAttributesAndData(item, attributes, length, data);
+    trace_end("SecKeychainItemModifyAttributesAndData", start_time);
+    return status;
+}
+
+OSStatus
+create_system_keychain_item(SecKeychainRef keychain, SecAccessRef access, SecKeychainAttributeList *attributes, UInt32 length, const void *data)
+{
+    uint64_t start_time = trace_begin();
+    OSStatus status = SecKeychainItemCreateFromContent(
+        kSecGenericPasswordItemClass,
+        attributes,
+        length,
+        data,
+        keychain,
+        access,
+        NULL
+    );
+    trace_end("SecKeychainItemCreateFromContent", start_time);
+    return status;
+}
+
+OSStatus
+delete_system_keychain_item(SecKeychainItemRef item)
+{
+    uint64_t start_time = trace_begin();
+    OSStatus status = SecKeychainItemDelete(item);
+    trace_end("SecKeychainItemDelete", start_time);
+    return status;
+}
+
+const KeychainBackend system_keychain_backend = {
+    copy_system_keychain,
+    create_system_access,
+    find_system_keychain_item,
+    free_system_keychain_data,
+    list_system_keychain_items,
+    modify_system_keychain_item,
+    create_system_keychain_item,
+    delete_system_keychain_item
+};
+
+const KeychainBackend *keychain_backend = &system_keychain_backend;
+
 Boolean
-delete_keychain_key(SecKeychainRef keychain, char *service)
+delete_keychain_key(SecKeychainRef keychain, const char *service)
 {
     OSStatus status;
     
     while (TRUE) {
         SecKeychainItemRef item;
-        status = SecKeychainFindGenericPassword(
-            keychain,
-            (UInt32)strlen(service),
-            service,
-            0,
-            NULL,
-            NULL,
-            NULL,
-            &item
-        );
+        status = keychain_backend->find_item(keychain, service, NULL, NULL, &item);
         
         if (status == errSecItemNotFound) {
             return TRUE;
@@ -77,7 +305,7 @@ delete_keychain_key(SecKeychainRef keychain, char *service)
             return FALSE;
         }
         
-        status = SecKeychainItemDelete(item);
+        status = keychain_backend->delete_item(item);
         CFRelease(item);
         
         if (status != errSecSuccess) {
@@ -87,21 +315,42 @@ delete_keychain_key(SecKeychainRef keychain, char *service)
     }
 }
 
+/* Updates the keychain item for a service in place, or creates it if there
+ * is none. Modifying the item keeps its access list, and leaves its data
+ * alone if there is no new password. */
 Boolean
-configure_keychain_key(SecKeychainRef keychain, SecAccessRef access, SecKeychainAttributeList attributes, char *service, char *password)
+configure_keychain_key(SecKeychainRef keychain, SecAccessRef access, SecKeychainAttributeList attributes, const char *service, const char *password)
 {
-    if (!delete_keychain_key(keychain, service)) {
+    SecKeychainItemRef item = NULL;
+    OSStatus status = keychain_backend->find_item(keychain, service, NULL, NULL, &item);
+    
+    if (status == errSecSuccess) {
+        status = keychain_backend->modify_item(
+            item,
+            &attributes,
+            password == NULL ? 0 : (UInt32)strlen(password),
+            password
+        );
+        CFRelease(item);
+        
+        if (status != errSecSuccess) {
+            print_osstatus("Failed to modify existing keychain entry", status);
+        }
+        
+        return status == errSecSuccess;
+    }
+    
+    if (status != errSecItemNotFound) {
+        print_osstatus("Failed to get existing keychain entry", status);
         return FALSE;
     }
     
-    OSStatus status = SecKeychainItemCreateFromContent(
-        kSecGenericPasswordItemClass,
-        &attributes,
-        password == NULL ? 0 : (UInt32)strlen(password),
-        password,
+    status = keychain_backend->create_item(
         keychain,
         access,
-        NULL
+        &attributes,
+        password == NULL ? 0 : (UInt32)strlen(password),
+        password
     );
     
     if (status != errSecSuccess) {
@@ -111,131 +360,313 @@ configure_keychain_key(SecKeychainRef keychain, SecAccessRef access, SecKeychain
     return status == errSecSuccess;
 }
 
+/* Appends an attribute to a list, if it has a value. The list must have
+ * room for it. */
+void
+add_keychain_attribute(SecKeychainAttributeList *list, SecKeychainAttrType tag, const char *value)
+{
+    if (value != NULL) {
+        list->attr[list->count++] = (SecKeychainAttribute){tag, (UInt32)strlen(value), (void *)value};
+    }
+}
+
 Boolean
-configure_keychain_vpn_password(SecKeychainRef keychain, SecAccessRef access, L2TPConfigRef config, CFStringRef service_id)
+configure_keychain_vpn_password(SecKeychainRef keychain, SecAccessRef access, Arena *arena, L2TPConfigRef config, CFStringRef service_id)
 {
-    CFStringRef service_name = config->service_name;
-    CFStringRef username = config->username;
-    CFStringRef password = config->password;
-    
-    if (service_name == NULL && username == NULL && password == NULL) {
+    if (config->service_name == NULL && config->username == NULL && config->password == NULL) {
         return TRUE;
     }
     
-    char *str_description = "VPN Password";
-    char *str_service = copy_utf8_chars(service_id);
+    const char *str_service = arena_copy_utf8_chars(arena, service_id);
+    const char *str_value = arena_copy_utf8_chars(arena, config->password);
     
-    char *str_label = copy_utf8_chars(service_name);
-    char *str_account = copy_utf8_chars(username);
-    char *str_value = copy_utf8_chars(password);
+    SecKeychainAttributeList attribute_list = {0, arena_alloc(arena, 4 * sizeof(SecKeychainAttribute))};
+    add_keychain_attribute(&attribute_list, kSecServiceItemAttr, str_service);
+    add_keychain_attribute(&attribute_list, kSecDescriptionItemAttr, VPN_PASSWORD_DESCRIPTION);
+    add_keychain_attribute(&attribute_list, kSecLabelItemAttr, arena_copy_utf8_chars(arena, config->service_name));
+    add_keychain_attribute(&attribute_list, kSecAccountItemAttr, arena_copy_utf8_chars(arena, config->username));
     
-    SecKeychainAttribute attributes[4] = {
-        {kSecServiceItemAttr,     (UInt32)strlen(str_service),     str_service},
-        {kSecDescriptionItemAttr, (UInt32)strlen(str_description), str_description}
-    };
+    return configure_keychain_key(keychain, access, attribute_list, str_service, str_value);
+}
+
+Boolean
+configure_keychain_shared_secret(SecKeychainRef keychain, SecAccessRef access, Arena *arena, L2TPConfigRef config, CFStringRef shared_secret_id)
+{
+    if (config->service_name == NULL && config->shared_secret == NULL) {
+        return TRUE;
+    }
     
-    int index = 2;
+    const char *str_service = arena_copy_utf8_chars(arena, shared_secret_id);
+    const char *str_value = arena_copy_utf8_chars(arena, config->shared_secret);
     
-    if (str_label != NULL) {
-        attributes[index++] = (SecKeychainAttribute){kSecLabelItemAttr, (UInt32)strlen(str_label), str_label};
-    }
+    SecKeychainAttributeList attribute_list = {0, arena_alloc(arena, 3 * sizeof(SecKeychainAttribute))};
+    add_keychain_attribute(&attribute_list, kSecServiceItemAttr, str_service);
+    add_keychain_attribute(&attribute_list, kSecDescriptionItemAttr, SHARED_SECRET_DESCRIPTION);
+    add_keychain_attribute(&attribute_list, kSecLabelItemAttr, arena_copy_utf8_chars(arena, config->service_name));
     
-    if (str_account != NULL) {
-        attributes[index++] = (SecKeychainAttribute){kSecAccountItemAttr, (UInt32)strlen(str_account), str_account};
+    return configure_keychain_key(keychain, access, attribute_list, str_service, str_value);
+}
+
+/* The keychain and access objects don't depend on the VPN being configured,
+ * so they are created once and shared by every operation in the process. */
+SecKeychainRef cached_keychain = NULL;
+SecAccessRef cached_access = NULL;
+
+SecKeychainRef
+get_system_keychain(void)
+{
+    if (cached_keychain == NULL) {
+        OSStatus status = keychain_backend->copy_keychain(&cached_keychain);
+        if (status != errSecSuccess) {
+            print_osstatus("Failed to open system keychain", status);
+            cached_keychain = NULL;
+        }
     }
     
-    SecKeychainAttributeList attribute_list = {index, attributes};
+    return cached_keychain;
+}
+
+SecAccessRef
+get_vpn_access(void)
+{
+    if (cached_access == NULL) {
+        OSStatus status = keychain_backend->create_access(&cached_access);
+        if (status != errSecSuccess) {
+            print_osstatus("Failed to obtain keychain access", status);
+            cached_access = NULL;
+        }
+    }
     
-    Boolean success = configure_keychain_key(keychain, access, attribute_list, str_service, str_value);
+    return cached_access;
+}
+
+void
+set_keychain_backend(const KeychainBackend *backend)
+{
+    if (cached_keychain != NULL) {
+        CFRelease(cached_keychain);
+        cached_keychain = NULL;
+    }
+    if (cached_access != NULL) {
+        CFRelease(cached_access);
+        cached_access = NULL;
+    }
     
-free_strings:
-    if (str_label != NULL) {
-        free(str_label);
+    keychain_backend = (backend == NULL) ? &system_keychain_backend : backend;
+}
+
+Boolean
+prepare_keychain(Boolean needs_access)
+{
+    if (get_system_keychain() == NULL) {
+        return FALSE;
     }
-    if (str_account != NULL) {
-        free(str_account);
+    
+    return !needs_access || get_vpn_access() != NULL;
+}
+
+Boolean
+delete_keychain_items(CFStringRef service_id, CFStringRef shared_secret_id)
+{
+    SecKeychainRef keychain = get_system_keychain();
+    if (keychain == NULL) {
+        return FALSE;
     }
-    free(str_service);
-    free(str_value);
-exit:
+    
+    Arena arena;
+    init_arena(&arena);
+    
+    Boolean success = delete_keychain_key(keychain, arena_copy_utf8_chars(&arena, service_id)) &&
+        delete_keychain_key(keychain, arena_copy_utf8_chars(&arena, shared_secret_id));
+    
+    release_arena(&arena);
     return success;
 }
 
 Boolean
-configure_keychain_shared_secret(SecKeychainRef keychain, SecAccessRef access, L2TPConfigRef config, CFStringRef shared_secret_id)
+keychain_password_matches(CFStringRef service, CFStringRef password)
 {
-    CFStringRef service_name = config->service_name;
-    CFStringRef shared_secret = config->shared_secret;
+    SecKeychainRef keychain = get_system_keychain();
+    if (keychain == NULL) {
+        return FALSE;
+    }
     
-    if (service_name == NULL && shared_secret == NULL) {
-        return TRUE;
+    Arena arena;
+    init_arena(&arena);
+    
+    const char *str_service = arena_copy_utf8_chars(&arena, service);
+    const char *str_password = arena_copy_utf8_chars(&arena, password);
+    
+    UInt32 stored_length;
+    void *stored_password;
+    OSStatus status = keychain_backend->find_item(keychain, str_service, &stored_length, &stored_password, NULL);
+    
+    Boolean matches = FALSE;
+    if (status == errSecSuccess) {
+        matches = (stored_length == strlen(str_password) && memcmp(stored_password, str_password, stored_length) == 0);
+        keychain_backend->free_data(stored_password);
+    } else if (status != errSecItemNotFound) {
+        print_osstatus("Failed to get existing keychain entry", status);
+    }
+    
+    release_arena(&arena);
+    return matches;
+}
+
+CFStringRef
+copy_keychain_password(CFStringRef service)
+{
+    SecKeychainRef keychain = get_system_keychain();
+    if (keychain == NULL) {
+        return NULL;
     }
     
-    char *str_description = "IPSec Shared Secret";
-    char *str_service = copy_utf8_chars(shared_secret_id);
+    Arena arena;
+    init_arena(&arena);
     
-    char *str_label = copy_utf8_chars(service_name);
-    char *str_value = copy_utf8_chars(shared_secret);
+    const char *str_service = arena_copy_utf8_chars(&arena, service);
     
-    SecKeychainAttribute attributes[3] = {
-        {kSecServiceItemAttr,     (UInt32)strlen(str_service),     str_service},
-        {kSecDescriptionItemAttr, (UInt32)strlen(str_description), str_description}
-    };
+    UInt32 stored_length;
+    void *stored_password;
+    OSStatus status = keychain_backend->find_item(keychain, str_service, &stored_length, &stored_password, NULL);
     
-    int index = 2;
+    CFStringRef password = NULL;
+    if (status == errSecSuccess) {
+        password = CFStringCreateWithBytes(NULL, stored_password, stored_length, kCFStringEncodingUTF8, FALSE);
+        keychain_backend->free_data(stored_password);
+    } else if (status != errSecItemNotFound) {
+        print_osstatus("Failed to get existing keychain entry", status);
+    }
     
-    if (str_label != NULL) {
-        attributes[index++] = (SecKeychainAttribute){kSecLabelItemAttr, (UInt32)strlen(str_label), str_label};
+    release_arena(&arena);
+    return password;
+}
+
+/* Adds the UTF-8 length of a string attribute to a total. */
+void
+add_attribute_size(CFDictionaryRef attributes, CFStringRef key, CFIndex *size)
+{
+    CFTypeRef value = CFDictionaryGetValue(attributes, key);
+    if (value != NULL && CFGetTypeID(value) == CFStringGetTypeID()) {
+        CFIndex length;
+        CFStringGetBytes(value, CFRangeMake(0, CFStringGetLength(value)), kCFStringEncodingUTF8, 0, FALSE, NULL, 0, &length);
+        *size += length;
+    }
+}
+
+CFArrayRef
+copy_vpn_keychain_items(void)
+{
+    SecKeychainRef keychain = get_system_keychain();
+    if (keychain == NULL) {
+        return NULL;
     }
     
-    SecKeychainAttributeList attribute_list = {index, attributes};
+    CFArrayRef matches = NULL;
+    OSStatus status = keychain_backend->list_items(keychain, &matches);
     
-    Boolean success = configure_keychain_key(keychain, access, attribute_list, str_service, str_value);
+    if (status != errSecSuccess && status != errSecItemNotFound) {
+        print_osstatus("Failed to list keychain entries", status);
+        return NULL;
+    }
     
-free_strings:
-    if (str_label != NULL) {
-        free(str_label);
+    CFMutableArrayRef items = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    if (matches == NULL) {
+        return items;
     }
-    free(str_service);
-    free(str_value);
-exit:
-    return success;
+    
+    for (CFIndex i = 0; i < CFArrayGetCount(matches); ++i) {
+        CFDictionaryRef attributes = CFArrayGetValueAtIndex(matches, i);
+        CFTypeRef description = CFDictionaryGetValue(attributes, kSecAttrDescription);
+        CFTypeRef service = CFDictionaryGetValue(attributes, kSecAttrService);
+        CFTypeRef item = CFDictionaryGetValue(attributes, kSecValueRef);
+        
+        if (description == NULL || service == NULL || item == NULL || CFGetTypeID(service) != CFStringGetTypeID() ||
+            (!CFEqual(description, CFSTR(VPN_PASSWORD_DESCRIPTION)) && !CFEqual(description, CFSTR(SHARED_SECRET_DESCRIPTION)))) {
+            continue;
+        }
+        
+        /* The secrets themselves aren't read, so they aren't counted */
+        CFIndex size = 0;
+        add_attribute_size(attributes, kSecAttrService, &size);
+        add_attribute_size(attributes, kSecAttrDescription, &size);
+        add_attribute_size(attributes, kSecAttrLabel, &size);
+        add_attribute_size(attributes, kSecAttrAccount, &size);
+        CFNumberRef size_number = CFNumberCreate(NULL, kCFNumberCFIndexType, &size);
+        
+        const void *item_keys[4] = {CFSTR("service"), CFSTR("description"), CFSTR("size"), CFSTR("item")};
+        const void *item_values[4] = {service, description, size_number, item};
+        CFDictionaryRef entry = CFDictionaryCreate(NULL, item_keys, item_values, 4, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        CFArrayAppendValue(items, entry);
+        CFRelease(entry);
+        CFRelease(size_number);
+    }
+    
+    CFRelease(matches);
+    return items;
+}
+
+CFTypeRef
+copy_keychain_item(CFStringRef service)
+{
+    SecKeychainRef keychain = get_system_keychain();
+    if (keychain == NULL) {
+        return NULL;
+    }
+    
+    Arena arena;
+    init_arena(&arena);
+    
+    const char *str_service = arena_copy_utf8_chars(&arena, service);
+    
+    SecKeychainItemRef item = NULL;
+    OSStatus status = keychain_backend->find_item(keychain, str_service, NULL, NULL, &item);
+    
+    if (status != errSecSuccess && status != errSecItemNotFound) {
+        print_osstatus("Failed to get existing keychain entry", status);
+    }
+    
+    release_arena(&arena);
+    return (status == errSecSuccess) ? item : NULL;
 }
 
 Boolean
-configure_keychain(L2TPConfigRef config, CFStringRef service_id, CFStringRef shared_secret_id)
+delete_keychain_item(CFTypeRef item)
 {
-    Boolean success = FALSE;
-    OSStatus status;
+    OSStatus status = keychain_backend->delete_item((SecKeychainItemRef)item);
     
-    SecKeychainRef keychain;
-    status = SecKeychainCopyDomainDefault(kSecPreferencesDomainSystem, &keychain);
     if (status != errSecSuccess) {
-        print_osstatus("Failed to open system keychain", status);
-        goto exit;
+        print_osstatus("Failed to delete keychain entry", status);
     }
     
-    SecAccessRef access;
-    status = SecAccessCreate(CFSTR("VPNHelper"), get_trusted_app_list(), &access);
-    if (status != errSecSuccess) {
-        print_osstatus("Failed to obtain keychain access", status);
-        goto release_keychain;
+    return status == errSecSuccess;
+}
+
+Boolean
+configure_keychain(L2TPConfigRef config, CFStringRef service_id, CFStringRef shared_secret_id, KeychainItems items)
+{
+    if (items == 0) {
+        return TRUE;
     }
     
-    if (!configure_keychain_vpn_password(keychain, access, config, service_id)) {
-        goto release_access;
+    SecKeychainRef keychain = get_system_keychain();
+    if (keychain == NULL) {
+        return FALSE;
     }
     
-    if (!configure_keychain_shared_secret(keychain, access, config, shared_secret_id)) {
-        goto release_access;
+    SecAccessRef access = get_vpn_access();
+    if (access == NULL) {
+        return FALSE;
     }
     
-    success = TRUE;
+    /* Every string and attribute list for this connection comes from one
+     * arena, so the secrets in them are wiped together at the end */
+    Arena arena;
+    init_arena(&arena);
+    
+    Boolean success = (!(items & KeychainItemVPNPassword) || configure_keychain_vpn_password(keychain, access, &arena, config, service_id)) &&
+        (!(items & KeychainItemSharedSecret) || configure_keychain_shared_secret(keychain, access, &arena, config, shared_secret_id));
     
-release_access:
-    CFRelease(access);
-release_keychain:
-    CFRelease(keychain);
-exit:
+    release_arena(&arena);
     return success;
 }
@@ -3,7 +3,124 @@
 
 #include "vpn.h"
 #include <CoreFoundation/CoreFoundation.h>
+#include <Security/Security.h>
 
-Boolean configure_keychain(L2TPConfigRef config, CFStringRef service_id, CFStringRef shared_secret_id);
+typedef enum {
+    /* The item holding the VPN password, keyed by the service ID. */
+    KeychainItemVPNPassword = 1 << 0,
+    
+    /* The item holding the IPSec shared secret, keyed by the shared secret ID. */
+    KeychainItemSharedSecret = 1 << 1
+} KeychainItems;
+
+/* The Security framework calls that every keychain function below goes
+ * through, so that a fake keychain can stand in for the system one. Each
+ * returns an OSStatus, as the call it replaces does. */
+typedef struct {
+    /* Opens the keychain that items are written to. */
+    OSStatus (*copy_keychain)(SecKeychainRef *keychain);
+    
+    /* Creates the access list that new items are written with. */
+    OSStatus (*create_access)(SecAccessRef *access);
+    
+    /* Finds the generic password item with a service name. Any of length,
+     * data and item may be NULL; data must be freed with free_data(). */
+    OSStatus (*find_item)(SecKeychainRef keychain, const char *service, UInt32 *length, void **data, SecKeychainItemRef *item);
+    
+    /* Frees the data returned by find_item(). */
+    void (*free_data)(void *data);
+    
+    /* Lists every generic password item, as an array of dictionaries
+     * holding its attributes under kSecAttr keys and the item itself under
+     * kSecValueRef, or NULL if there are none. */
+    OSStatus (*list_items)(SecKeychainRef keychain, CFArrayRef *items);
+    
+    /* Changes the attributes of an item, and its data unless data is NULL. */
+    OSStatus (*modify_item)(SecKeychainItemRef item, const SecKeychainAttributeList *attributes, UInt32 length, const void *data);
+    
+    /* Creates a generic password item. */
+    OSStatus (*create_item)(SecKeychainRef keychain, SecAccessRef access, SecKeychainAttributeList *attributes, UInt32 length, const void *data);
+    
+    /* Deletes an item. */
+    OSStatus (*delete_item)(SecKeychainItemRef item);
+} KeychainBackend;
+
+/* Replaces the calls used to read, list, write and delete items.
+ * @param backend The calls to use, or NULL to go back to the system keychain.
+ *     It must outlive every later call.
+ */
+void set_keychain_backend(const KeychainBackend *backend);
+
+/* Writes the VPN password and shared secret items for a VPN connection.
+ * @param config The VPN connection configuration.
+ * @param service_id The service ID of the VPN connection.
+ * @param shared_secret_id The shared secret ID of the VPN connection.
+ * @param items The items to write. Items not included are left untouched,
+ *     and if there are none, the keychain is not opened at all.
+ * @result TRUE if the operation is successful; FALSE otherwise.
+ */
+Boolean configure_keychain(L2TPConfigRef config, CFStringRef service_id, CFStringRef shared_secret_id, KeychainItems items);
+
+/* Opens the system keychain ahead of time, so that a transaction can find
+ * out the keychain is unusable before it changes anything else.
+ * @param needs_access TRUE to also create the access object that new items
+ *     are written with.
+ * @result TRUE if the operation is successful; FALSE otherwise.
+ */
+Boolean prepare_keychain(Boolean needs_access);
+
+/* Deletes the VPN password and shared secret items of a VPN connection.
+ * Items that don't exist are ignored.
+ * @param service_id The service ID of the VPN connection.
+ * @param shared_secret_id The shared secret ID of the VPN connection.
+ * @result TRUE if the operation is successful; FALSE otherwise.
+ */
+Boolean delete_keychain_items(CFStringRef service_id, CFStringRef shared_secret_id);
+
+/* Checks whether a password stored in the system keychain has a given value.
+ * @param service The service name of the keychain item.
+ * @param password The expected password.
+ * @result TRUE if the item exists and holds the password; FALSE otherwise.
+ */
+Boolean keychain_password_matches(CFStringRef service, CFStringRef password);
+
+/* Reads a password stored in the system keychain.
+ * @param service The service name of the keychain item.
+ * @result The password, or NULL if there is no such item. The caller is
+ *     responsible for releasing it.
+ */
+CFStringRef copy_keychain_password(CFStringRef service);
+
+/* Lists the VPN password and shared secret items in the system keychain,
+ * whichever connection they belong to, in a single query.
+ * @result An array of dictionaries with the keys "service", the service
+ *     name of the item, "description", "size", the number of bytes in its
+ *     attributes, and "item", the keychain item itself; or NULL if the
+ *     keychain could not be searched. The caller is responsible for
+ *     releasing it.
+ */
+CFArrayRef copy_vpn_keychain_items(void);
+
+/* Finds the keychain item that reading a password would use, when there is
+ * more than one with the same service name.
+ * @param service The service name of the keychain item.
+ * @result The item, or NULL if there is none. The caller is responsible
+ *     for releasing it.
+ */
+CFTypeRef copy_keychain_item(CFStringRef service);
+
+/* Deletes a single keychain item.
+ * @param item A keychain item returned by copy_vpn_keychain_items().
+ * @result TRUE if the operation is successful; FALSE otherwise.
+ */
+Boolean delete_keychain_item(CFTypeRef item);
+
+/* Gets the number of trusted applications that were loaded from the on-disk
+ * cache, and the number that had to be hashed from their binaries, so far in
+ * this process.
+ * @param hits Receives the number of cache hits.
+ * @param misses Receives the number of cache misses.
+ */
+void get_trusted_app_cache_stats(unsigned int *hits, unsigned int *misses);
 
 #endif
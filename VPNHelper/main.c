@@ -1,4 +1,22 @@
 #include "vpn.h"
+#include "json.h"
+#include "manifest.h"
+#include "server.h"
+#include "keychain.h"
+#include "snapshot.h"
+#include "connection.h"
+#include "trace.h"
+#include "reconcile.h"
+#include "stream.h"
+#include "watch.h"
+#include "supervise.h"
+#include "bench.h"
+#include "probe.h"
+#include "resolve.h"
+#include "archive.h"
+#include "metrics.h"
+#include "coalesce.h"
+#include "gc.h"
 #include <err.h>
 #include <errno.h>
 #include <stdio.h>
@@ -8,15 +26,332 @@
 void
 usage(char *name)
 {
-    fprintf(stderr, "usage: %s (create|edit|delete) <args>\n\
-    create -n name -a address -u username -p password -s secret\n\
-    edit   -i serviceid [-n name] [-a address] [-u username]\n\
-                        [-p password] [-s secret]\n\
-    delete -i serviceid\n", name);
+    fprintf(stderr, "usage: %s [-v] [-T tracefile] [-M metricsfile] [-P prefs] [-S socket] [--coalesce] <command> <args>\n\
+    create     -n name -a address[,address...] -u username -p password\n\
+               -s secret [--if-absent]\n\
+    edit       (-i serviceid [-n name] | -n name) [-a address[,address...]]\n\
+               [-u username] [-p password] [-s secret]\n\
+    delete     -i serviceid [-i serviceid ...] | -f idfile\n\
+    connect    -i serviceid [-i serviceid ...] | -f idfile\n\
+               [-a address[,address...]] [-c concurrency] [-t timeout]\n\
+    disconnect -i serviceid [-i serviceid ...] | -f idfile\n\
+               [-c concurrency] [-t timeout]\n\
+    watch      [-i serviceid ...] [-f idfile]\n\
+    supervise  [-i serviceid ...] [-f idfile] [-c concurrency]\n\
+               [-t timeout] [-r retrydelay] [-m maxdelay]\n\
+    bench      -i serviceid | -I interface -g host [-l port]\n\
+               [-D duration] [-N packets]\n\
+    bench-server [-l port]\n\
+    resolve    [-i serviceid ...] [-f idfile] [--pin-ip] [--ttl seconds]\n\
+    list\n\
+    show       -i serviceid\n\
+    batch      -f manifest\n\
+    export     -f archive [-k passphrasefile]\n\
+    import     -f archive [-k passphrasefile]\n\
+    apply      -f desired [--dry-run]\n\
+    gc         [--dry-run]\n\
+    stream     [-b batchsize] [-w batchinterval]\n\
+    serve      -S socket\n", name);
 }
 
+void
+print_cache_stats(void)
+{
+    unsigned int hits, misses;
+    get_trusted_app_cache_stats(&hits, &misses);
+    fprintf(stderr, "Trusted application cache: %u hits, %u misses\n", hits, misses);
+    
+    unsigned int lock_count;
+    double lock_ms;
+    get_vpn_lock_stats(&lock_count, &lock_ms);
+    fprintf(stderr, "Preferences lock: held %u times, %.3f ms total\n", lock_count, lock_ms);
+}
+
+void
+print_service_id(CFStringRef service_id)
+{
+    char buffer[256];
+    if (CFStringGetCString(service_id, buffer, sizeof(buffer), kCFStringEncodingUTF8)) {
+        printf("Service ID: %s\n", buffer);
+    }
+}
+
+/* Performs an operation, either locally, by handing it to a running
+ * server if a socket path was given, or together with other processes if
+ * coalesce is set. */
+Boolean
+run_operation(const char *socket_path, Boolean coalesce, const VPNOperation *operation, CFStringRef *service_id)
+{
+    CFStringRef result_id = NULL;
+    Boolean success;
+    
+    if (socket_path != NULL) {
+        success = send_server_request(socket_path, operation, &result_id);
+    } else if (coalesce) {
+        success = perform_coalesced_vpn_operations(operation, 1, &result_id);
+    } else {
+        success = perform_vpn_operation(operation, &result_id);
+    }
+    
+    if (success && service_id != NULL) {
+        *service_id = result_id;
+    } else if (result_id != NULL) {
+        CFRelease(result_id);
+    }
+    
+    return success;
+}
+
+/* Reads service IDs from a file containing one ID per line. Blank lines
+ * and lines starting with '#' are ignored. */
+Boolean
+read_service_id_file(const char *path, CFMutableArrayRef service_ids)
+{
+    FILE *file = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return FALSE;
+    }
+    
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *start = line;
+        while (*start == ' ' || *start == '\t') {
+            start++;
+        }
+        
+        char *end = start + strlen(start);
+        while (end > start && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) {
+            *--end = '\0';
+        }
+        
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+        
+        CFStringRef service_id = CFStringCreateWithCString(NULL, start, kCFStringEncodingUTF8);
+        CFArrayAppendValue(service_ids, service_id);
+        CFRelease(service_id);
+    }
+    
+    if (file != stdin) {
+        fclose(file);
+    }
+    return TRUE;
+}
+
+/* Performs the entries of a manifest in a single transaction. */
 int
-main(int argc, char *argv[])
+run_manifest(CFArrayRef manifest)
+{
+    int err = 1;
+    
+    CFIndex count = CFArrayGetCount(manifest);
+    VPNOperation *operations = calloc(count + 1, sizeof(VPNOperation));
+    CFStringRef *service_ids = calloc(count + 1, sizeof(CFStringRef));
+    
+    /* Validate every entry before staging any of them */
+    for (CFIndex i = 0; i < count; ++i) {
+        if (!read_vpn_operation(CFArrayGetValueAtIndex(manifest, i), &operations[i])) {
+            fprintf(stderr, "Invalid manifest entry at index %ld\n", i);
+            goto free_operations;
+        }
+    }
+    
+    VPNTransactionRef transaction = begin_vpn_transaction();
+    if (transaction == NULL) {
+        goto free_operations;
+    }
+    
+    for (CFIndex i = 0; i < count; ++i) {
+        service_ids[i] = operations[i].service_id;
+        
+        Boolean success;
+        if (operations[i].type == VPNOperationDelete) {
+            success = delete_vpn_in_transaction(transaction, service_ids[i]);
+        } else {
+            success = create_vpn_in_transaction(transaction, &service_ids[i], &operations[i].config);
+        }
+        
+        if (!success) {
+            fprintf(stderr, "Failed to apply manifest entry at index %ld\n", i);
+            goto end_transaction;
+        }
+    }
+    
+    if (!commit_vpn_transaction(transaction)) {
+        goto end_transaction;
+    }
+    
+    for (CFIndex i = 0; i < count; ++i) {
+        print_service_id(service_ids[i]);
+    }
+    err = 0;
+    
+end_transaction:
+    end_vpn_transaction(transaction);
+free_operations:
+    for (CFIndex i = 0; i < count; ++i) {
+        /* IDs of new services were created for us; edited IDs are borrowed */
+        if (operations[i].type == VPNOperationCreate && service_ids[i] != NULL) {
+            CFRelease(service_ids[i]);
+        }
+    }
+    free(service_ids);
+    free(operations);
+    return err;
+}
+
+/* Loads a JSON file that must contain an array. */
+CFArrayRef
+copy_json_array_from_file(const char *path)
+{
+    CFTypeRef value = create_json_value_from_file(path);
+    if (value == NULL) {
+        return NULL;
+    }
+    
+    if (CFGetTypeID(value) != CFArrayGetTypeID()) {
+        fprintf(stderr, "%s must contain an array of entries\n", path);
+        CFRelease(value);
+        return NULL;
+    }
+    
+    return value;
+}
+
+/* Adds the service ID of every L2TP VPN connection to an array. */
+Boolean
+read_all_service_ids(CFMutableArrayRef service_ids)
+{
+    CFArrayRef vpn_list = copy_vpn_snapshot();
+    if (vpn_list == NULL) {
+        return FALSE;
+    }
+    
+    for (CFIndex i = 0; i < CFArrayGetCount(vpn_list); ++i) {
+        CFDictionaryRef description = CFArrayGetValueAtIndex(vpn_list, i);
+        CFArrayAppendValue(service_ids, CFDictionaryGetValue(description, CFSTR("id")));
+    }
+    
+    CFRelease(vpn_list);
+    return TRUE;
+}
+
+/* Replaces a comma separated list of candidate servers with the one that
+ * answers fastest. */
+Boolean
+select_server_address(CFStringRef *server_address)
+{
+    if (*server_address == NULL) {
+        return TRUE;
+    }
+    
+    CFStringRef fastest = copy_fastest_vpn_server(*server_address, SERVER_PROBE_TIMEOUT_MS);
+    if (fastest == NULL) {
+        return FALSE;
+    }
+    
+    CFRelease(*server_address);
+    *server_address = fastest;
+    return TRUE;
+}
+
+/* Finds a connection that create --if-absent would duplicate: one with the
+ * same name and any of the candidate server addresses. */
+CFStringRef
+copy_existing_vpn_id(CFStringRef service_name, CFStringRef server_addresses)
+{
+    CFStringRef existing_id = NULL;
+    CFArrayRef candidates = CFStringCreateArrayBySeparatingStrings(NULL, server_addresses, CFSTR(","));
+    
+    for (CFIndex i = 0; i < CFArrayGetCount(candidates) && existing_id == NULL; ++i) {
+        CFMutableStringRef candidate = CFStringCreateMutableCopy(NULL, 0, CFArrayGetValueAtIndex(candidates, i));
+        CFStringTrimWhitespace(candidate);
+        existing_id = copy_vpn_id_with_content(service_name, candidate);
+        CFRelease(candidate);
+    }
+    
+    CFRelease(candidates);
+    return existing_id;
+}
+
+/* Resolves a name to the service ID of the only connection with it. */
+CFStringRef
+copy_vpn_id_for_name(CFStringRef service_name)
+{
+    CFArrayRef service_ids = copy_vpn_ids_with_name(service_name);
+    if (service_ids == NULL) {
+        fprintf(stderr, "Failed to read VPN connections\n");
+        return NULL;
+    }
+    
+    CFStringRef service_id = NULL;
+    CFIndex count = CFArrayGetCount(service_ids);
+    if (count == 1) {
+        service_id = CFRetain(CFArrayGetValueAtIndex(service_ids, 0));
+    } else if (count == 0) {
+        fprintf(stderr, "No VPN connection has that name (-n)\n");
+    } else {
+        fprintf(stderr, "%ld VPN connections have that name, must specify VPN service ID (-i)\n", count);
+    }
+    
+    CFRelease(service_ids);
+    return service_id;
+}
+
+int
+run_batch(const char *manifest_path)
+{
+    CFArrayRef manifest = copy_json_array_from_file(manifest_path);
+    if (manifest == NULL) {
+        return 1;
+    }
+    
+    int err = run_manifest(manifest);
+    CFRelease(manifest);
+    return err;
+}
+
+int
+run_apply(const char *desired_path, Boolean dry_run)
+{
+    int err = 1;
+    
+    CFArrayRef desired = copy_json_array_from_file(desired_path);
+    if (desired == NULL) {
+        goto exit;
+    }
+    
+    CFArrayRef current = copy_vpn_list();
+    if (current == NULL) {
+        goto release_desired;
+    }
+    
+    CFArrayRef plan = create_vpn_plan(desired, current);
+    if (plan == NULL) {
+        goto release_current;
+    }
+    
+    print_vpn_plan(stdout, plan);
+    
+    if (dry_run || CFArrayGetCount(plan) == 0) {
+        err = 0;
+    } else {
+        err = run_manifest(plan);
+    }
+    
+    CFRelease(plan);
+release_current:
+    CFRelease(current);
+release_desired:
+    CFRelease(desired);
+exit:
+    return err;
+}
+
+int
+run_main(int argc, char *argv[])
 {
     char *program_name = argv[0];
     
@@ -31,6 +366,30 @@ main(int argc, char *argv[])
     CFStringRef username = NULL;
     CFStringRef password = NULL;
     CFStringRef shared_secret = NULL;
+    CFMutableArrayRef service_ids = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    char *file_path = NULL;
+    char *socket_path = NULL;
+    char *passphrase_path = NULL;
+    char *metrics_path = NULL;
+    int max_concurrent = 0;
+    double timeout = 60;
+    Boolean dry_run = FALSE;
+    Boolean custom_prefs = FALSE;
+    Boolean if_absent = FALSE;
+    Boolean coalesce = FALSE;
+    int batch_size = 64;
+    double batch_interval = 100;
+    double retry_delay = 1;
+    double max_retry_delay = 60;
+    Boolean pin_ip = FALSE;
+    double dns_ttl = DEFAULT_DNS_TTL;
+    BenchOptions bench_options = {
+        .host = NULL,
+        .port = DEFAULT_BENCH_PORT,
+        .interface = NULL,
+        .duration = 5,
+        .packets = 100
+    };
     
     const struct option long_options[] = {
         {"service-id",       required_argument, NULL, 'i'},
@@ -39,15 +398,39 @@ main(int argc, char *argv[])
         {"username",         required_argument, NULL, 'u'},
         {"password",         required_argument, NULL, 'p'},
         {"shared-secret",    required_argument, NULL, 's'},
+        {"file",             required_argument, NULL, 'f'},
+        {"prefs",            required_argument, NULL, 'P'},
+        {"socket",           required_argument, NULL, 'S'},
+        {"verbose",          no_argument,       NULL, 'v'},
+        {"concurrency",      required_argument, NULL, 'c'},
+        {"timeout",          required_argument, NULL, 't'},
+        {"trace",            required_argument, NULL, 'T'},
+        {"dry-run",          no_argument,       NULL, 'd'},
+        {"batch-size",       required_argument, NULL, 'b'},
+        {"batch-interval",   required_argument, NULL, 'w'},
+        {"retry-delay",      required_argument, NULL, 'r'},
+        {"max-retry-delay",  required_argument, NULL, 'm'},
+        {"interface",        required_argument, NULL, 'I'},
+        {"target",           required_argument, NULL, 'g'},
+        {"port",             required_argument, NULL, 'l'},
+        {"duration",         required_argument, NULL, 'D'},
+        {"packets",          required_argument, NULL, 'N'},
+        {"pin-ip",           no_argument,       NULL, 'A'},
+        {"ttl",              required_argument, NULL, 'L'},
+        {"passphrase-file",  required_argument, NULL, 'k'},
+        {"metrics-file",     required_argument, NULL, 'M'},
+        {"if-absent",        no_argument,       NULL, 'x'},
+        {"coalesce",         no_argument,       NULL, 'C'},
         {NULL,               no_argument,       NULL, 0  }
     };
     
     int opt;
     int opt_index = 0;
-    while ((opt = getopt_long(argc, argv, "i:n:a:u:p:s:", long_options, &opt_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "i:n:a:u:p:s:f:P:S:vc:t:T:db:w:r:m:I:g:l:D:N:AL:k:M:xC", long_options, &opt_index)) != -1) {
         switch (opt) {
             case 'i':
                 service_id = CFStringCreateWithCString(NULL, optarg, kCFStringEncodingUTF8);
+                CFArrayAppendValue(service_ids, service_id);
                 break;
             case 'n':
                 service_name = CFStringCreateWithCString(NULL, optarg, kCFStringEncodingUTF8);
@@ -64,6 +447,79 @@ main(int argc, char *argv[])
             case 's':
                 shared_secret = CFStringCreateWithCString(NULL, optarg, kCFStringEncodingUTF8);
                 break;
+            case 'f':
+                file_path = optarg;
+                break;
+            case 'S':
+                socket_path = optarg;
+                break;
+            case 'v':
+                atexit(print_cache_stats);
+                break;
+            case 'c':
+                max_concurrent = atoi(optarg);
+                break;
+            case 't':
+                timeout = atof(optarg);
+                break;
+            case 'T':
+                enable_tracing(optarg);
+                break;
+            case 'd':
+                dry_run = TRUE;
+                break;
+            case 'b':
+                batch_size = atoi(optarg);
+                break;
+            case 'w':
+                batch_interval = atof(optarg);
+                break;
+            case 'r':
+                retry_delay = atof(optarg);
+                break;
+            case 'm':
+                max_retry_delay = atof(optarg);
+                break;
+            case 'I':
+                bench_options.interface = optarg;
+                break;
+            case 'g':
+                bench_options.host = optarg;
+                break;
+            case 'l':
+                bench_options.port = optarg;
+                break;
+            case 'D':
+                bench_options.duration = atof(optarg);
+                break;
+            case 'N':
+                bench_options.packets = atoi(optarg);
+                break;
+            case 'A':
+                pin_ip = TRUE;
+                break;
+            case 'L':
+                dns_ttl = atof(optarg);
+                break;
+            case 'k':
+                passphrase_path = optarg;
+                break;
+            case 'M':
+                metrics_path = optarg;
+                break;
+            case 'x':
+                if_absent = TRUE;
+                break;
+            case 'C':
+                coalesce = TRUE;
+                break;
+            case 'P': {
+                custom_prefs = TRUE;
+                CFStringRef prefs_id = CFStringCreateWithCString(NULL, optarg, kCFStringEncodingUTF8);
+                set_vpn_preferences_id(prefs_id);
+                CFRelease(prefs_id);
+                break;
+            }
             case '?':
             default:
                 usage(program_name);
@@ -79,6 +535,10 @@ main(int argc, char *argv[])
     }
     
     char *mode_str = argv[argc-1];
+    if (metrics_path != NULL) {
+        enable_metrics(metrics_path, mode_str);
+    }
+    
     if (strcmp(mode_str, "create") == 0) {
         int err = 0;
         
@@ -112,19 +572,39 @@ main(int argc, char *argv[])
             err = 1;
         }
         
+        /* Checked against every candidate before probing, so a retried
+         * create finds the connection whichever server was picked */
+        if (!err && if_absent) {
+            CFStringRef existing_id = copy_existing_vpn_id(service_name, server_address);
+            if (existing_id != NULL) {
+                printf("VPN connection already exists\n");
+                print_service_id(existing_id);
+                CFRelease(existing_id);
+                return 0;
+            }
+        }
+        
+        if (!err && !select_server_address(&server_address)) {
+            err = 1;
+        }
+        
         if (!err) {
-            L2TPConfig config = {
-                .service_name = service_name,
-                .server_address = server_address,
-                .username = username,
-                .password = password,
-                .shared_secret = shared_secret,
-                .send_all_traffic = kCFBooleanTrue
+            VPNOperation operation = {
+                .type = VPNOperationCreate,
+                .service_id = NULL,
+                .config = {
+                    .service_name = service_name,
+                    .server_address = server_address,
+                    .username = username,
+                    .password = password,
+                    .shared_secret = shared_secret,
+                    .send_all_traffic = kCFBooleanTrue
+                }
             };
             
-            if (create_vpn(&service_id, &config)) {
+            if (run_operation(socket_path, coalesce, &operation, &service_id)) {
                 printf("Everything went okay!\n");
-                printf("Service ID: %s\n", CFStringGetCStringPtr(service_id, kCFStringEncodingUTF8));
+                print_service_id(service_id);
                 err = 0;
             } else {
                 fprintf(stderr, "Something went wrong!\n");
@@ -136,22 +616,43 @@ main(int argc, char *argv[])
     } else if (strcmp(mode_str, "edit") == 0) {
         int err = 0;
         
-        if (service_id == NULL) {
-            fprintf(stderr, "Must specify VPN service ID (-i)\n");
+        if (CFArrayGetCount(service_ids) > 1) {
+            fprintf(stderr, "Cannot specify more than one VPN service ID (-i)\n");
+            err = 1;
+        }
+        
+        /* Without an ID, the name picks the connection rather than renaming it */
+        if (!err && service_id == NULL) {
+            if (service_name == NULL) {
+                fprintf(stderr, "Must specify VPN service ID (-i) or name (-n)\n");
+                err = 1;
+            } else {
+                service_id = copy_vpn_id_for_name(service_name);
+                CFRelease(service_name);
+                service_name = NULL;
+                err = (service_id == NULL);
+            }
+        }
+        
+        if (!err && !select_server_address(&server_address)) {
             err = 1;
         }
         
         if (!err) {
-            L2TPConfig config = {
-                .service_name = service_name,
-                .server_address = server_address,
-                .username = username,
-                .password = password,
-                .shared_secret = shared_secret,
-                .send_all_traffic = NULL
+            VPNOperation operation = {
+                .type = VPNOperationEdit,
+                .service_id = service_id,
+                .config = {
+                    .service_name = service_name,
+                    .server_address = server_address,
+                    .username = username,
+                    .password = password,
+                    .shared_secret = shared_secret,
+                    .send_all_traffic = NULL
+                }
             };
             
-            if (create_vpn(&service_id, &config)) {
+            if (run_operation(socket_path, coalesce, &operation, NULL)) {
                 printf("Everything went okay!\n");
                 err = 0;
             } else {
@@ -164,8 +665,12 @@ main(int argc, char *argv[])
     } else if (strcmp(mode_str, "delete") == 0) {
         int err = 0;
         
-        if (service_id == NULL) {
-            fprintf(stderr, "Must specify VPN service ID (-i)\n");
+        if (file_path != NULL && !read_service_id_file(file_path, service_ids)) {
+            err = 1;
+        }
+        
+        if (!err && CFArrayGetCount(service_ids) == 0) {
+            fprintf(stderr, "Must specify VPN service ID (-i) or ID file (-f)\n");
             err = 1;
         }
         
@@ -195,7 +700,34 @@ main(int argc, char *argv[])
         }
         
         if (!err) {
-            if (delete_vpn(service_id)) {
+            Boolean success;
+            
+            if (socket_path == NULL && coalesce) {
+                /* Queued as one request, so they succeed or fail together */
+                CFIndex count = CFArrayGetCount(service_ids);
+                VPNOperation *operations = calloc(count, sizeof(VPNOperation));
+                for (CFIndex i = 0; i < count; ++i) {
+                    operations[i].type = VPNOperationDelete;
+                    operations[i].service_id = CFArrayGetValueAtIndex(service_ids, i);
+                }
+                success = perform_coalesced_vpn_operations(operations, count, NULL);
+                free(operations);
+            } else if (socket_path != NULL) {
+                /* The server takes one operation per request, so each
+                 * deletion stands on its own */
+                success = TRUE;
+                for (CFIndex i = 0; i < CFArrayGetCount(service_ids); ++i) {
+                    VPNOperation operation = {
+                        .type = VPNOperationDelete,
+                        .service_id = CFArrayGetValueAtIndex(service_ids, i)
+                    };
+                    success = run_operation(socket_path, coalesce, &operation, NULL) && success;
+                }
+            } else {
+                success = delete_vpns(service_ids);
+            }
+            
+            if (success) {
                 printf("Everything went okay!\n");
                 err = 0;
             } else {
@@ -205,6 +737,346 @@ main(int argc, char *argv[])
         }
         
         return err;
+    } else if (strcmp(mode_str, "connect") == 0 || strcmp(mode_str, "disconnect") == 0) {
+        int err = 0;
+        
+        if (file_path != NULL && !read_service_id_file(file_path, service_ids)) {
+            err = 1;
+        }
+        
+        if (!err && CFArrayGetCount(service_ids) == 0) {
+            fprintf(stderr, "Must specify VPN service ID (-i) or ID file (-f)\n");
+            err = 1;
+        }
+        
+        Boolean connect = (strcmp(mode_str, "connect") == 0);
+        
+        if (service_name != NULL || (!connect && server_address != NULL) || username != NULL ||
+            password != NULL || shared_secret != NULL) {
+            fprintf(stderr, "Cannot specify VPN settings\n");
+            err = 1;
+        }
+        
+        if (timeout <= 0) {
+            fprintf(stderr, "Timeout (-t) must be positive\n");
+            err = 1;
+        }
+        
+        /* Point every connection at the fastest candidate before connecting */
+        if (!err && server_address != NULL) {
+            if (!select_server_address(&server_address)) {
+                err = 1;
+            }
+            
+            /* One commit, so configd only reconfigures once before connecting */
+            L2TPConfig config = {.server_address = server_address};
+            VPNTransactionRef transaction = err ? NULL : begin_vpn_transaction();
+            if (transaction == NULL) {
+                err = 1;
+            }
+            
+            CFIndex count = CFArrayGetCount(service_ids);
+            CFStringRef *connection_ids = calloc(count + 1, sizeof(CFStringRef));
+            for (CFIndex i = 0; i < count && !err; ++i) {
+                connection_ids[i] = CFArrayGetValueAtIndex(service_ids, i);
+                if (!create_vpn_in_transaction(transaction, &connection_ids[i], &config)) {
+                    err = 1;
+                }
+            }
+            
+            if (transaction != NULL) {
+                if (!err && !commit_vpn_transaction(transaction)) {
+                    err = 1;
+                }
+                end_vpn_transaction(transaction);
+            }
+            free(connection_ids);
+        }
+        
+        if (!err) {
+            if (change_vpn_connections(service_ids, connect, max_concurrent, timeout)) {
+                printf("Everything went okay!\n");
+            } else {
+                fprintf(stderr, "Something went wrong!\n");
+                err = 1;
+            }
+        }
+        
+        return err;
+    } else if (strcmp(mode_str, "watch") == 0) {
+        int err = 0;
+        
+        if (file_path != NULL && !read_service_id_file(file_path, service_ids)) {
+            err = 1;
+        }
+        
+        if (service_name != NULL || server_address != NULL || username != NULL ||
+            password != NULL || shared_secret != NULL) {
+            fprintf(stderr, "Cannot specify VPN settings\n");
+            err = 1;
+        }
+        
+        if (err) {
+            return err;
+        }
+        
+        /* Without any IDs, watch every L2TP connection */
+        if (CFArrayGetCount(service_ids) == 0 && !read_all_service_ids(service_ids)) {
+            fprintf(stderr, "Something went wrong!\n");
+            return 1;
+        }
+        
+        return run_watch(service_ids, watch_connection_events, stdout);
+    } else if (strcmp(mode_str, "supervise") == 0) {
+        int err = 0;
+        
+        if (file_path != NULL && !read_service_id_file(file_path, service_ids)) {
+            err = 1;
+        }
+        
+        if (service_name != NULL || server_address != NULL || username != NULL ||
+            password != NULL || shared_secret != NULL) {
+            fprintf(stderr, "Cannot specify VPN settings\n");
+            err = 1;
+        }
+        
+        if (timeout <= 0) {
+            fprintf(stderr, "Timeout (-t) must be positive\n");
+            err = 1;
+        }
+        
+        if (retry_delay <= 0 || max_retry_delay < retry_delay) {
+            fprintf(stderr, "Retry delay (-r) must be positive and no more than the maximum (-m)\n");
+            err = 1;
+        }
+        
+        if (err) {
+            return err;
+        }
+        
+        /* Without any IDs, keep every L2TP connection up */
+        if (CFArrayGetCount(service_ids) == 0 && !read_all_service_ids(service_ids)) {
+            fprintf(stderr, "Something went wrong!\n");
+            return 1;
+        }
+        
+        SupervisorPolicy policy = {
+            .base_delay = retry_delay * 1000,
+            .max_delay = max_retry_delay * 1000,
+            .attempt_timeout = timeout * 1000,
+            .max_concurrent = max_concurrent
+        };
+        return run_supervise(service_ids, policy);
+    } else if (strcmp(mode_str, "bench") == 0) {
+        int err = 0;
+        
+        if ((service_id == NULL) == (bench_options.interface == NULL) || CFArrayGetCount(service_ids) > 1) {
+            fprintf(stderr, "Must specify either one VPN service ID (-i) or an interface (-I)\n");
+            err = 1;
+        }
+        
+        if (bench_options.host == NULL) {
+            fprintf(stderr, "Must specify bench server host (-g)\n");
+            err = 1;
+        }
+        
+        if (bench_options.duration <= 0) {
+            fprintf(stderr, "Duration (-D) must be positive\n");
+            err = 1;
+        }
+        
+        if (bench_options.packets <= 0) {
+            fprintf(stderr, "Packet count (-N) must be positive\n");
+            err = 1;
+        }
+        
+        if (err) {
+            return err;
+        }
+        
+        return run_bench(&bench_options, service_id);
+    } else if (strcmp(mode_str, "bench-server") == 0) {
+        return run_bench_server(bench_options.port);
+    } else if (strcmp(mode_str, "resolve") == 0) {
+        int err = 0;
+        
+        if (file_path != NULL && !read_service_id_file(file_path, service_ids)) {
+            err = 1;
+        }
+        
+        if (service_name != NULL || server_address != NULL || username != NULL ||
+            password != NULL || shared_secret != NULL) {
+            fprintf(stderr, "Cannot specify VPN settings\n");
+            err = 1;
+        }
+        
+        if (dns_ttl <= 0) {
+            fprintf(stderr, "TTL (--ttl) must be positive\n");
+            err = 1;
+        }
+        
+        if (err) {
+            return err;
+        }
+        
+        return run_resolve(service_ids, pin_ip, dns_ttl);
+    } else if (strcmp(mode_str, "list") == 0 || strcmp(mode_str, "show") == 0) {
+        Boolean is_show = (strcmp(mode_str, "show") == 0);
+        int err = 0;
+        
+        if (is_show && CFArrayGetCount(service_ids) != 1) {
+            fprintf(stderr, "Must specify exactly one VPN service ID (-i)\n");
+            err = 1;
+        }
+        
+        if (!is_show && service_id != NULL) {
+            fprintf(stderr, "Cannot specify VPN service ID (-i)\n");
+            err = 1;
+        }
+        
+        if (service_name != NULL || server_address != NULL || username != NULL ||
+            password != NULL || shared_secret != NULL) {
+            fprintf(stderr, "Cannot specify VPN settings\n");
+            err = 1;
+        }
+        
+        if (err) {
+            return err;
+        }
+        
+        CFArrayRef snapshot = copy_vpn_snapshot();
+        if (snapshot == NULL) {
+            fprintf(stderr, "Something went wrong!\n");
+            return 1;
+        }
+        
+        /* Staleness depends on the time, so it can't be part of the snapshot */
+        CFArrayRef vpn_list = create_vpn_list_with_staleness(snapshot);
+        CFRelease(snapshot);
+        
+        if (is_show) {
+            CFDictionaryRef description = find_vpn_description(vpn_list, service_id);
+            if (description != NULL) {
+                write_json_value(stdout, description);
+                printf("\n");
+            } else {
+                fprintf(stderr, "No such VPN service\n");
+                err = 1;
+            }
+        } else {
+            write_json_value(stdout, vpn_list);
+            printf("\n");
+        }
+        
+        CFRelease(vpn_list);
+        return err;
+    } else if (strcmp(mode_str, "batch") == 0) {
+        int err = 0;
+        
+        if (file_path == NULL) {
+            fprintf(stderr, "Must specify manifest file (-f)\n");
+            err = 1;
+        }
+        
+        if (service_id != NULL || service_name != NULL || server_address != NULL ||
+            username != NULL || password != NULL || shared_secret != NULL) {
+            fprintf(stderr, "Cannot specify VPN settings outside of the manifest\n");
+            err = 1;
+        }
+        
+        if (!err) {
+            err = run_batch(file_path);
+            if (!err) {
+                printf("Everything went okay!\n");
+            } else {
+                fprintf(stderr, "Something went wrong!\n");
+            }
+        }
+        
+        return err;
+    } else if (strcmp(mode_str, "export") == 0 || strcmp(mode_str, "import") == 0) {
+        Boolean is_export = (strcmp(mode_str, "export") == 0);
+        
+        if (file_path == NULL) {
+            fprintf(stderr, "Must specify archive file (-f)\n");
+            return 1;
+        }
+        
+        if (service_id != NULL || service_name != NULL || server_address != NULL ||
+            username != NULL || password != NULL || shared_secret != NULL) {
+            fprintf(stderr, "Cannot specify VPN settings outside of the archive\n");
+            return 1;
+        }
+        
+        if (is_export) {
+            return run_export(file_path, passphrase_path);
+        } else {
+            return run_import(file_path, passphrase_path);
+        }
+    } else if (strcmp(mode_str, "apply") == 0) {
+        int err = 0;
+        
+        if (file_path == NULL) {
+            fprintf(stderr, "Must specify desired state file (-f)\n");
+            err = 1;
+        }
+        
+        if (service_id != NULL || service_name != NULL || server_address != NULL ||
+            username != NULL || password != NULL || shared_secret != NULL) {
+            fprintf(stderr, "Cannot specify VPN settings outside of the desired state file\n");
+            err = 1;
+        }
+        
+        if (!err) {
+            err = run_apply(file_path, dry_run);
+            if (err) {
+                fprintf(stderr, "Something went wrong!\n");
+            } else if (!dry_run) {
+                printf("Everything went okay!\n");
+            }
+        }
+        
+        return err;
+    } else if (strcmp(mode_str, "gc") == 0) {
+        if (service_id != NULL || service_name != NULL || server_address != NULL ||
+            username != NULL || password != NULL || shared_secret != NULL) {
+            fprintf(stderr, "Cannot specify VPN settings for gc\n");
+            return 1;
+        }
+        
+        /* Another preferences file doesn't own the system's keychain items */
+        return run_gc(dry_run, !custom_prefs);
+    } else if (strcmp(mode_str, "stream") == 0) {
+        int err = 0;
+        
+        if (service_id != NULL || service_name != NULL || server_address != NULL ||
+            username != NULL || password != NULL || shared_secret != NULL) {
+            fprintf(stderr, "Cannot specify VPN settings outside of the stream\n");
+            err = 1;
+        }
+        
+        if (batch_size <= 0) {
+            fprintf(stderr, "Batch size (-b) must be positive\n");
+            err = 1;
+        }
+        
+        if (batch_interval < 0) {
+            fprintf(stderr, "Batch interval (-w) must not be negative\n");
+            err = 1;
+        }
+        
+        if (err) {
+            return err;
+        }
+        
+        return run_stream(STDIN_FILENO, stdout, batch_size, batch_interval);
+    } else if (strcmp(mode_str, "serve") == 0) {
+        if (socket_path == NULL) {
+            fprintf(stderr, "Must specify socket path (-S)\n");
+            return 1;
+        }
+        
+        return run_server(socket_path);
     } else {
         usage(program_name);
         return 1;
@@ -212,3 +1084,11 @@ main(int argc, char *argv[])
     
     return 0;
 }
+
+int
+main(int argc, char *argv[])
+{
+    int err = run_main(argc, argv);
+    set_metrics_exit_status(err);
+    return err;
+}
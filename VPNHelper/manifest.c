@@ -0,0 +1,238 @@
+#include "manifest.h"
+#include <stdio.h>
+
+Boolean
+read_manifest_string(CFDictionaryRef object, CFStringRef key, CFStringRef *value)
+{
+    CFTypeRef raw_value = CFDictionaryGetValue(object, key);
+    
+    if (raw_value == NULL || raw_value == kCFNull) {
+        *value = NULL;
+        return TRUE;
+    }
+    
+    if (CFGetTypeID(raw_value) != CFStringGetTypeID()) {
+        fprintf(stderr, "Manifest entry member \"%s\" must be a string\n", CFStringGetCStringPtr(key, kCFStringEncodingUTF8));
+        return FALSE;
+    }
+    
+    *value = raw_value;
+    return TRUE;
+}
+
+Boolean
+read_manifest_boolean(CFDictionaryRef object, CFStringRef key, CFBooleanRef *value)
+{
+    CFTypeRef raw_value = CFDictionaryGetValue(object, key);
+    
+    if (raw_value == NULL || raw_value == kCFNull) {
+        *value = NULL;
+        return TRUE;
+    }
+    
+    if (CFGetTypeID(raw_value) != CFBooleanGetTypeID()) {
+        fprintf(stderr, "Manifest entry member \"%s\" must be a boolean\n", CFStringGetCStringPtr(key, kCFStringEncodingUTF8));
+        return FALSE;
+    }
+    
+    *value = raw_value;
+    return TRUE;
+}
+
+Boolean
+read_vpn_operation(CFDictionaryRef object, VPNOperation *operation)
+{
+    if (CFGetTypeID(object) != CFDictionaryGetTypeID()) {
+        fprintf(stderr, "Manifest entry must be an object\n");
+        return FALSE;
+    }
+    
+    CFStringRef action;
+    L2TPConfig *config = &operation->config;
+    
+    if (!read_manifest_string(object, CFSTR("action"), &action) ||
+        !read_manifest_string(object, CFSTR("id"), &operation->service_id) ||
+        !read_manifest_string(object, CFSTR("name"), &config->service_name) ||
+        !read_manifest_string(object, CFSTR("address"), &config->server_address) ||
+        !read_manifest_string(object, CFSTR("username"), &config->username) ||
+        !read_manifest_string(object, CFSTR("password"), &config->password) ||
+        !read_manifest_string(object, CFSTR("secret"), &config->shared_secret) ||
+        !read_manifest_boolean(object, CFSTR("send_all_traffic"), &config->send_all_traffic)) {
+        return FALSE;
+    }
+    
+    int err = 0;
+    
+    if (action != NULL && CFEqual(action, CFSTR("create"))) {
+        operation->type = VPNOperationCreate;
+        
+        if (operation->service_id != NULL) {
+            fprintf(stderr, "Cannot specify VPN service ID (\"id\")\n");
+            err = 1;
+        }
+        
+        if (config->service_name == NULL) {
+            fprintf(stderr, "Must specify VPN name (\"name\")\n");
+            err = 1;
+        }
+        
+        if (config->server_address == NULL) {
+            fprintf(stderr, "Must specify server address (\"address\")\n");
+            err = 1;
+        }
+        
+        if (config->username == NULL) {
+            fprintf(stderr, "Must specify username (\"username\")\n");
+            err = 1;
+        }
+        
+        if (config->password == NULL) {
+            fprintf(stderr, "Must specify password (\"password\")\n");
+            err = 1;
+        }
+        
+        if (config->shared_secret == NULL) {
+            fprintf(stderr, "Must specify shared secret (\"secret\")\n");
+            err = 1;
+        }
+        
+        if (config->send_all_traffic == NULL) {
+            config->send_all_traffic = kCFBooleanTrue;
+        }
+    } else if (action != NULL && CFEqual(action, CFSTR("edit"))) {
+        operation->type = VPNOperationEdit;
+        
+        if (operation->service_id == NULL) {
+            fprintf(stderr, "Must specify VPN service ID (\"id\")\n");
+            err = 1;
+        }
+    } else if (action != NULL && CFEqual(action, CFSTR("delete"))) {
+        operation->type = VPNOperationDelete;
+        
+        if (operation->service_id == NULL) {
+            fprintf(stderr, "Must specify VPN service ID (\"id\")\n");
+            err = 1;
+        }
+        
+        if (config->service_name != NULL || config->server_address != NULL ||
+            config->username != NULL || config->password != NULL ||
+            config->shared_secret != NULL || config->send_all_traffic != NULL) {
+            fprintf(stderr, "Cannot specify VPN settings when deleting\n");
+            err = 1;
+        }
+    } else {
+        fprintf(stderr, "Manifest entry action must be \"create\", \"edit\" or \"delete\"\n");
+        err = 1;
+    }
+    
+    return !err;
+}
+
+void
+set_manifest_value(CFMutableDictionaryRef object, CFStringRef key, CFTypeRef value)
+{
+    if (value != NULL) {
+        CFDictionarySetValue(object, key, value);
+    }
+}
+
+CFDictionaryRef
+create_vpn_operation_object(const VPNOperation *operation)
+{
+    CFMutableDictionaryRef object = CFDictionaryCreateMutable(
+        NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+    );
+    
+    CFStringRef action;
+    switch (operation->type) {
+        case VPNOperationCreate:
+            action = CFSTR("create");
+            break;
+        case VPNOperationEdit:
+            action = CFSTR("edit");
+            break;
+        case VPNOperationDelete:
+        default:
+            action = CFSTR("delete");
+            break;
+    }
+    
+    const L2TPConfig *config = &operation->config;
+    set_manifest_value(object, CFSTR("action"), action);
+    set_manifest_value(object, CFSTR("id"), operation->service_id);
+    set_manifest_value(object, CFSTR("name"), config->service_name);
+    set_manifest_value(object, CFSTR("address"), config->server_address);
+    set_manifest_value(object, CFSTR("username"), config->username);
+    set_manifest_value(object, CFSTR("password"), config->password);
+    set_manifest_value(object, CFSTR("secret"), config->shared_secret);
+    set_manifest_value(object, CFSTR("send_all_traffic"), config->send_all_traffic);
+    
+    return object;
+}
+
+Boolean
+perform_vpn_operation(const VPNOperation *operation, CFStringRef *service_id)
+{
+    switch (operation->type) {
+        case VPNOperationCreate:
+            *service_id = NULL;
+            return create_vpn(service_id, &operation->config);
+        case VPNOperationEdit:
+            *service_id = CFRetain(operation->service_id);
+            return create_vpn(service_id, &operation->config);
+        case VPNOperationDelete:
+            *service_id = CFRetain(operation->service_id);
+            return delete_vpn(operation->service_id);
+    }
+    
+    return FALSE;
+}
+
+Boolean
+perform_vpn_operations(const VPNOperation *operations, CFIndex count, CFStringRef *service_ids)
+{
+    Boolean success = FALSE;
+    
+    for (CFIndex i = 0; i < count; ++i) {
+        service_ids[i] = NULL;
+    }
+    
+    VPNTransactionRef transaction = begin_vpn_transaction();
+    if (transaction == NULL) {
+        goto exit;
+    }
+    
+    for (CFIndex i = 0; i < count; ++i) {
+        const VPNOperation *operation = &operations[i];
+        if (operation->service_id != NULL) {
+            service_ids[i] = CFRetain(operation->service_id);
+        }
+        
+        /* The IDs of new services are filled in by the commit */
+        Boolean staged;
+        if (operation->type == VPNOperationDelete) {
+            staged = delete_vpn_in_transaction(transaction, operation->service_id);
+        } else {
+            staged = create_vpn_in_transaction(transaction, &service_ids[i], &operation->config);
+        }
+        
+        if (!staged) {
+            goto end_transaction;
+        }
+    }
+    
+    success = commit_vpn_transaction(transaction);
+    
+end_transaction:
+    end_vpn_transaction(transaction);
+exit:
+    if (!success) {
+        for (CFIndex i = 0; i < count; ++i) {
+            if (service_ids[i] != NULL) {
+                CFRelease(service_ids[i]);
+                service_ids[i] = NULL;
+            }
+        }
+    }
+    return success;
+}
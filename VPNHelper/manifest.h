@@ -0,0 +1,74 @@
+#ifndef VPNHELPER_MANIFEST_H
+#define VPNHELPER_MANIFEST_H
+
+#include "vpn.h"
+#include <CoreFoundation/CoreFoundation.h>
+
+typedef enum {
+    /* Create a new VPN connection. */
+    VPNOperationCreate,
+    
+    /* Modify an existing VPN connection. */
+    VPNOperationEdit,
+    
+    /* Delete an existing VPN connection. */
+    VPNOperationDelete
+} VPNOperationType;
+
+typedef struct {
+    /* What to do with the VPN connection. */
+    VPNOperationType type;
+    
+    /* The service ID of the VPN connection, or NULL when creating. */
+    CFStringRef service_id;
+    
+    /* The VPN connection configuration. */
+    L2TPConfig config;
+} VPNOperation;
+
+/* Reads an operation from its JSON representation, which is an object
+ * of the form:
+ *
+ *     {"action": "create" | "edit" | "delete", "id": ..., "name": ...,
+ *      "address": ...,
+ *      "username": ..., "password": ..., "secret": ...,
+ *      "send_all_traffic": true | false}
+ *
+ * The members have the same meaning and requirements as the command line
+ * arguments of the corresponding action.
+ * @param object The parsed JSON object.
+ * @param operation Receives the operation. The strings it contains are not
+ *     retained, and are only valid for as long as the object is.
+ * @result TRUE if the object describes a valid operation; FALSE otherwise.
+ */
+Boolean read_vpn_operation(CFDictionaryRef object, VPNOperation *operation);
+
+/* Creates the JSON representation of an operation, as accepted by
+ * read_vpn_operation().
+ * @param operation The operation.
+ * @result The JSON object. The caller is responsible for releasing it.
+ */
+CFDictionaryRef create_vpn_operation_object(const VPNOperation *operation);
+
+/* Performs an operation in its own transaction.
+ * @param operation The operation to perform.
+ * @param service_id Receives the service ID of the VPN connection that was
+ *     created, modified or deleted. The caller is responsible for releasing
+ *     it, if it is not NULL.
+ * @result TRUE if the operation is successful; FALSE otherwise.
+ */
+Boolean perform_vpn_operation(const VPNOperation *operation, CFStringRef *service_id);
+
+/* Performs several operations in a single transaction, so either all of
+ * them take effect or, unless the transaction fails after committing (see
+ * is_vpn_transaction_committed()), none of them do.
+ * @param operations The operations to perform.
+ * @param count The number of operations.
+ * @param service_ids Receives the service ID of the VPN connection that each
+ *     operation created, modified or deleted. Every entry is NULL on
+ *     failure. The caller is responsible for releasing them.
+ * @result TRUE if every operation is successful; FALSE otherwise.
+ */
+Boolean perform_vpn_operations(const VPNOperation *operations, CFIndex count, CFStringRef *service_ids);
+
+#endif
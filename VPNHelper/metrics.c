@@ -0,0 +1,367 @@
+#include "metrics.h"
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#define METRIC_RUNS "vpnhelper_runs_total"
+#define METRIC_PHASE_DURATION "vpnhelper_phase_duration_seconds"
+#define METRIC_FAILURES "vpnhelper_failures_total"
+
+/* Upper bounds of the latency histogram buckets, in seconds. The last
+ * bucket, +Inf, is implied. */
+const double bucket_bounds[] = {0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 30};
+#define BUCKET_COUNT (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]))
+
+typedef struct {
+    /* The name of the phase. */
+    const char *name;
+    
+    /* The number of spans in each bucket, not cumulative. The last entry
+     * counts spans longer than every bound. */
+    unsigned int bucket_counts[BUCKET_COUNT + 1];
+    unsigned int count;
+    uint64_t total_time;
+} PhaseMetrics;
+
+typedef struct {
+    const char *source;
+    int code;
+    unsigned int count;
+} FailureMetrics;
+
+Boolean metrics_enabled = FALSE;
+
+const char *metrics_path = NULL;
+char metrics_command[32];
+int metrics_exit_status = -1;
+uint64_t metrics_start_time = 0;
+
+/* There are only a handful of distinct phases and failures, so these are
+ * searched linearly; phase names are literals, so pointers are compared */
+PhaseMetrics *phase_metrics = NULL;
+size_t phase_metrics_count = 0;
+size_t phase_metrics_capacity = 0;
+
+FailureMetrics *failure_metrics = NULL;
+size_t failure_metrics_count = 0;
+size_t failure_metrics_capacity = 0;
+
+void
+record_metrics_span(const char *name, uint64_t duration)
+{
+    size_t i = 0;
+    while (i < phase_metrics_count && phase_metrics[i].name != name) {
+        i++;
+    }
+    
+    if (i == phase_metrics_count) {
+        if (phase_metrics_count == phase_metrics_capacity) {
+            phase_metrics_capacity = (phase_metrics_capacity == 0) ? 16 : phase_metrics_capacity * 2;
+            phase_metrics = realloc(phase_metrics, phase_metrics_capacity * sizeof(PhaseMetrics));
+        }
+        memset(&phase_metrics[i], 0, sizeof(PhaseMetrics));
+        phase_metrics[i].name = name;
+        phase_metrics_count++;
+    }
+    
+    PhaseMetrics *phase = &phase_metrics[i];
+    double seconds = mach_time_to_ms(duration) / 1000;
+    
+    size_t bucket = 0;
+    while (bucket < BUCKET_COUNT && seconds > bucket_bounds[bucket]) {
+        bucket++;
+    }
+    
+    phase->bucket_counts[bucket]++;
+    phase->count++;
+    phase->total_time += duration;
+}
+
+void
+record_metrics_failure(const char *source, int code)
+{
+    if (!metrics_enabled) {
+        return;
+    }
+    
+    size_t i = 0;
+    while (i < failure_metrics_count && (failure_metrics[i].source != source || failure_metrics[i].code != code)) {
+        i++;
+    }
+    
+    if (i == failure_metrics_count) {
+        if (failure_metrics_count == failure_metrics_capacity) {
+            failure_metrics_capacity = (failure_metrics_capacity == 0) ? 8 : failure_metrics_capacity * 2;
+            failure_metrics = realloc(failure_metrics, failure_metrics_capacity * sizeof(FailureMetrics));
+        }
+        failure_metrics[i].source = source;
+        failure_metrics[i].code = code;
+        failure_metrics[i].count = 0;
+        failure_metrics_count++;
+    }
+    
+    failure_metrics[i].count++;
+}
+
+void
+set_metrics_exit_status(int status)
+{
+    metrics_exit_status = status;
+}
+
+/* Adds to a sample, appending it to the order samples are written in if
+ * it is new. */
+void
+add_metrics_sample(CFMutableArrayRef order, CFMutableDictionaryRef values, CFStringRef key, double delta)
+{
+    double value = 0;
+    CFNumberRef stored = CFDictionaryGetValue(values, key);
+    if (stored != NULL) {
+        CFNumberGetValue(stored, kCFNumberDoubleType, &value);
+    } else {
+        CFArrayAppendValue(order, key);
+    }
+    
+    value += delta;
+    CFNumberRef number = CFNumberCreate(NULL, kCFNumberDoubleType, &value);
+    CFDictionarySetValue(values, key, number);
+    CFRelease(number);
+}
+
+/* Reads the samples already in the metrics file. Comments are dropped,
+ * since they are written again for every metric. */
+void
+read_metrics_samples(FILE *file, CFMutableArrayRef order, CFMutableDictionaryRef values)
+{
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "vpnhelper_", 10) != 0) {
+            continue;
+        }
+        
+        char *separator = strrchr(line, ' ');
+        if (separator == NULL) {
+            continue;
+        }
+        *separator = '\0';
+        
+        char *end;
+        double value = strtod(separator + 1, &end);
+        if (end == separator + 1) {
+            continue;
+        }
+        
+        CFStringRef key = CFStringCreateWithCString(NULL, line, kCFStringEncodingUTF8);
+        if (key != NULL) {
+            add_metrics_sample(order, values, key, value);
+            CFRelease(key);
+        }
+    }
+}
+
+/* Adds this invocation's metrics to the samples. */
+void
+add_invocation_samples(CFMutableArrayRef order, CFMutableDictionaryRef values)
+{
+    Boolean failed;
+    if (metrics_exit_status >= 0) {
+        failed = (metrics_exit_status != 0);
+    } else {
+        failed = (failure_metrics_count > 0);
+    }
+    
+    CFStringRef key = CFStringCreateWithFormat(
+        NULL, NULL, CFSTR(METRIC_RUNS "{command=\"%s\",result=\"%s\"}"),
+        metrics_command, failed ? "failure" : "success"
+    );
+    add_metrics_sample(order, values, key, 1);
+    CFRelease(key);
+    
+    for (size_t i = 0; i < phase_metrics_count; ++i) {
+        PhaseMetrics *phase = &phase_metrics[i];
+        
+        /* Buckets are written cumulatively, smallest first */
+        unsigned int cumulative = 0;
+        for (size_t bucket = 0; bucket <= BUCKET_COUNT; ++bucket) {
+            cumulative += phase->bucket_counts[bucket];
+            
+            char bound[32];
+            if (bucket < BUCKET_COUNT) {
+                snprintf(bound, sizeof(bound), "%g", bucket_bounds[bucket]);
+            } else {
+                strlcpy(bound, "+Inf", sizeof(bound));
+            }
+            
+            key = CFStringCreateWithFormat(
+                NULL, NULL, CFSTR(METRIC_PHASE_DURATION "_bucket{command=\"%s\",phase=\"%s\",le=\"%s\"}"),
+                metrics_command, phase->name, bound
+            );
+            add_metrics_sample(order, values, key, cumulative);
+            CFRelease(key);
+        }
+        
+        key = CFStringCreateWithFormat(
+            NULL, NULL, CFSTR(METRIC_PHASE_DURATION "_sum{command=\"%s\",phase=\"%s\"}"),
+            metrics_command, phase->name
+        );
+        add_metrics_sample(order, values, key, mach_time_to_ms(phase->total_time) / 1000);
+        CFRelease(key);
+        
+        key = CFStringCreateWithFormat(
+            NULL, NULL, CFSTR(METRIC_PHASE_DURATION "_count{command=\"%s\",phase=\"%s\"}"),
+            metrics_command, phase->name
+        );
+        add_metrics_sample(order, values, key, phase->count);
+        CFRelease(key);
+    }
+    
+    for (size_t i = 0; i < failure_metrics_count; ++i) {
+        FailureMetrics *failure = &failure_metrics[i];
+        key = CFStringCreateWithFormat(
+            NULL, NULL, CFSTR(METRIC_FAILURES "{command=\"%s\",source=\"%s\",code=\"%d\"}"),
+            metrics_command, failure->source, failure->code
+        );
+        add_metrics_sample(order, values, key, failure->count);
+        CFRelease(key);
+    }
+}
+
+/* Checks whether a sample belongs to a metric, including the _bucket, _sum
+ * and _count series of a histogram. */
+Boolean
+sample_has_metric(const char *sample, const char *metric)
+{
+    size_t length = strlen(metric);
+    if (strncmp(sample, metric, length) != 0) {
+        return FALSE;
+    }
+    
+    const char *suffix = sample + length;
+    return suffix[0] == '{' || strncmp(suffix, "_bucket{", 8) == 0 ||
+        strncmp(suffix, "_sum{", 5) == 0 || strncmp(suffix, "_count{", 7) == 0;
+}
+
+/* Writes the samples grouped by metric, since the format requires each
+ * metric's samples to be contiguous. Samples keep the order they were
+ * first added in, so histogram buckets stay sorted. */
+void
+write_metrics_samples(FILE *file, CFArrayRef order, CFDictionaryRef values)
+{
+    const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+    } metrics[] = {
+        {METRIC_RUNS, "counter", "Invocations by subcommand and result."},
+        {METRIC_PHASE_DURATION, "histogram", "Time spent in each phase of a subcommand."},
+        {METRIC_FAILURES, "counter", "Failed system calls by SCError or OSStatus code."}
+    };
+    
+    CFIndex count = CFArrayGetCount(order);
+    for (size_t i = 0; i < sizeof(metrics) / sizeof(metrics[0]); ++i) {
+        fprintf(file, "# HELP %s %s\n", metrics[i].name, metrics[i].help);
+        fprintf(file, "# TYPE %s %s\n", metrics[i].name, metrics[i].type);
+        
+        for (CFIndex j = 0; j < count; ++j) {
+            CFStringRef key = CFArrayGetValueAtIndex(order, j);
+            
+            char sample[1024];
+            if (!CFStringGetCString(key, sample, sizeof(sample), kCFStringEncodingUTF8) ||
+                !sample_has_metric(sample, metrics[i].name)) {
+                continue;
+            }
+            
+            double value;
+            CFNumberGetValue(CFDictionaryGetValue(values, key), kCFNumberDoubleType, &value);
+            fprintf(file, "%s %.15g\n", sample, value);
+        }
+    }
+}
+
+void
+write_metrics_file(void)
+{
+    if (metrics_start_time != 0) {
+        record_metrics_span("total", mach_absolute_time() - metrics_start_time);
+    }
+    
+    char lock_path[PATH_MAX];
+    char temp_path[PATH_MAX];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", metrics_path);
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", metrics_path, getpid());
+    
+    /* The lock is held from reading the old counters until the new file has
+     * replaced them, so concurrent invocations can't lose each other's updates */
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0) {
+        fprintf(stderr, "Failed to lock %s: %s\n", lock_path, strerror(errno));
+        goto close_lock;
+    }
+    
+    CFMutableArrayRef order = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    CFMutableDictionaryRef values = CFDictionaryCreateMutable(
+        NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+    );
+    
+    FILE *file = fopen(metrics_path, "r");
+    if (file != NULL) {
+        read_metrics_samples(file, order, values);
+        fclose(file);
+    }
+    
+    add_invocation_samples(order, values);
+    
+    file = fopen(temp_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", temp_path, strerror(errno));
+        goto release_samples;
+    }
+    
+    write_metrics_samples(file, order, values);
+    
+    Boolean written = (fflush(file) == 0 && fsync(fileno(file)) == 0);
+    if (fclose(file) != 0) {
+        written = FALSE;
+    }
+    
+    if (!written || rename(temp_path, metrics_path) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", metrics_path, strerror(errno));
+        unlink(temp_path);
+    }
+    
+release_samples:
+    CFRelease(values);
+    CFRelease(order);
+close_lock:
+    if (lock_fd >= 0) {
+        close(lock_fd);
+    }
+}
+
+void
+enable_metrics(const char *path, const char *command)
+{
+    if (metrics_enabled) {
+        return;
+    }
+    
+    /* The command becomes a label value, so anything unexpected in it is
+     * reported as unknown rather than escaped */
+    size_t length = strspn(command, "abcdefghijklmnopqrstuvwxyz-");
+    if (command[length] != '\0' || length == 0 || length >= sizeof(metrics_command)) {
+        command = "unknown";
+    }
+    strlcpy(metrics_command, command, sizeof(metrics_command));
+    
+    metrics_path = path;
+    metrics_start_time = mach_absolute_time();
+    metrics_enabled = TRUE;
+    enable_trace_spans();
+    atexit(write_metrics_file);
+}
@@ -0,0 +1,37 @@
+#ifndef VPNHELPER_METRICS_H
+#define VPNHELPER_METRICS_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/* Whether metrics are being collected. */
+extern Boolean metrics_enabled;
+
+/* Starts collecting metrics for this invocation. When the process exits,
+ * they are added to the counters already in the file, in the Prometheus
+ * text format read by node_exporter's textfile collector. Concurrent
+ * invocations are serialized with a lock file next to it, and the file is
+ * replaced with rename() so the collector never sees a partial write.
+ * @param path The path of the metrics file. Should end in ".prom".
+ * @param command The subcommand, used as the "command" label.
+ */
+void enable_metrics(const char *path, const char *command);
+
+/* Sets the exit status reported in the "result" label. Invocations that
+ * end with exit() are reported as succeeding unless a failure was recorded.
+ * @param status The status the process is exiting with.
+ */
+void set_metrics_exit_status(int status);
+
+/* Adds a span to the phase latency histogram. Called by the tracing code.
+ * @param name The name of the phase. Must be a string literal.
+ * @param duration How long the span took, in mach time units.
+ */
+void record_metrics_span(const char *name, uint64_t duration);
+
+/* Counts a failed system call.
+ * @param source Where the code comes from, "SCError" or "OSStatus".
+ * @param code The error code.
+ */
+void record_metrics_failure(const char *source, int code);
+
+#endif
@@ -0,0 +1,243 @@
+#include "probe.h"
+#include "trace.h"
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <dispatch/dispatch.h>
+#include <mach/mach_time.h>
+
+const char *ike_ports[IKE_PORT_COUNT] = {"500", "4500"};
+
+/* The length of an IKE request, and of the marker that tells NAT traversal
+ * traffic on port 4500 apart from ESP. */
+#define IKE_REQUEST_LENGTH 80
+#define NON_ESP_MARKER_LENGTH 4
+
+typedef struct {
+    /* The candidate's address, as given. */
+    CFStringRef server;
+    char host[256];
+    
+    /* Its resolved address for each port, or NULL if it didn't resolve. */
+    struct addrinfo *addresses[IKE_PORT_COUNT];
+    
+    /* A socket per port, or -1. */
+    int fds[IKE_PORT_COUNT];
+    
+    /* How long the first answer took, or a negative number. */
+    double rtt;
+} ServerProbe;
+
+/* Builds the first message of an IKEv1 Main Mode exchange, offering a
+ * single common transform (3DES, SHA-1, pre-shared key, MODP-1024), which
+ * is enough for any IKE server to answer. */
+void
+build_ike_request(uint8_t *request, const uint8_t *cookie)
+{
+    const uint8_t template[IKE_REQUEST_LENGTH] = {
+        /* Header: initiator and responder cookies, next payload SA, version
+         * 1.0, Main Mode, no flags, message ID 0, length */
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0x01, 0x10, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, IKE_REQUEST_LENGTH,
+        
+        /* SA payload: IPSec DOI, identity-only situation */
+        0x00, 0x00, 0x00, 0x34, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,
+        
+        /* Proposal payload: ISAKMP, no SPI, one transform */
+        0x00, 0x00, 0x00, 0x28, 0x01, 0x01, 0x00, 0x01,
+        
+        /* Transform payload: KEY_IKE, then its attributes */
+        0x00, 0x00, 0x00, 0x20, 0x01, 0x01, 0x00, 0x00,
+        0x80, 0x01, 0x00, 0x05,     /* Encryption: 3DES-CBC */
+        0x80, 0x02, 0x00, 0x02,     /* Hash: SHA-1 */
+        0x80, 0x03, 0x00, 0x01,     /* Authentication: pre-shared key */
+        0x80, 0x04, 0x00, 0x02,     /* Group: MODP-1024 */
+        0x80, 0x0b, 0x00, 0x01,     /* Life type: seconds */
+        0x80, 0x0c, 0x70, 0x80      /* Life duration: 8 hours */
+    };
+    
+    memcpy(request, template, IKE_REQUEST_LENGTH);
+    memcpy(request, cookie, 8);
+}
+
+/* Runs concurrently for every candidate, since lookups can be slow. */
+void
+resolve_server_probe(void *context, size_t index)
+{
+    ServerProbe *probe = &((ServerProbe *)context)[index];
+    
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM
+    };
+    
+    for (int i = 0; i < IKE_PORT_COUNT; ++i) {
+        if (getaddrinfo(probe->host, ike_ports[i], &hints, &probe->addresses[i]) != 0) {
+            probe->addresses[i] = NULL;
+        }
+    }
+}
+
+/* Splits a comma separated list into probes, dropping empty entries. */
+ServerProbe *
+create_server_probes(CFStringRef candidates, CFIndex *count)
+{
+    CFArrayRef servers = CFStringCreateArrayBySeparatingStrings(NULL, candidates, CFSTR(","));
+    ServerProbe *probes = calloc(CFArrayGetCount(servers) + 1, sizeof(ServerProbe));
+    *count = 0;
+    
+    for (CFIndex i = 0; i < CFArrayGetCount(servers); ++i) {
+        CFMutableStringRef server = CFStringCreateMutableCopy(NULL, 0, CFArrayGetValueAtIndex(servers, i));
+        CFStringTrimWhitespace(server);
+        
+        ServerProbe *probe = &probes[*count];
+        if (CFStringGetLength(server) == 0 || !CFStringGetCString(server, probe->host, sizeof(probe->host), kCFStringEncodingUTF8)) {
+            CFRelease(server);
+            continue;
+        }
+        
+        probe->server = server;
+        probe->fds[0] = probe->fds[1] = -1;
+        probe->rtt = -1;
+        (*count)++;
+    }
+    
+    CFRelease(servers);
+    return probes;
+}
+
+CFStringRef
+copy_fastest_vpn_server(CFStringRef candidates, double timeout)
+{
+    CFIndex count;
+    ServerProbe *probes = create_server_probes(candidates, &count);
+    CFStringRef fastest = NULL;
+    
+    if (count == 0) {
+        fprintf(stderr, "No candidate servers given\n");
+        goto free_probes;
+    }
+    
+    if (count == 1) {
+        fastest = CFRetain(probes[0].server);
+        goto free_probes;
+    }
+    
+    uint64_t start_time = trace_begin();
+    dispatch_apply_f(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), probes, resolve_server_probe);
+    trace_end("resolve_servers", start_time);
+    
+    uint8_t cookie[8];
+    arc4random_buf(cookie, sizeof(cookie));
+    
+    uint8_t request[NON_ESP_MARKER_LENGTH + IKE_REQUEST_LENGTH] = {0};
+    build_ike_request(request + NON_ESP_MARKER_LENGTH, cookie);
+    
+    /* Send everything before waiting for anything, so every candidate gets
+     * the same head start */
+    struct pollfd *poll_fds = calloc(count * IKE_PORT_COUNT + 1, sizeof(struct pollfd));
+    uint64_t send_time = mach_absolute_time();
+    
+    for (CFIndex i = 0; i < count; ++i) {
+        for (int j = 0; j < IKE_PORT_COUNT; ++j) {
+            ServerProbe *probe = &probes[i];
+            struct addrinfo *address = probe->addresses[j];
+            poll_fds[i * IKE_PORT_COUNT + j].fd = -1;
+            
+            if (address == NULL) {
+                continue;
+            }
+            
+            int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            
+            /* Only port 4500 takes the non-ESP marker */
+            const uint8_t *message = (j == 1) ? request : request + NON_ESP_MARKER_LENGTH;
+            size_t length = (j == 1) ? sizeof(request) : IKE_REQUEST_LENGTH;
+            
+            if (connect(fd, address->ai_addr, address->ai_addrlen) < 0 || send(fd, message, length, 0) < 0) {
+                close(fd);
+                continue;
+            }
+            
+            probe->fds[j] = fd;
+            poll_fds[i * IKE_PORT_COUNT + j] = (struct pollfd){fd, POLLIN, 0};
+        }
+    }
+    
+    start_time = trace_begin();
+    CFIndex best = -1;
+    
+    while (best < 0) {
+        double elapsed = mach_time_to_ms(mach_absolute_time() - send_time);
+        if (elapsed >= timeout) {
+            break;
+        }
+        
+        int ready = poll(poll_fds, (nfds_t)(count * IKE_PORT_COUNT), (int)(timeout - elapsed) + 1);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        
+        for (CFIndex i = 0; i < count * IKE_PORT_COUNT && ready > 0; ++i) {
+            short revents = poll_fds[i].revents;
+            if (!(revents & POLLIN)) {
+                /* A socket in error stays ready without ever becoming
+                 * readable, so stop polling it or every poll returns at once */
+                if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                    poll_fds[i].fd = -1;
+                }
+                continue;
+            }
+            
+            /* Errors such as port unreachable mean this port won't answer */
+            uint8_t reply[1500];
+            ssize_t length = recv(poll_fds[i].fd, reply, sizeof(reply), 0);
+            if (length < 0) {
+                poll_fds[i].fd = -1;
+                continue;
+            }
+            
+            int marker_length = (i % IKE_PORT_COUNT == 1) ? NON_ESP_MARKER_LENGTH : 0;
+            if (length >= marker_length + 8 && memcmp(reply + marker_length, cookie, 8) == 0) {
+                ServerProbe *probe = &probes[i / IKE_PORT_COUNT];
+                probe->rtt = mach_time_to_ms(mach_absolute_time() - send_time);
+                best = i / IKE_PORT_COUNT;
+                break;
+            }
+        }
+    }
+    trace_end("probe_servers", start_time);
+    
+    if (best >= 0) {
+        fastest = CFRetain(probes[best].server);
+        printf("Selected server %s (%.1f ms)\n", probes[best].host, probes[best].rtt);
+    } else {
+        fprintf(stderr, "No candidate server answered within %.0f ms\n", timeout);
+    }
+    
+    free(poll_fds);
+    for (CFIndex i = 0; i < count; ++i) {
+        for (int j = 0; j < IKE_PORT_COUNT; ++j) {
+            if (probes[i].fds[j] >= 0) {
+                close(probes[i].fds[j]);
+            }
+            if (probes[i].addresses[j] != NULL) {
+                freeaddrinfo(probes[i].addresses[j]);
+            }
+        }
+    }
+free_probes:
+    for (CFIndex i = 0; i < count; ++i) {
+        CFRelease(probes[i].server);
+    }
+    free(probes);
+    return fastest;
+}
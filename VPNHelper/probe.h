@@ -0,0 +1,28 @@
+#ifndef VPNHELPER_PROBE_H
+#define VPNHELPER_PROBE_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/* The UDP ports candidates are probed on: IKE's plain port, and its NAT
+ * traversal port, where requests start with a non-ESP marker. They can be
+ * pointed elsewhere to probe local responders. */
+#define IKE_PORT_COUNT 2
+extern const char *ike_ports[IKE_PORT_COUNT];
+
+/* How long to wait for candidate servers to answer, in milliseconds. */
+#define SERVER_PROBE_TIMEOUT_MS 2000
+
+/* Picks the server that answers IKE fastest out of a list of candidates.
+ * Every candidate is resolved and sent an IKE Main Mode request on UDP
+ * ports 500 and 4500 at the same time, and the first to answer on either
+ * port wins. Any reply that echoes the request's initiator cookie counts,
+ * so a plain UDP echo service can stand in for a VPN server.
+ * @param candidates The candidate server addresses, separated by commas.
+ *     If there is only one, it is returned without being probed.
+ * @param timeout How long to wait for an answer, in milliseconds.
+ * @result The address of the fastest candidate, or NULL if none of them
+ *     answered. The caller is responsible for releasing it.
+ */
+CFStringRef copy_fastest_vpn_server(CFStringRef candidates, double timeout);
+
+#endif
@@ -0,0 +1,212 @@
+#include "reconcile.h"
+#include "manifest.h"
+#include "json.h"
+
+Boolean
+read_desired_vpn(CFTypeRef entry, VPNOperation *operation)
+{
+    if (CFGetTypeID(entry) != CFDictionaryGetTypeID()) {
+        fprintf(stderr, "Desired entry must be an object\n");
+        return FALSE;
+    }
+    
+    if (CFDictionaryContainsKey(entry, CFSTR("action"))) {
+        fprintf(stderr, "Desired entry cannot have an action (\"action\")\n");
+        return FALSE;
+    }
+    
+    CFTypeRef service_id = CFDictionaryGetValue(entry, CFSTR("id"));
+    if (service_id == kCFNull) {
+        service_id = NULL;
+    }
+    
+    if (service_id != NULL && CFGetTypeID(service_id) != CFStringGetTypeID()) {
+        fprintf(stderr, "Desired entry member \"id\" must be a string\n");
+        return FALSE;
+    }
+    
+    /* Check member types here, so errors name the desired state file
+     * rather than a manifest */
+    const CFStringRef string_members[5] = {CFSTR("name"), CFSTR("address"), CFSTR("username"), CFSTR("password"), CFSTR("secret")};
+    for (int i = 0; i < 5; ++i) {
+        CFTypeRef value = CFDictionaryGetValue(entry, string_members[i]);
+        if (value != NULL && value != kCFNull && CFGetTypeID(value) != CFStringGetTypeID()) {
+            fprintf(stderr, "Desired entry member \"%s\" must be a string\n", CFStringGetCStringPtr(string_members[i], kCFStringEncodingUTF8));
+            return FALSE;
+        }
+    }
+    
+    CFTypeRef send_all_traffic = CFDictionaryGetValue(entry, CFSTR("send_all_traffic"));
+    if (send_all_traffic != NULL && send_all_traffic != kCFNull && CFGetTypeID(send_all_traffic) != CFBooleanGetTypeID()) {
+        fprintf(stderr, "Desired entry member \"send_all_traffic\" must be a boolean\n");
+        return FALSE;
+    }
+    
+    /* A desired entry must be as complete as a new connection, so it is
+     * validated as a create. The copy holds the same strings as the entry,
+     * so they stay valid after it is released. */
+    CFMutableDictionaryRef object = CFDictionaryCreateMutableCopy(NULL, 0, entry);
+    CFDictionaryRemoveValue(object, CFSTR("id"));
+    CFDictionarySetValue(object, CFSTR("action"), CFSTR("create"));
+    
+    Boolean success = read_vpn_operation(object, operation);
+    CFRelease(object);
+    
+    operation->service_id = service_id;
+    return success;
+}
+
+/* Finds an existing connection that hasn't been matched to an entry yet.
+ * Returns its index, or -1 if there is none. */
+CFIndex
+find_unmatched_vpn(CFArrayRef current, const Boolean *matched, CFStringRef key, CFStringRef value)
+{
+    for (CFIndex i = 0; i < CFArrayGetCount(current); ++i) {
+        CFDictionaryRef description = CFArrayGetValueAtIndex(current, i);
+        CFTypeRef current_value = CFDictionaryGetValue(description, key);
+        if (!matched[i] && current_value != NULL && CFEqual(current_value, value)) {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+/* Returns the desired value if it differs from the existing connection's,
+ * or NULL if it is already up to date. */
+CFTypeRef
+changed_field(CFTypeRef value, CFDictionaryRef description, CFStringRef key)
+{
+    CFTypeRef current_value = CFDictionaryGetValue(description, key);
+    if (value == NULL || (current_value != NULL && CFEqual(value, current_value))) {
+        return NULL;
+    }
+    return value;
+}
+
+CFArrayRef
+create_vpn_plan(CFArrayRef desired, CFArrayRef current)
+{
+    CFMutableArrayRef plan = NULL;
+    CFIndex desired_count = CFArrayGetCount(desired);
+    CFIndex current_count = CFArrayGetCount(current);
+    
+    VPNOperation *entries = calloc(desired_count + 1, sizeof(VPNOperation));
+    CFIndex *matches = calloc(desired_count + 1, sizeof(CFIndex));
+    Boolean *matched = calloc(current_count + 1, sizeof(Boolean));
+    
+    /* Entries with an ID are matched first, so that a name match can't
+     * steal a connection that an ID refers to */
+    for (CFIndex i = 0; i < desired_count; ++i) {
+        if (!read_desired_vpn(CFArrayGetValueAtIndex(desired, i), &entries[i])) {
+            fprintf(stderr, "Invalid desired entry at index %ld\n", i);
+            goto free_entries;
+        }
+        
+        matches[i] = -1;
+        if (entries[i].service_id != NULL) {
+            matches[i] = find_unmatched_vpn(current, matched, CFSTR("id"), entries[i].service_id);
+            if (matches[i] < 0) {
+                fprintf(stderr, "Desired entry at index %ld refers to a missing or already matched VPN service\n", i);
+                goto free_entries;
+            }
+            matched[matches[i]] = TRUE;
+        }
+    }
+    
+    for (CFIndex i = 0; i < desired_count; ++i) {
+        if (entries[i].service_id == NULL) {
+            matches[i] = find_unmatched_vpn(current, matched, CFSTR("name"), entries[i].config.service_name);
+            if (matches[i] >= 0) {
+                matched[matches[i]] = TRUE;
+            }
+        }
+    }
+    
+    plan = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    
+    /* Deletions go first, so that a connection can be replaced by a new
+     * one with the same name */
+    for (CFIndex i = 0; i < current_count; ++i) {
+        if (!matched[i]) {
+            CFDictionaryRef description = CFArrayGetValueAtIndex(current, i);
+            VPNOperation operation = {
+                .type = VPNOperationDelete,
+                .service_id = CFDictionaryGetValue(description, CFSTR("id"))
+            };
+            
+            CFDictionaryRef object = create_vpn_operation_object(&operation);
+            CFArrayAppendValue(plan, object);
+            CFRelease(object);
+        }
+    }
+    
+    for (CFIndex i = 0; i < desired_count; ++i) {
+        VPNOperation operation = entries[i];
+        
+        if (matches[i] >= 0) {
+            CFDictionaryRef description = CFArrayGetValueAtIndex(current, matches[i]);
+            L2TPConfig *config = &operation.config;
+            
+            operation.type = VPNOperationEdit;
+            operation.service_id = CFDictionaryGetValue(description, CFSTR("id"));
+            config->service_name = changed_field(config->service_name, description, CFSTR("name"));
+            config->server_address = changed_field(config->server_address, description, CFSTR("address"));
+            config->username = changed_field(config->username, description, CFSTR("username"));
+            config->send_all_traffic = changed_field(config->send_all_traffic, description, CFSTR("send_all_traffic"));
+            remove_unchanged_vpn_secrets(operation.service_id, config);
+            
+            if (config->service_name == NULL && config->server_address == NULL &&
+                config->username == NULL && config->password == NULL &&
+                config->shared_secret == NULL && config->send_all_traffic == NULL) {
+                continue;
+            }
+        }
+        
+        CFDictionaryRef object = create_vpn_operation_object(&operation);
+        CFArrayAppendValue(plan, object);
+        CFRelease(object);
+    }
+    
+free_entries:
+    free(matched);
+    free(matches);
+    free(entries);
+    return plan;
+}
+
+void
+print_vpn_plan(FILE *file, CFArrayRef plan)
+{
+    const CFStringRef fields[6] = {
+        CFSTR("name"), CFSTR("address"), CFSTR("username"),
+        CFSTR("password"), CFSTR("secret"), CFSTR("send_all_traffic")
+    };
+    
+    if (CFArrayGetCount(plan) == 0) {
+        fprintf(file, "Nothing to do\n");
+        return;
+    }
+    
+    for (CFIndex i = 0; i < CFArrayGetCount(plan); ++i) {
+        CFDictionaryRef object = CFArrayGetValueAtIndex(plan, i);
+        CFStringRef action = CFDictionaryGetValue(object, CFSTR("action"));
+        
+        if (CFEqual(action, CFSTR("create"))) {
+            fprintf(file, "create ");
+            write_json_string(file, CFDictionaryGetValue(object, CFSTR("name")));
+        } else {
+            fprintf(file, CFEqual(action, CFSTR("edit")) ? "edit   " : "delete ");
+            write_json_string(file, CFDictionaryGetValue(object, CFSTR("id")));
+            
+            const char *separator = ": ";
+            for (int j = 0; j < 6; ++j) {
+                if (CFDictionaryContainsKey(object, fields[j])) {
+                    fprintf(file, "%s%s", separator, CFStringGetCStringPtr(fields[j], kCFStringEncodingUTF8));
+                    separator = ", ";
+                }
+            }
+        }
+        fprintf(file, "\n");
+    }
+}
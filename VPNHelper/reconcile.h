@@ -0,0 +1,29 @@
+#ifndef VPNHELPER_RECONCILE_H
+#define VPNHELPER_RECONCILE_H
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdio.h>
+
+/* Works out the operations that turn the existing VPN connections into a
+ * desired set. Desired entries are matched to existing connections by "id"
+ * if they have one, and by name otherwise. Existing connections that no
+ * entry matches are deleted, and entries that match nothing are created.
+ * Edits only include the fields that differ, secrets included, and
+ * connections that are already up to date are left out of the plan.
+ * @param desired The desired connections, as a JSON array of objects with
+ *     the same members as a "create" manifest entry plus an optional "id".
+ * @param current The existing connections, as returned by copy_vpn_list().
+ * @result The plan, as an array of manifest entries in the form accepted by
+ *     read_vpn_operation(), or NULL if the desired connections are invalid.
+ *     The caller is responsible for releasing it.
+ */
+CFArrayRef create_vpn_plan(CFArrayRef desired, CFArrayRef current);
+
+/* Prints a plan one operation per line, naming the fields each edit changes
+ * but never the values of secrets.
+ * @param file The file to write to.
+ * @param plan The plan, as returned by create_vpn_plan().
+ */
+void print_vpn_plan(FILE *file, CFArrayRef plan);
+
+#endif
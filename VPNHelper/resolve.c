@@ -0,0 +1,333 @@
+#include "resolve.h"
+#include "cache.h"
+#include "json.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "vpn.h"
+#include <netdb.h>
+#include <stdio.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <dispatch/dispatch.h>
+
+/* The cache holds "hosts", mapping each hostname to its "addresses" and
+ * when they "expires", and "pins", mapping the service ID of each pinned
+ * connection to the hostname it was pinned from. */
+#define DNS_CACHE_NAME "dns.plist"
+
+typedef struct {
+    char host[256];
+    
+    /* The resolved addresses, IPv4 first, or NULL if the lookup failed. */
+    CFMutableArrayRef addresses;
+} HostLookup;
+
+Boolean
+is_ip_address(CFStringRef address)
+{
+    char chars[INET6_ADDRSTRLEN];
+    if (!CFStringGetCString(address, chars, sizeof(chars), kCFStringEncodingUTF8)) {
+        return FALSE;
+    }
+    
+    struct in6_addr buffer;
+    return inet_pton(AF_INET, chars, &buffer) == 1 || inet_pton(AF_INET6, chars, &buffer) == 1;
+}
+
+/* Loads the cache as mutable dictionaries, or creates an empty one. */
+CFMutableDictionaryRef
+copy_dns_cache(void)
+{
+    CFMutableDictionaryRef cache = CFDictionaryCreateMutable(
+        NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+    );
+    
+    CFPropertyListRef stored = copy_cache(DNS_CACHE_NAME);
+    const CFStringRef sections[2] = {CFSTR("hosts"), CFSTR("pins")};
+    
+    for (int i = 0; i < 2; ++i) {
+        CFTypeRef stored_section = NULL;
+        if (stored != NULL && CFGetTypeID(stored) == CFDictionaryGetTypeID()) {
+            stored_section = CFDictionaryGetValue(stored, sections[i]);
+        }
+        
+        CFMutableDictionaryRef section;
+        if (stored_section != NULL && CFGetTypeID(stored_section) == CFDictionaryGetTypeID()) {
+            section = CFDictionaryCreateMutableCopy(NULL, 0, stored_section);
+        } else {
+            section = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        }
+        
+        CFDictionarySetValue(cache, sections[i], section);
+        CFRelease(section);
+    }
+    
+    if (stored != NULL) {
+        CFRelease(stored);
+    }
+    return cache;
+}
+
+/* Gets the hostname a connection's address should be resolved from, or
+ * NULL if it is a plain IP address. */
+CFStringRef
+get_service_hostname(CFDictionaryRef description, CFDictionaryRef pins)
+{
+    CFStringRef address = CFDictionaryGetValue(description, CFSTR("address"));
+    if (address == NULL) {
+        return NULL;
+    }
+    
+    if (!is_ip_address(address)) {
+        return address;
+    }
+    
+    /* A pin only counts while the address is still an IP; editing the
+     * connection to use a hostname again replaces it */
+    return CFDictionaryGetValue(pins, CFDictionaryGetValue(description, CFSTR("id")));
+}
+
+/* Runs concurrently for every hostname, so one slow lookup doesn't hold
+ * up the rest. */
+void
+resolve_host(void *context, size_t index)
+{
+    HostLookup *lookup = &((HostLookup *)context)[index];
+    
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM
+    };
+    
+    struct addrinfo *addresses;
+    if (getaddrinfo(lookup->host, NULL, &hints, &addresses) != 0) {
+        return;
+    }
+    
+    lookup->addresses = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    
+    /* IPv4 first, since that's what L2TP servers are usually reached by */
+    for (int pass = 0; pass < 2; ++pass) {
+        for (struct addrinfo *address = addresses; address != NULL; address = address->ai_next) {
+            if ((address->ai_family == AF_INET) != (pass == 0)) {
+                continue;
+            }
+            
+            char chars[NI_MAXHOST];
+            if (getnameinfo(address->ai_addr, address->ai_addrlen, chars, sizeof(chars), NULL, 0, NI_NUMERICHOST) != 0) {
+                continue;
+            }
+            
+            CFStringRef str = CFStringCreateWithCString(NULL, chars, kCFStringEncodingUTF8);
+            if (!CFArrayContainsValue(lookup->addresses, CFRangeMake(0, CFArrayGetCount(lookup->addresses)), str)) {
+                CFArrayAppendValue(lookup->addresses, str);
+            }
+            CFRelease(str);
+        }
+    }
+    
+    freeaddrinfo(addresses);
+}
+
+/* Pins connections to the first address of their hostname, in a single
+ * transaction. */
+Boolean
+pin_resolved_addresses(CFArrayRef services, CFDictionaryRef hosts, CFMutableDictionaryRef pins)
+{
+    VPNTransactionRef transaction = begin_vpn_transaction();
+    if (transaction == NULL) {
+        return FALSE;
+    }
+    
+    for (CFIndex i = 0; i < CFArrayGetCount(services); ++i) {
+        CFDictionaryRef description = CFArrayGetValueAtIndex(services, i);
+        CFStringRef service_id = CFDictionaryGetValue(description, CFSTR("id"));
+        CFStringRef hostname = get_service_hostname(description, pins);
+        CFDictionaryRef host = CFDictionaryGetValue(hosts, hostname);
+        CFArrayRef addresses = (host == NULL) ? NULL : CFDictionaryGetValue(host, CFSTR("addresses"));
+        
+        if (addresses == NULL || CFArrayGetCount(addresses) == 0) {
+            continue;
+        }
+        
+        L2TPConfig config = {.server_address = CFArrayGetValueAtIndex(addresses, 0)};
+        edit_vpn_in_transaction(transaction, service_id, &config);
+        CFDictionarySetValue(pins, service_id, hostname);
+    }
+    
+    Boolean success = commit_vpn_transaction(transaction);
+    end_vpn_transaction(transaction);
+    return success;
+}
+
+/* Forgets the pins of connections that no longer exist. */
+void
+remove_stale_pins(CFMutableDictionaryRef pins, CFArrayRef vpn_list)
+{
+    CFIndex count = CFDictionaryGetCount(pins);
+    const void **pinned_ids = malloc((count + 1) * sizeof(void *));
+    CFDictionaryGetKeysAndValues(pins, pinned_ids, NULL);
+    
+    for (CFIndex i = 0; i < count; ++i) {
+        if (find_vpn_description(vpn_list, pinned_ids[i]) == NULL) {
+            CFDictionaryRemoveValue(pins, pinned_ids[i]);
+        }
+    }
+    
+    free(pinned_ids);
+}
+
+int
+run_resolve(CFArrayRef service_ids, Boolean pin, double ttl)
+{
+    int err = 1;
+    
+    CFArrayRef vpn_list = copy_vpn_snapshot();
+    if (vpn_list == NULL) {
+        goto exit;
+    }
+    
+    CFMutableDictionaryRef cache = copy_dns_cache();
+    CFMutableDictionaryRef hosts = (CFMutableDictionaryRef)CFDictionaryGetValue(cache, CFSTR("hosts"));
+    CFMutableDictionaryRef pins = (CFMutableDictionaryRef)CFDictionaryGetValue(cache, CFSTR("pins"));
+    remove_stale_pins(pins, vpn_list);
+    
+    /* Pick the connections with hostnames, and look each hostname up once
+     * no matter how many connections share it */
+    CFMutableArrayRef services = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    CFMutableArrayRef hostnames = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    
+    for (CFIndex i = 0; i < CFArrayGetCount(vpn_list); ++i) {
+        CFDictionaryRef description = CFArrayGetValueAtIndex(vpn_list, i);
+        CFStringRef service_id = CFDictionaryGetValue(description, CFSTR("id"));
+        CFStringRef hostname = get_service_hostname(description, pins);
+        
+        if (CFArrayGetCount(service_ids) > 0 && !CFArrayContainsValue(service_ids, CFRangeMake(0, CFArrayGetCount(service_ids)), service_id)) {
+            continue;
+        }
+        if (hostname == NULL) {
+            continue;
+        }
+        
+        CFArrayAppendValue(services, description);
+        if (!CFArrayContainsValue(hostnames, CFRangeMake(0, CFArrayGetCount(hostnames)), hostname)) {
+            CFArrayAppendValue(hostnames, hostname);
+        }
+    }
+    
+    CFIndex count = CFArrayGetCount(hostnames);
+    HostLookup *lookups = calloc(count + 1, sizeof(HostLookup));
+    for (CFIndex i = 0; i < count; ++i) {
+        CFStringGetCString(CFArrayGetValueAtIndex(hostnames, i), lookups[i].host, sizeof(lookups[i].host), kCFStringEncodingUTF8);
+    }
+    
+    uint64_t start_time = trace_begin();
+    dispatch_apply_f(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), lookups, resolve_host);
+    trace_end("resolve_hosts", start_time);
+    
+    /* Failed lookups keep their old entry, which will show up as stale */
+    CFAbsoluteTime expires = CFAbsoluteTimeGetCurrent() + ttl;
+    CFNumberRef expires_number = CFNumberCreate(NULL, kCFNumberDoubleType, &expires);
+    
+    for (CFIndex i = 0; i < count; ++i) {
+        if (lookups[i].addresses == NULL) {
+            fprintf(stderr, "Failed to resolve %s\n", lookups[i].host);
+            continue;
+        }
+        
+        const void *keys[2] = {CFSTR("addresses"), CFSTR("expires")};
+        const void *values[2] = {lookups[i].addresses, expires_number};
+        CFDictionaryRef host = CFDictionaryCreate(NULL, keys, values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        CFDictionarySetValue(hosts, CFArrayGetValueAtIndex(hostnames, i), host);
+        CFRelease(host);
+    }
+    
+    if (pin && !pin_resolved_addresses(services, hosts, pins)) {
+        goto release_lookups;
+    }
+    
+    write_cache(DNS_CACHE_NAME, cache);
+    
+    CFMutableArrayRef results = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    for (CFIndex i = 0; i < CFArrayGetCount(services); ++i) {
+        CFDictionaryRef description = CFArrayGetValueAtIndex(services, i);
+        CFStringRef hostname = get_service_hostname(description, pins);
+        CFDictionaryRef host = CFDictionaryGetValue(hosts, hostname);
+        CFTypeRef addresses = (host == NULL) ? NULL : CFDictionaryGetValue(host, CFSTR("addresses"));
+        
+        const void *keys[3] = {CFSTR("id"), CFSTR("hostname"), CFSTR("addresses")};
+        const void *values[3] = {CFDictionaryGetValue(description, CFSTR("id")), hostname, (addresses != NULL) ? addresses : kCFNull};
+        CFDictionaryRef result = CFDictionaryCreate(NULL, keys, values, 3, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        CFArrayAppendValue(results, result);
+        CFRelease(result);
+    }
+    
+    write_json_value(stdout, results);
+    printf("\n");
+    CFRelease(results);
+    err = 0;
+    
+release_lookups:
+    for (CFIndex i = 0; i < count; ++i) {
+        if (lookups[i].addresses != NULL) {
+            CFRelease(lookups[i].addresses);
+        }
+    }
+    free(lookups);
+    CFRelease(expires_number);
+    CFRelease(hostnames);
+    CFRelease(services);
+    CFRelease(cache);
+    CFRelease(vpn_list);
+exit:
+    return err;
+}
+
+CFArrayRef
+create_vpn_list_with_staleness(CFArrayRef vpn_list)
+{
+    CFMutableDictionaryRef cache = copy_dns_cache();
+    CFDictionaryRef hosts = CFDictionaryGetValue(cache, CFSTR("hosts"));
+    CFDictionaryRef pins = CFDictionaryGetValue(cache, CFSTR("pins"));
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    
+    CFMutableArrayRef result = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    
+    for (CFIndex i = 0; i < CFArrayGetCount(vpn_list); ++i) {
+        CFDictionaryRef description = CFArrayGetValueAtIndex(vpn_list, i);
+        CFStringRef hostname = get_service_hostname(description, pins);
+        
+        if (hostname == NULL) {
+            CFArrayAppendValue(result, description);
+            continue;
+        }
+        
+        CFStringRef address = CFDictionaryGetValue(description, CFSTR("address"));
+        Boolean pinned = !CFEqual(hostname, address);
+        
+        CFDictionaryRef host = CFDictionaryGetValue(hosts, hostname);
+        CFNumberRef expires_number = (host == NULL) ? NULL : CFDictionaryGetValue(host, CFSTR("expires"));
+        CFArrayRef addresses = (host == NULL) ? NULL : CFDictionaryGetValue(host, CFSTR("addresses"));
+        
+        CFAbsoluteTime expires = 0;
+        if (expires_number != NULL) {
+            CFNumberGetValue(expires_number, kCFNumberDoubleType, &expires);
+        }
+        
+        Boolean stale = (expires < now);
+        if (pinned && !stale) {
+            stale = (addresses == NULL || !CFArrayContainsValue(addresses, CFRangeMake(0, CFArrayGetCount(addresses)), address));
+        }
+        
+        CFMutableDictionaryRef annotated = CFDictionaryCreateMutableCopy(NULL, 0, description);
+        CFDictionarySetValue(annotated, CFSTR("address_stale"), stale ? kCFBooleanTrue : kCFBooleanFalse);
+        if (pinned) {
+            CFDictionarySetValue(annotated, CFSTR("hostname"), hostname);
+        }
+        CFArrayAppendValue(result, annotated);
+        CFRelease(annotated);
+    }
+    
+    CFRelease(cache);
+    return result;
+}
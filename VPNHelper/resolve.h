@@ -0,0 +1,34 @@
+#ifndef VPNHELPER_RESOLVE_H
+#define VPNHELPER_RESOLVE_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/* How long resolved addresses are trusted, in seconds, if no TTL is given. */
+#define DEFAULT_DNS_TTL 300
+
+/* Resolves the server hostnames of VPN connections concurrently, and stores
+ * the results in an on-disk cache that list uses to tell whether an address
+ * is stale. The results are printed as a JSON array with an object per
+ * connection of the form {"id": ..., "hostname": ..., "addresses": [...]}.
+ * @param service_ids The service IDs of the VPN connections, or an empty
+ *     array for every L2TP connection.
+ * @param pin TRUE to also write the first resolved address into each
+ *     connection, so connecting doesn't have to wait for DNS. The hostname
+ *     is remembered, so later runs resolve it again rather than the address.
+ * @param ttl How long the results are valid for, in seconds.
+ * @result Nonzero on failure.
+ */
+int run_resolve(CFArrayRef service_ids, Boolean pin, double ttl);
+
+/* Adds "address_stale" to the descriptions of VPN connections whose server
+ * is a hostname, which is TRUE unless it was resolved by run_resolve()
+ * within its TTL. Pinned connections also get their "hostname", and are
+ * stale if their address is no longer among the hostname's addresses.
+ * @param vpn_list The VPN connection descriptions, as returned by
+ *     copy_vpn_snapshot().
+ * @result The updated descriptions. The caller is responsible for
+ *     releasing them.
+ */
+CFArrayRef create_vpn_list_with_staleness(CFArrayRef vpn_list);
+
+#endif
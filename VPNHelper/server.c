@@ -0,0 +1,241 @@
+#include "server.h"
+#include "json.h"
+#include "vpn.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/* Requests larger than this are rejected rather than buffered. */
+#define MAX_REQUEST_LENGTH 65536
+
+/* How long a client may take to send its request or read its response,
+ * in seconds. Clients are served one at a time, so one that stalls holds
+ * up everyone else until then. */
+#define CLIENT_TIMEOUT 5
+
+Boolean
+make_socket_address(const char *socket_path, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    
+    if (strlen(socket_path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", socket_path);
+        return FALSE;
+    }
+    
+    strcpy(address->sun_path, socket_path);
+    return TRUE;
+}
+
+/* Reads a single newline-terminated line. Returns the number of bytes read,
+ * not including the newline, or -1 on error, if the line is too long, or if
+ * it isn't complete by the deadline. A deadline of 0 waits for as long as
+ * it takes. */
+ssize_t
+read_socket_line(int fd, char *buffer, size_t capacity, time_t deadline)
+{
+    size_t length = 0;
+    
+    while (length < capacity) {
+        if (deadline != 0 && time(NULL) > deadline) {
+            return -1;
+        }
+        
+        ssize_t count = read(fd, buffer + length, 1);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            return -1;
+        }
+        if (count == 0) {
+            return (length > 0) ? (ssize_t)length : -1;
+        }
+        if (buffer[length] == '\n') {
+            return (ssize_t)length;
+        }
+        length++;
+    }
+    
+    return -1;
+}
+
+void
+handle_server_client(int client_fd)
+{
+    char *request = malloc(MAX_REQUEST_LENGTH);
+    Boolean success = FALSE;
+    CFStringRef service_id = NULL;
+    
+    ssize_t length = read_socket_line(client_fd, request, MAX_REQUEST_LENGTH, time(NULL) + CLIENT_TIMEOUT);
+    if (length < 0) {
+        fprintf(stderr, "Failed to read request\n");
+        goto free_request;
+    }
+    
+    CFTypeRef object = create_json_value(request, (size_t)length);
+    if (object == NULL) {
+        goto respond;
+    }
+    
+    VPNOperation operation;
+    if (read_vpn_operation(object, &operation)) {
+        success = perform_vpn_operation(&operation, &service_id);
+    }
+    
+    CFRelease(object);
+    
+respond:;
+    FILE *response = fdopen(dup(client_fd), "w");
+    if (response != NULL) {
+        fprintf(response, "{\"ok\":%s,\"id\":", success ? "true" : "false");
+        write_json_string(response, success ? service_id : NULL);
+        fprintf(response, "}\n");
+        fclose(response);
+    }
+    
+    if (service_id != NULL) {
+        CFRelease(service_id);
+    }
+free_request:
+    free(request);
+}
+
+int
+run_server(const char *socket_path)
+{
+    struct sockaddr_un address;
+    if (!make_socket_address(socket_path, &address)) {
+        return 1;
+    }
+    
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    
+    /* Clients that go away before reading their response shouldn't kill us */
+    signal(SIGPIPE, SIG_IGN);
+    
+    /* Only replace a socket left by an earlier server, never whatever
+     * else the path names */
+    struct stat st;
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket\n", socket_path);
+            close(server_fd);
+            return 1;
+        }
+        unlink(socket_path);
+    } else if (errno != ENOENT) {
+        perror(socket_path);
+        close(server_fd);
+        return 1;
+    }
+    
+    /* The socket must never be reachable by anyone other than root, since
+     * requests are performed with our privileges. */
+    mode_t old_umask = umask(077);
+    int bind_result = bind(server_fd, (struct sockaddr *)&address, sizeof(address));
+    umask(old_umask);
+    
+    if (bind_result < 0) {
+        perror(socket_path);
+        close(server_fd);
+        return 1;
+    }
+    
+    if (listen(server_fd, 16) < 0) {
+        perror("listen");
+        close(server_fd);
+        return 1;
+    }
+    
+    while (TRUE) {
+        int client_fd = accept(server_fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+        
+        struct timeval timeout = {CLIENT_TIMEOUT, 0};
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        
+        handle_server_client(client_fd);
+        close(client_fd);
+    }
+}
+
+Boolean
+send_server_request(const char *socket_path, const VPNOperation *operation, CFStringRef *service_id)
+{
+    Boolean success = FALSE;
+    
+    struct sockaddr_un address;
+    if (!make_socket_address(socket_path, &address)) {
+        goto exit;
+    }
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        goto exit;
+    }
+    
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror(socket_path);
+        goto close_socket;
+    }
+    
+    FILE *request = fdopen(dup(fd), "w");
+    if (request == NULL) {
+        perror("fdopen");
+        goto close_socket;
+    }
+    
+    CFDictionaryRef object = create_vpn_operation_object(operation);
+    write_json_value(request, object);
+    fputc('\n', request);
+    fclose(request);
+    CFRelease(object);
+    
+    char *response = malloc(MAX_REQUEST_LENGTH);
+    ssize_t length = read_socket_line(fd, response, MAX_REQUEST_LENGTH, 0);
+    if (length < 0) {
+        fprintf(stderr, "Failed to read response from server\n");
+        goto free_response;
+    }
+    
+    CFTypeRef result = create_json_value(response, (size_t)length);
+    if (result == NULL) {
+        goto free_response;
+    }
+    
+    if (CFGetTypeID(result) == CFDictionaryGetTypeID()) {
+        success = (CFDictionaryGetValue(result, CFSTR("ok")) == kCFBooleanTrue);
+        
+        CFTypeRef result_id = CFDictionaryGetValue(result, CFSTR("id"));
+        if (success && service_id != NULL && result_id != NULL && CFGetTypeID(result_id) == CFStringGetTypeID()) {
+            *service_id = CFRetain(result_id);
+        }
+    }
+    
+    CFRelease(result);
+    
+free_response:
+    free(response);
+close_socket:
+    close(fd);
+exit:
+    return success;
+}
@@ -0,0 +1,30 @@
+#ifndef VPNHELPER_SERVER_H
+#define VPNHELPER_SERVER_H
+
+#include "manifest.h"
+#include <CoreFoundation/CoreFoundation.h>
+
+/* Runs a resident server that performs operations on behalf of clients.
+ * Each request is a single line containing the JSON representation of an
+ * operation (see read_vpn_operation()), and each response is a single line
+ * of the form {"ok": true | false, "id": ...}. The preferences, keychain and
+ * keychain access objects stay alive between requests, so clients don't
+ * pay to set them up every time. Does not return unless the socket could
+ * not be set up.
+ * @param socket_path The path of the Unix domain socket to listen on. Only
+ *     root may connect to it.
+ * @result Nonzero on failure.
+ */
+int run_server(const char *socket_path);
+
+/* Sends an operation to a running server and waits for the result.
+ * @param socket_path The path of the server's Unix domain socket.
+ * @param operation The operation to perform.
+ * @param service_id If not NULL, receives the service ID reported by the
+ *     server. The caller is responsible for releasing it.
+ * @result TRUE if the server performed the operation successfully; FALSE
+ *     otherwise.
+ */
+Boolean send_server_request(const char *socket_path, const VPNOperation *operation, CFStringRef *service_id);
+
+#endif
@@ -0,0 +1,199 @@
+#include "snapshot.h"
+#include "cache.h"
+#include "vpn.h"
+#include <stdio.h>
+#include <CommonCrypto/CommonDigest.h>
+
+/* The snapshot holds the "signature" of the store it was built from, the
+ * "services" it describes, and two indexes into them: "names" maps each
+ * name to the IDs of the connections with it, and "contents" maps each
+ * connection's content key to its ID. */
+#define SNAPSHOT_CACHE_NAME "snapshot.plist"
+
+CFStringRef
+create_vpn_content_key(CFStringRef service_name, CFStringRef server_address)
+{
+    CFStringRef content = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@\n%@"), service_name, server_address);
+    CFDataRef bytes = CFStringCreateExternalRepresentation(NULL, content, kCFStringEncodingUTF8, 0);
+    CFRelease(content);
+    
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256(CFDataGetBytePtr(bytes), (CC_LONG)CFDataGetLength(bytes), digest);
+    CFRelease(bytes);
+    
+    char hex[2 * CC_SHA256_DIGEST_LENGTH + 1];
+    for (int i = 0; i < CC_SHA256_DIGEST_LENGTH; ++i) {
+        snprintf(&hex[2 * i], 3, "%02x", digest[i]);
+    }
+    
+    return CFStringCreateWithCString(NULL, hex, kCFStringEncodingASCII);
+}
+
+/* Builds a snapshot from the live store. */
+CFDictionaryRef
+create_snapshot(CFDataRef signature)
+{
+    CFArrayRef vpn_list = copy_vpn_list();
+    if (vpn_list == NULL) {
+        return NULL;
+    }
+    
+    CFMutableDictionaryRef names = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFMutableDictionaryRef contents = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    
+    for (CFIndex i = 0; i < CFArrayGetCount(vpn_list); ++i) {
+        CFDictionaryRef description = CFArrayGetValueAtIndex(vpn_list, i);
+        CFStringRef service_id = CFDictionaryGetValue(description, CFSTR("id"));
+        CFStringRef service_name = CFDictionaryGetValue(description, CFSTR("name"));
+        CFStringRef server_address = CFDictionaryGetValue(description, CFSTR("address"));
+        if (service_name == NULL) {
+            continue;
+        }
+        
+        CFMutableArrayRef name_ids = (CFMutableArrayRef)CFDictionaryGetValue(names, service_name);
+        if (name_ids == NULL) {
+            name_ids = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+            CFDictionarySetValue(names, service_name, name_ids);
+            CFRelease(name_ids);
+        }
+        CFArrayAppendValue(name_ids, service_id);
+        
+        /* Duplicates keep the first ID, so lookups are stable */
+        if (server_address != NULL) {
+            CFStringRef content_key = create_vpn_content_key(service_name, server_address);
+            if (!CFDictionaryContainsKey(contents, content_key)) {
+                CFDictionarySetValue(contents, content_key, service_id);
+            }
+            CFRelease(content_key);
+        }
+    }
+    
+    CFMutableDictionaryRef snapshot = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFDictionarySetValue(snapshot, CFSTR("services"), vpn_list);
+    CFDictionarySetValue(snapshot, CFSTR("names"), names);
+    CFDictionarySetValue(snapshot, CFSTR("contents"), contents);
+    if (signature != NULL) {
+        CFDictionarySetValue(snapshot, CFSTR("signature"), signature);
+    }
+    
+    CFRelease(contents);
+    CFRelease(names);
+    CFRelease(vpn_list);
+    return snapshot;
+}
+
+/* Loads the snapshot, rebuilding it if the store has been modified since
+ * it was written, whether by this tool or anything else. */
+CFDictionaryRef
+copy_snapshot(void)
+{
+    CFDataRef signature = copy_vpn_preferences_signature();
+    
+    if (signature != NULL) {
+        CFDictionaryRef cache = copy_cache(SNAPSHOT_CACHE_NAME);
+        if (cache != NULL) {
+            if (CFGetTypeID(cache) == CFDictionaryGetTypeID()) {
+                const CFStringRef keys[4] = {CFSTR("signature"), CFSTR("services"), CFSTR("names"), CFSTR("contents")};
+                Boolean complete = TRUE;
+                for (int i = 0; i < 4; ++i) {
+                    complete = complete && CFDictionaryContainsKey(cache, keys[i]);
+                }
+                
+                if (complete && CFEqual(CFDictionaryGetValue(cache, CFSTR("signature")), signature)) {
+                    CFRelease(signature);
+                    return cache;
+                }
+            }
+            
+            CFRelease(cache);
+        }
+    }
+    
+    CFDictionaryRef snapshot = create_snapshot(signature);
+    
+    /* If the store changed while we were reading it, the signature won't
+     * match next time and the snapshot will just be rebuilt */
+    if (snapshot != NULL && signature != NULL) {
+        write_cache(SNAPSHOT_CACHE_NAME, snapshot);
+    }
+    
+    if (signature != NULL) {
+        CFRelease(signature);
+    }
+    return snapshot;
+}
+
+CFArrayRef
+copy_vpn_snapshot(void)
+{
+    CFDictionaryRef snapshot = copy_snapshot();
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    
+    CFArrayRef vpn_list = CFRetain(CFDictionaryGetValue(snapshot, CFSTR("services")));
+    CFRelease(snapshot);
+    return vpn_list;
+}
+
+CFArrayRef
+copy_vpn_ids_with_name(CFStringRef service_name)
+{
+    CFDictionaryRef snapshot = copy_snapshot();
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    
+    CFArrayRef service_ids = NULL;
+    CFDictionaryRef names = CFDictionaryGetValue(snapshot, CFSTR("names"));
+    if (CFGetTypeID(names) == CFDictionaryGetTypeID()) {
+        service_ids = CFDictionaryGetValue(names, service_name);
+    }
+    
+    if (service_ids != NULL) {
+        CFRetain(service_ids);
+    } else {
+        service_ids = CFArrayCreate(NULL, NULL, 0, &kCFTypeArrayCallBacks);
+    }
+    
+    CFRelease(snapshot);
+    return service_ids;
+}
+
+CFStringRef
+copy_vpn_id_with_content(CFStringRef service_name, CFStringRef server_address)
+{
+    CFDictionaryRef snapshot = copy_snapshot();
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    
+    CFStringRef service_id = NULL;
+    CFDictionaryRef contents = CFDictionaryGetValue(snapshot, CFSTR("contents"));
+    if (CFGetTypeID(contents) == CFDictionaryGetTypeID()) {
+        CFStringRef content_key = create_vpn_content_key(service_name, server_address);
+        service_id = CFDictionaryGetValue(contents, content_key);
+        CFRelease(content_key);
+    }
+    
+    if (service_id != NULL) {
+        CFRetain(service_id);
+    }
+    
+    CFRelease(snapshot);
+    return service_id;
+}
+
+CFDictionaryRef
+find_vpn_description(CFArrayRef vpn_list, CFStringRef service_id)
+{
+    for (CFIndex i = 0; i < CFArrayGetCount(vpn_list); ++i) {
+        CFDictionaryRef description = CFArrayGetValueAtIndex(vpn_list, i);
+        CFTypeRef description_id = CFDictionaryGetValue(description, CFSTR("id"));
+        if (description_id != NULL && CFEqual(description_id, service_id)) {
+            return description;
+        }
+    }
+    
+    return NULL;
+}
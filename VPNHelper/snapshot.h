@@ -0,0 +1,38 @@
+#ifndef VPNHELPER_SNAPSHOT_H
+#define VPNHELPER_SNAPSHOT_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/* Describes every L2TP VPN connection, like copy_vpn_list(). The result is
+ * kept in an on-disk snapshot that is only rebuilt when the preferences
+ * store has been modified, so repeated queries don't have to load it.
+ * @result The VPN connection descriptions, or NULL if the preferences could
+ *     not be read. The caller is responsible for releasing them.
+ */
+CFArrayRef copy_vpn_snapshot(void);
+
+/* Looks up VPN connections by name in the snapshot's index.
+ * @param service_name The name to look for.
+ * @result The service IDs of every connection with that name, which may be
+ *     empty, or NULL if the preferences could not be read. The caller is
+ *     responsible for releasing them.
+ */
+CFArrayRef copy_vpn_ids_with_name(CFStringRef service_name);
+
+/* Looks up a VPN connection with a given name and server address in the
+ * snapshot's index.
+ * @param service_name The name of the connection.
+ * @param server_address The address of its server.
+ * @result The service ID of the first such connection, or NULL if there is
+ *     none. The caller is responsible for releasing it.
+ */
+CFStringRef copy_vpn_id_with_content(CFStringRef service_name, CFStringRef server_address);
+
+/* Finds a VPN connection in a list returned by copy_vpn_snapshot().
+ * @param vpn_list The VPN connection descriptions.
+ * @param service_id The service ID to look for.
+ * @result The description of the VPN connection, or NULL if there is none.
+ */
+CFDictionaryRef find_vpn_description(CFArrayRef vpn_list, CFStringRef service_id);
+
+#endif
@@ -0,0 +1,305 @@
+#include "stream.h"
+#include "json.h"
+#include "manifest.h"
+#include "snapshot.h"
+#include "trace.h"
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+/* Lines longer than this are rejected rather than buffered. */
+#define MAX_LINE_LENGTH 65536
+
+typedef struct {
+    int fd;
+    char *buffer;
+    
+    /* The start of the unread data, and the end of all buffered data. */
+    size_t start;
+    size_t length;
+    
+    /* Whether the rest of an overlong line is being skipped. */
+    Boolean discarding;
+    
+    Boolean eof;
+} LineReader;
+
+typedef struct {
+    /* The parsed line, which owns the operation's strings, or NULL. */
+    CFTypeRef object;
+    
+    /* Whether the operation was valid and staged. */
+    Boolean staged;
+    
+    VPNOperation operation;
+    
+    /* The ID of the service, filled in by the commit for new services. */
+    CFStringRef service_id;
+} StreamEntry;
+
+typedef struct {
+    VPNTransactionRef transaction;
+    
+    /* The operations waiting for the commit, which can hold batch_size. */
+    StreamEntry *entries;
+    int count;
+    
+    /* When the first waiting operation arrived. */
+    uint64_t start_time;
+} StreamBatch;
+
+/* Returns the next complete line without its newline, or NULL if more input
+ * is needed. At the end of the input, any unterminated data is returned as
+ * the last line. too_long is set for a line that didn't fit in the buffer,
+ * whose contents are gone. */
+char *
+next_stream_line(LineReader *reader, size_t *length, Boolean *too_long)
+{
+    char *start = reader->buffer + reader->start;
+    size_t available = reader->length - reader->start;
+    char *newline = memchr(start, '\n', available);
+    
+    if (newline == NULL && !(reader->eof && (available > 0 || reader->discarding))) {
+        return NULL;
+    }
+    
+    *length = (newline != NULL) ? (size_t)(newline - start) : available;
+    *too_long = reader->discarding;
+    reader->start += *length + (newline != NULL ? 1 : 0);
+    reader->discarding = FALSE;
+    return start;
+}
+
+/* Reads more input into the buffer. Returns FALSE on a read error. */
+Boolean
+fill_stream_reader(LineReader *reader)
+{
+    memmove(reader->buffer, reader->buffer + reader->start, reader->length - reader->start);
+    reader->length -= reader->start;
+    reader->start = 0;
+    
+    /* The line can't fit, so drop what we have and skip to its end */
+    if (reader->length == MAX_LINE_LENGTH) {
+        reader->length = 0;
+        reader->discarding = TRUE;
+    }
+    
+    while (TRUE) {
+        ssize_t count = read(reader->fd, reader->buffer + reader->length, MAX_LINE_LENGTH - reader->length);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            perror("Failed to read input");
+            reader->eof = TRUE;
+            return FALSE;
+        }
+        
+        reader->eof = (count == 0);
+        reader->length += count;
+        return TRUE;
+    }
+}
+
+void
+write_stream_result(FILE *output, Boolean ok, CFStringRef service_id, CFDictionaryRef description)
+{
+    CFMutableDictionaryRef result = CFDictionaryCreateMutable(
+        NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+    );
+    
+    CFDictionarySetValue(result, CFSTR("ok"), ok ? kCFBooleanTrue : kCFBooleanFalse);
+    CFDictionarySetValue(result, CFSTR("id"), (ok && service_id != NULL) ? (CFTypeRef)service_id : kCFNull);
+    if (description != NULL) {
+        CFDictionarySetValue(result, CFSTR("vpn"), description);
+    }
+    
+    write_json_value(output, result);
+    fputc('\n', output);
+    CFRelease(result);
+}
+
+/* Commits the waiting operations and writes their results. */
+void
+flush_stream_batch(StreamBatch *batch, FILE *output)
+{
+    Boolean committed = FALSE;
+    Boolean store_changed = FALSE;
+    int staged_count = 0;
+    if (batch->transaction != NULL) {
+        committed = commit_vpn_transaction(batch->transaction);
+        store_changed = is_vpn_transaction_committed(batch->transaction);
+        end_vpn_transaction(batch->transaction);
+        batch->transaction = NULL;
+    }
+    
+    for (int i = 0; i < batch->count; ++i) {
+        if (batch->entries[i].staged) {
+            staged_count++;
+        }
+    }
+    
+    for (int i = 0; i < batch->count; ++i) {
+        StreamEntry *entry = &batch->entries[i];
+        Boolean ok = entry->staged && committed;
+        CFStringRef service_id = entry->service_id;
+        CFStringRef retried_id = NULL;
+        
+        /* One bad operation, like a delete of an unknown ID, fails the whole
+         * group. If nothing was committed, find out which operations
+         * actually fail; otherwise retrying could create services twice. */
+        if (entry->staged && !committed && !store_changed && staged_count > 1) {
+            ok = perform_vpn_operation(&entry->operation, &retried_id);
+            service_id = retried_id;
+        }
+        
+        write_stream_result(output, ok, service_id, NULL);
+        
+        if (retried_id != NULL) {
+            CFRelease(retried_id);
+        }
+        
+        /* IDs of new services were created for us; the rest are borrowed */
+        if (entry->staged && entry->operation.type == VPNOperationCreate && entry->service_id != NULL) {
+            CFRelease(entry->service_id);
+        }
+        if (entry->object != NULL) {
+            CFRelease(entry->object);
+        }
+    }
+    
+    batch->count = 0;
+    fflush(output);
+}
+
+void
+show_stream_vpn(FILE *output, CFDictionaryRef object)
+{
+    CFStringRef service_id = CFDictionaryGetValue(object, CFSTR("id"));
+    CFDictionaryRef description = NULL;
+    
+    CFArrayRef vpn_list = NULL;
+    if (service_id != NULL && CFGetTypeID(service_id) == CFStringGetTypeID()) {
+        vpn_list = copy_vpn_snapshot();
+    }
+    if (vpn_list != NULL) {
+        description = find_vpn_description(vpn_list, service_id);
+    }
+    
+    write_stream_result(output, description != NULL, service_id, description);
+    fflush(output);
+    
+    if (vpn_list != NULL) {
+        CFRelease(vpn_list);
+    }
+}
+
+void
+handle_stream_line(StreamBatch *batch, FILE *output, const char *line, size_t length, Boolean too_long)
+{
+    CFTypeRef object = too_long ? NULL : create_json_value(line, length);
+    
+    if (object != NULL && CFGetTypeID(object) == CFDictionaryGetTypeID()) {
+        CFTypeRef action = CFDictionaryGetValue(object, CFSTR("action"));
+        if (action != NULL && CFEqual(action, CFSTR("show"))) {
+            /* Make sure the show sees everything before it */
+            flush_stream_batch(batch, output);
+            show_stream_vpn(output, object);
+            CFRelease(object);
+            return;
+        }
+    }
+    
+    if (batch->count == 0) {
+        batch->start_time = mach_absolute_time();
+    }
+    
+    StreamEntry *entry = &batch->entries[batch->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->object = object;
+    
+    if (too_long) {
+        fprintf(stderr, "Operation is longer than %d bytes\n", MAX_LINE_LENGTH);
+        return;
+    }
+    
+    if (object == NULL || !read_vpn_operation(object, &entry->operation)) {
+        return;
+    }
+    
+    if (batch->transaction == NULL) {
+        batch->transaction = begin_vpn_transaction();
+        if (batch->transaction == NULL) {
+            return;
+        }
+    }
+    
+    entry->service_id = entry->operation.service_id;
+    if (entry->operation.type == VPNOperationDelete) {
+        entry->staged = delete_vpn_in_transaction(batch->transaction, entry->service_id);
+    } else {
+        entry->staged = create_vpn_in_transaction(batch->transaction, &entry->service_id, &entry->operation.config);
+    }
+}
+
+int
+run_stream(int input_fd, FILE *output, int batch_size, double batch_interval)
+{
+    int err = 0;
+    
+    LineReader reader = {
+        .fd = input_fd,
+        .buffer = malloc(MAX_LINE_LENGTH)
+    };
+    
+    StreamBatch batch = {
+        .transaction = NULL,
+        .entries = calloc(batch_size, sizeof(StreamEntry)),
+        .count = 0
+    };
+    
+    while (TRUE) {
+        size_t length;
+        Boolean too_long;
+        char *line = next_stream_line(&reader, &length, &too_long);
+        
+        if (line != NULL) {
+            if (length > 0 || too_long) {
+                handle_stream_line(&batch, output, line, length, too_long);
+            }
+            if (batch.count >= batch_size) {
+                flush_stream_batch(&batch, output);
+            }
+            continue;
+        }
+        
+        if (reader.eof) {
+            break;
+        }
+        
+        /* Wait for more input, but only until the waiting operations are due
+         * to be committed */
+        if (batch.count > 0) {
+            double elapsed = mach_time_to_ms(mach_absolute_time() - batch.start_time);
+            if (elapsed >= batch_interval) {
+                flush_stream_batch(&batch, output);
+                continue;
+            }
+            
+            struct pollfd poll_fd = {input_fd, POLLIN, 0};
+            int ready = poll(&poll_fd, 1, (int)(batch_interval - elapsed) + 1);
+            if (ready == 0 || (ready < 0 && errno == EINTR)) {
+                continue;
+            }
+        }
+        
+        if (!fill_stream_reader(&reader)) {
+            err = 1;
+        }
+    }
+    
+    flush_stream_batch(&batch, output);
+    free(batch.entries);
+    free(reader.buffer);
+    return err;
+}
@@ -0,0 +1,28 @@
+#ifndef VPNHELPER_STREAM_H
+#define VPNHELPER_STREAM_H
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdio.h>
+
+/* Performs a stream of operations, one JSON object per input line, and
+ * writes one result line per operation, in order. Each operation is either
+ * a manifest entry (see read_vpn_operation()) or {"action": "show", "id":
+ * ...}. Results have the form {"ok": true | false, "id": ...}, plus "vpn"
+ * with the connection's description for a show.
+ *
+ * Changes are group committed: they are staged in a transaction that is
+ * committed once it holds batch_size operations, or batch_interval
+ * milliseconds after its first operation arrived, whichever comes first.
+ * Their results are written once the commit finishes, and if it fails,
+ * every operation in the group fails. A show commits pending changes first,
+ * so it always sees them.
+ * @param input_fd The file descriptor to read operations from.
+ * @param output The file to write results to.
+ * @param batch_size The most operations to commit together.
+ * @param batch_interval The longest to wait before committing, in
+ *     milliseconds.
+ * @result Nonzero if the input could not be read.
+ */
+int run_stream(int input_fd, FILE *output, int batch_size, double batch_interval);
+
+#endif
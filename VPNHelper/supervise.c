@@ -0,0 +1,178 @@
+#include "supervise.h"
+#include "watch.h"
+#include "trace.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dispatch/dispatch.h>
+#include <mach/mach_time.h>
+
+typedef struct {
+    CFArrayRef service_ids;
+    Supervisor *supervisor;
+    dispatch_source_t timer;
+} SuperviseState;
+
+void
+get_service_id_chars(CFArrayRef service_ids, int service, char *buffer, size_t size)
+{
+    if (!CFStringGetCString(CFArrayGetValueAtIndex(service_ids, service), buffer, size, kCFStringEncodingUTF8)) {
+        buffer[0] = '\0';
+    }
+}
+
+Boolean
+supervise_connect(int service, int attempt, void *info)
+{
+    SuperviseState *state = info;
+    CFStringRef service_id = CFArrayGetValueAtIndex(state->service_ids, service);
+    
+    char service_id_chars[256];
+    get_service_id_chars(state->service_ids, service, service_id_chars, sizeof(service_id_chars));
+    printf("%s: reconnecting (attempt %d)\n", service_id_chars, attempt);
+    fflush(stdout);
+    
+    SCNetworkConnectionRef connection = SCNetworkConnectionCreateWithServiceID(NULL, service_id, NULL, NULL);
+    if (connection == NULL) {
+        fprintf(stderr, "Failed to create connection: %s (%d)\n", SCErrorString(SCError()), SCError());
+        return FALSE;
+    }
+    
+    /* Linger so the tunnel outlives this process */
+    Boolean success = SCNetworkConnectionStart(connection, NULL, TRUE);
+    if (!success) {
+        fprintf(stderr, "Failed to start VPN: %s (%d)\n", SCErrorString(SCError()), SCError());
+    }
+    
+    CFRelease(connection);
+    return success;
+}
+
+double
+supervise_now(void *info)
+{
+    return mach_time_to_ms(mach_absolute_time());
+}
+
+void
+supervise_wake_at(double when, void *info)
+{
+    SuperviseState *state = info;
+    
+    if (when < 0) {
+        dispatch_source_set_timer(state->timer, DISPATCH_TIME_FOREVER, 0, 0);
+        return;
+    }
+    
+    double delay = when - supervise_now(info);
+    if (delay < 0) {
+        delay = 0;
+    }
+    dispatch_source_set_timer(state->timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_MSEC)), DISPATCH_TIME_FOREVER, 10 * NSEC_PER_MSEC);
+}
+
+double
+supervise_random(void *info)
+{
+    return arc4random() / 4294967296.0;
+}
+
+void
+supervise_timer_fired(void *info)
+{
+    SuperviseState *state = info;
+    run_supervisor(state->supervisor);
+}
+
+void
+supervise_status_changed(CFStringRef service_id, SCNetworkConnectionStatus status, int last_cause, void *info)
+{
+    SuperviseState *state = info;
+    
+    CFIndex service = CFArrayGetFirstIndexOfValue(state->service_ids, CFRangeMake(0, CFArrayGetCount(state->service_ids)), service_id);
+    if (service < 0) {
+        return;
+    }
+    
+    char service_id_chars[256];
+    get_service_id_chars(state->service_ids, (int)service, service_id_chars, sizeof(service_id_chars));
+    
+    SupervisedServiceStats stats;
+    get_supervised_service_stats(state->supervisor, (int)service, &stats);
+    
+    if (status == kSCNetworkConnectionConnected && !stats.is_up) {
+        supervisor_service_up(state->supervisor, (int)service);
+        printf("%s: up\n", service_id_chars);
+    } else if ((status == kSCNetworkConnectionDisconnected || status == kSCNetworkConnectionInvalid) && stats.is_up) {
+        supervisor_service_down(state->supervisor, (int)service);
+        printf("%s: down (last cause %d)\n", service_id_chars, last_cause);
+    } else if (status == kSCNetworkConnectionDisconnected || status == kSCNetworkConnectionInvalid) {
+        /* Either the initial status, or an attempt that failed */
+        supervisor_service_down(state->supervisor, (int)service);
+    }
+    fflush(stdout);
+    
+    run_supervisor(state->supervisor);
+}
+
+void
+supervise_interrupted(void *info)
+{
+    SuperviseState *state = info;
+    
+    printf("%-40s %8s %10s %12s\n", "service", "attempts", "reconnects", "downtime ms");
+    for (CFIndex i = 0; i < CFArrayGetCount(state->service_ids); ++i) {
+        char service_id_chars[256];
+        get_service_id_chars(state->service_ids, (int)i, service_id_chars, sizeof(service_id_chars));
+        
+        SupervisedServiceStats stats;
+        get_supervised_service_stats(state->supervisor, (int)i, &stats);
+        printf("%-40s %8d %10d %12.0f\n", service_id_chars, stats.attempts, stats.reconnects, stats.downtime);
+    }
+    
+    exit(0);
+}
+
+dispatch_source_t
+create_signal_source(int signal_number, dispatch_queue_t queue, SuperviseState *state)
+{
+    signal(signal_number, SIG_IGN);
+    dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_SIGNAL, signal_number, 0, queue);
+    dispatch_set_context(source, state);
+    dispatch_source_set_event_handler_f(source, supervise_interrupted);
+    dispatch_resume(source);
+    return source;
+}
+
+int
+run_supervise(CFArrayRef service_ids, SupervisorPolicy policy)
+{
+    /* Everything runs on one serial queue, so the scheduler needs no locks */
+    dispatch_queue_t queue = dispatch_queue_create("VPNHelper.supervise", DISPATCH_QUEUE_SERIAL);
+    
+    SuperviseState *state = malloc(sizeof(SuperviseState));
+    state->service_ids = service_ids;
+    state->timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+    dispatch_set_context(state->timer, state);
+    dispatch_source_set_event_handler_f(state->timer, supervise_timer_fired);
+    dispatch_source_set_timer(state->timer, DISPATCH_TIME_FOREVER, 0, 0);
+    
+    SupervisorBackend backend = {
+        .connect = supervise_connect,
+        .wake_at = supervise_wake_at,
+        .now = supervise_now,
+        .random = supervise_random,
+        .info = state
+    };
+    state->supervisor = create_supervisor((int)CFArrayGetCount(service_ids), policy, backend);
+    
+    create_signal_source(SIGINT, queue, state);
+    create_signal_source(SIGTERM, queue, state);
+    dispatch_resume(state->timer);
+    
+    if (!watch_connection_events(service_ids, queue, supervise_status_changed, state)) {
+        return 1;
+    }
+    
+    dispatch_main();
+}
@@ -0,0 +1,17 @@
+#ifndef VPNHELPER_SUPERVISE_H
+#define VPNHELPER_SUPERVISE_H
+
+#include "supervisor.h"
+#include <CoreFoundation/CoreFoundation.h>
+
+/* Keeps VPN connections up, reconnecting them when they drop according to
+ * a policy. Every drop, attempt and reconnect is printed as it happens, and
+ * each connection's downtime is printed when the process is interrupted.
+ * Does not return unless the connections could not be watched.
+ * @param service_ids The service IDs of the VPN connections.
+ * @param policy How to pace reconnect attempts.
+ * @result Nonzero on failure.
+ */
+int run_supervise(CFArrayRef service_ids, SupervisorPolicy policy);
+
+#endif
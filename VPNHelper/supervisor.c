@@ -0,0 +1,208 @@
+#include "supervisor.h"
+#include <math.h>
+
+typedef enum {
+    /* No status has been reported yet. */
+    SupervisedUnknown,
+    
+    /* Connected. */
+    SupervisedUp,
+    
+    /* Down, waiting for the next attempt. */
+    SupervisedWaiting,
+    
+    /* Down, with an attempt in progress. */
+    SupervisedConnecting
+} SupervisedState;
+
+typedef struct {
+    SupervisedState state;
+    
+    /* Failed attempts since the service was last up, which sets the backoff. */
+    int failures;
+    
+    /* When the next attempt is due, or when the current one started. */
+    double next_attempt;
+    double attempt_started;
+    
+    /* When the current outage started. */
+    double down_since;
+    
+    SupervisedServiceStats stats;
+} SupervisedService;
+
+struct Supervisor {
+    SupervisorPolicy policy;
+    SupervisorBackend backend;
+    
+    SupervisedService *services;
+    int service_count;
+    
+    /* The number of attempts in progress. */
+    int active;
+};
+
+Supervisor *
+create_supervisor(int service_count, SupervisorPolicy policy, SupervisorBackend backend)
+{
+    Supervisor *supervisor = malloc(sizeof(Supervisor));
+    supervisor->policy = policy;
+    supervisor->backend = backend;
+    supervisor->services = calloc(service_count + 1, sizeof(SupervisedService));
+    supervisor->service_count = service_count;
+    supervisor->active = 0;
+    return supervisor;
+}
+
+void
+free_supervisor(Supervisor *supervisor)
+{
+    free(supervisor->services);
+    free(supervisor);
+}
+
+double
+get_supervisor_time(Supervisor *supervisor)
+{
+    return supervisor->backend.now(supervisor->backend.info);
+}
+
+/* Picks the delay before the next attempt. Half of it is random, so
+ * services that dropped together don't all retry at the same moment. */
+double
+get_backoff_delay(Supervisor *supervisor, int failures)
+{
+    double delay = supervisor->policy.base_delay * pow(2, failures);
+    if (delay > supervisor->policy.max_delay) {
+        delay = supervisor->policy.max_delay;
+    }
+    
+    double jitter = supervisor->backend.random(supervisor->backend.info);
+    return delay / 2 + jitter * delay / 2;
+}
+
+void
+supervisor_service_up(Supervisor *supervisor, int service)
+{
+    SupervisedService *supervised = &supervisor->services[service];
+    double now = get_supervisor_time(supervisor);
+    
+    if (supervised->state == SupervisedUp) {
+        return;
+    }
+    
+    /* An attempt that timed out may still connect afterwards, which counts
+     * as a reconnect too */
+    if (supervised->state == SupervisedConnecting) {
+        supervisor->active--;
+        supervised->stats.reconnects++;
+    } else if (supervised->state == SupervisedWaiting && supervised->failures > 0) {
+        supervised->stats.reconnects++;
+    }
+    
+    if (supervised->state == SupervisedWaiting || supervised->state == SupervisedConnecting) {
+        supervised->stats.downtime += now - supervised->down_since;
+    }
+    
+    supervised->state = SupervisedUp;
+    supervised->failures = 0;
+    supervised->stats.is_up = TRUE;
+}
+
+void
+supervisor_service_down(Supervisor *supervisor, int service)
+{
+    SupervisedService *supervised = &supervisor->services[service];
+    double now = get_supervisor_time(supervisor);
+    
+    switch (supervised->state) {
+        case SupervisedWaiting:
+            /* Already waiting, so keep the scheduled attempt */
+            return;
+        case SupervisedConnecting:
+            supervisor->active--;
+            supervised->failures++;
+            break;
+        case SupervisedUnknown:
+        case SupervisedUp:
+            supervised->down_since = now;
+            break;
+    }
+    
+    supervised->state = SupervisedWaiting;
+    supervised->next_attempt = now + get_backoff_delay(supervisor, supervised->failures);
+    supervised->stats.is_up = FALSE;
+}
+
+void
+run_supervisor(Supervisor *supervisor)
+{
+    SupervisorPolicy *policy = &supervisor->policy;
+    double now = get_supervisor_time(supervisor);
+    
+    for (int i = 0; i < supervisor->service_count; ++i) {
+        SupervisedService *supervised = &supervisor->services[i];
+        if (supervised->state == SupervisedConnecting && now - supervised->attempt_started >= policy->attempt_timeout) {
+            supervisor_service_down(supervisor, i);
+        }
+    }
+    
+    /* Start due attempts, most overdue first, until the limit is reached */
+    while (policy->max_concurrent <= 0 || supervisor->active < policy->max_concurrent) {
+        SupervisedService *next = NULL;
+        int next_index = -1;
+        for (int i = 0; i < supervisor->service_count; ++i) {
+            SupervisedService *supervised = &supervisor->services[i];
+            if (supervised->state == SupervisedWaiting && supervised->next_attempt <= now &&
+                (next == NULL || supervised->next_attempt < next->next_attempt)) {
+                next = supervised;
+                next_index = i;
+            }
+        }
+        
+        if (next == NULL) {
+            break;
+        }
+        
+        next->state = SupervisedConnecting;
+        next->attempt_started = now;
+        next->stats.attempts++;
+        supervisor->active++;
+        
+        if (!supervisor->backend.connect(next_index, next->failures + 1, supervisor->backend.info)) {
+            supervisor_service_down(supervisor, next_index);
+        }
+    }
+    
+    /* Wake for the earliest attempt or timeout. Attempts that are due but
+     * held back by the limit wait for a slot, which frees up through an
+     * event or a timeout. */
+    Boolean at_limit = policy->max_concurrent > 0 && supervisor->active >= policy->max_concurrent;
+    double wake = -1;
+    for (int i = 0; i < supervisor->service_count; ++i) {
+        SupervisedService *supervised = &supervisor->services[i];
+        double when = -1;
+        if (supervised->state == SupervisedConnecting) {
+            when = supervised->attempt_started + policy->attempt_timeout;
+        } else if (supervised->state == SupervisedWaiting && !at_limit) {
+            when = supervised->next_attempt;
+        }
+        
+        if (when >= 0 && (wake < 0 || when < wake)) {
+            wake = when;
+        }
+    }
+    
+    supervisor->backend.wake_at(wake, supervisor->backend.info);
+}
+
+void
+get_supervised_service_stats(Supervisor *supervisor, int service, SupervisedServiceStats *stats)
+{
+    SupervisedService *supervised = &supervisor->services[service];
+    *stats = supervised->stats;
+    
+    if (supervised->state == SupervisedWaiting || supervised->state == SupervisedConnecting) {
+        stats->downtime += get_supervisor_time(supervisor) - supervised->down_since;
+    }
+}
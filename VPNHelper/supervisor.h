@@ -0,0 +1,109 @@
+#ifndef VPNHELPER_SUPERVISOR_H
+#define VPNHELPER_SUPERVISOR_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/* The scheduler behind the supervise command. It decides when to reconnect
+ * services that have dropped, and knows nothing about SystemConfiguration
+ * or libdispatch: services are numbered from 0, and connecting, time and
+ * randomness all come from a backend, so it can be driven by a simulated
+ * one with a virtual clock. */
+
+typedef struct {
+    /* The delay before the first reconnect attempt after a drop, in
+     * milliseconds. It doubles after every failed attempt. */
+    double base_delay;
+    
+    /* The longest delay between attempts, in milliseconds. */
+    double max_delay;
+    
+    /* How long an attempt may take before it counts as failed, in
+     * milliseconds. */
+    double attempt_timeout;
+    
+    /* The most attempts that may be in progress at once, or 0 for no limit. */
+    int max_concurrent;
+} SupervisorPolicy;
+
+typedef struct {
+    /* Starts connecting a service. The backend reports the outcome later
+     * with supervisor_service_up() or supervisor_service_down().
+     * @result TRUE if the attempt was started; FALSE otherwise.
+     */
+    Boolean (*connect)(int service, int attempt, void *info);
+    
+    /* Asks for run_supervisor() to be called at a given time, replacing any
+     * earlier request. A negative time cancels the request. */
+    void (*wake_at)(double when, void *info);
+    
+    /* Gets the current time, in milliseconds. */
+    double (*now)(void *info);
+    
+    /* Gets a random number in [0, 1). */
+    double (*random)(void *info);
+    
+    /* Passed to every function above. */
+    void *info;
+} SupervisorBackend;
+
+typedef struct {
+    /* Whether the service is currently connected. */
+    Boolean is_up;
+    
+    /* The number of reconnect attempts made, and how many succeeded,
+     * including attempts that connected after timing out. */
+    int attempts;
+    int reconnects;
+    
+    /* The total time the service has been down, including the current
+     * outage, in milliseconds. */
+    double downtime;
+} SupervisedServiceStats;
+
+typedef struct Supervisor Supervisor;
+
+/* Creates a scheduler. Services are not reconnected until they have been
+ * reported down.
+ * @param service_count The number of services to supervise.
+ * @param policy How to pace reconnect attempts.
+ * @param backend The backend to drive.
+ * @result The scheduler. Free it with free_supervisor().
+ */
+Supervisor *create_supervisor(int service_count, SupervisorPolicy policy, SupervisorBackend backend);
+
+/* Frees a scheduler.
+ * @param supervisor The scheduler.
+ */
+void free_supervisor(Supervisor *supervisor);
+
+/* Reports that a service has connected. This ends its outage and resets its
+ * backoff.
+ * @param supervisor The scheduler.
+ * @param service The service.
+ */
+void supervisor_service_up(Supervisor *supervisor, int service);
+
+/* Reports that a service has disconnected, either by dropping or because
+ * an attempt failed. A reconnect is scheduled with exponential backoff and
+ * jitter.
+ * @param supervisor The scheduler.
+ * @param service The service.
+ */
+void supervisor_service_down(Supervisor *supervisor, int service);
+
+/* Starts any reconnect attempts that are due and that fit within the
+ * concurrency limit, fails attempts that have timed out, and asks the
+ * backend to wake it again when the next one is due. Call this after
+ * reporting events and whenever the backend's wake time is reached.
+ * @param supervisor The scheduler.
+ */
+void run_supervisor(Supervisor *supervisor);
+
+/* Gets the statistics of a service.
+ * @param supervisor The scheduler.
+ * @param service The service.
+ * @param stats Receives the statistics.
+ */
+void get_supervised_service_stats(Supervisor *supervisor, int service, SupervisedServiceStats *stats);
+
+#endif
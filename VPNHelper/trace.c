@@ -0,0 +1,151 @@
+#include "trace.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <unistd.h>
+
+typedef struct {
+    /* The name of the phase. */
+    const char *name;
+    
+    /* When the span started and ended, in mach time units. */
+    uint64_t start_time;
+    uint64_t end_time;
+} TraceSpan;
+
+typedef struct {
+    /* The name of the phase. */
+    const char *name;
+    
+    /* The number of spans, and their total and longest durations. */
+    unsigned int count;
+    uint64_t total_time;
+    uint64_t max_time;
+} TraceSummary;
+
+Boolean tracing_enabled = FALSE;
+
+const char *trace_path = NULL;
+uint64_t trace_start_time = 0;
+TraceSpan *trace_spans = NULL;
+size_t trace_span_count = 0;
+size_t trace_span_capacity = 0;
+
+double
+mach_time_to_ms(uint64_t duration)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return (double)duration * timebase.numer / timebase.denom / 1e6;
+}
+
+void
+record_trace_span(const char *name, uint64_t start_time, uint64_t end_time)
+{
+    if (metrics_enabled) {
+        record_metrics_span(name, end_time - start_time);
+    }
+    
+    if (trace_path == NULL) {
+        return;
+    }
+    
+    if (trace_span_count == trace_span_capacity) {
+        trace_span_capacity = (trace_span_capacity == 0) ? 64 : trace_span_capacity * 2;
+        trace_spans = realloc(trace_spans, trace_span_capacity * sizeof(TraceSpan));
+    }
+    
+    TraceSpan *span = &trace_spans[trace_span_count++];
+    span->name = name;
+    span->start_time = start_time;
+    span->end_time = end_time;
+}
+
+void
+write_trace_file(void)
+{
+    FILE *file = fopen(trace_path, "w");
+    if (file == NULL) {
+        perror(trace_path);
+        return;
+    }
+    
+    int pid = getpid();
+    
+    fprintf(file, "{\"traceEvents\":[");
+    for (size_t i = 0; i < trace_span_count; ++i) {
+        TraceSpan *span = &trace_spans[i];
+        double start_us = mach_time_to_ms(span->start_time - trace_start_time) * 1000;
+        double duration_us = mach_time_to_ms(span->end_time - span->start_time) * 1000;
+        fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":1}",
+                (i > 0) ? "," : "", span->name, start_us, duration_us, pid);
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    
+    fclose(file);
+}
+
+void
+print_trace_summary(void)
+{
+    TraceSummary *summaries = calloc(trace_span_count + 1, sizeof(TraceSummary));
+    size_t summary_count = 0;
+    
+    /* There are only a handful of distinct phases, so a linear search
+     * is fine; names are literals, so pointers can be compared */
+    for (size_t i = 0; i < trace_span_count; ++i) {
+        TraceSpan *span = &trace_spans[i];
+        
+        size_t j = 0;
+        while (j < summary_count && summaries[j].name != span->name) {
+            j++;
+        }
+        if (j == summary_count) {
+            summaries[summary_count++].name = span->name;
+        }
+        
+        uint64_t duration = span->end_time - span->start_time;
+        summaries[j].count++;
+        summaries[j].total_time += duration;
+        if (duration > summaries[j].max_time) {
+            summaries[j].max_time = duration;
+        }
+    }
+    
+    fprintf(stderr, "%-32s %8s %12s %12s %12s\n", "phase", "count", "total ms", "mean ms", "max ms");
+    for (size_t i = 0; i < summary_count; ++i) {
+        TraceSummary *summary = &summaries[i];
+        double total_ms = mach_time_to_ms(summary->total_time);
+        fprintf(stderr, "%-32s %8u %12.3f %12.3f %12.3f\n",
+                summary->name, summary->count, total_ms, total_ms / summary->count, mach_time_to_ms(summary->max_time));
+    }
+    
+    free(summaries);
+}
+
+void
+finish_tracing(void)
+{
+    write_trace_file();
+    print_trace_summary();
+}
+
+void
+enable_trace_spans(void)
+{
+    tracing_enabled = TRUE;
+}
+
+void
+enable_tracing(const char *path)
+{
+    if (trace_path != NULL) {
+        return;
+    }
+    
+    trace_path = path;
+    trace_start_time = mach_absolute_time();
+    enable_trace_spans();
+    atexit(finish_tracing);
+}
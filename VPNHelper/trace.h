@@ -0,0 +1,55 @@
+#ifndef VPNHELPER_TRACE_H
+#define VPNHELPER_TRACE_H
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <mach/mach_time.h>
+
+/* Whether spans are being timed, for a trace file or for metrics. Checked
+ * inline so that tracing costs a single branch when it is off. */
+extern Boolean tracing_enabled;
+
+/* Starts recording spans. When the process exits, they are written to a
+ * file in Chrome trace event format (viewable in chrome://tracing), and a
+ * per-phase summary is printed to stderr.
+ * @param path The path of the trace file.
+ */
+void enable_tracing(const char *path);
+
+/* Starts timing spans without writing a trace file. Spans are passed to
+ * the metrics code if it is enabled.
+ */
+void enable_trace_spans(void);
+
+/* Records a span. Only call this from the main thread.
+ * @param name The name of the phase. Must be a string literal, since it
+ *     is not copied.
+ * @param start_time When the span started, in mach time units.
+ * @param end_time When the span ended, in mach time units.
+ */
+void record_trace_span(const char *name, uint64_t start_time, uint64_t end_time);
+
+/* Converts a duration in mach time units to milliseconds. */
+double mach_time_to_ms(uint64_t duration);
+
+/* Marks the start of a span.
+ * @result The start time to pass to trace_end().
+ */
+static inline uint64_t
+trace_begin(void)
+{
+    return tracing_enabled ? mach_absolute_time() : 0;
+}
+
+/* Marks the end of a span started with trace_begin().
+ * @param name The name of the phase. Must be a string literal.
+ * @param start_time The value returned by trace_begin().
+ */
+static inline void
+trace_end(const char *name, uint64_t start_time)
+{
+    if (tracing_enabled) {
+        record_trace_span(name, start_time, mach_absolute_time());
+    }
+}
+
+#endif
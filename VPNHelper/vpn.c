@@ -1,12 +1,22 @@
 #include "vpn.h"
 #include "keychain.h"
+#include "metrics.h"
+#include "trace.h"
 #include <stdio.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include <SystemConfiguration/SystemConfiguration.h>
 
+/* Where SCPreferences keeps the network configuration, and where it
+ * resolves relative preferences IDs against. */
+#define SYSTEM_PREFERENCES_DIRECTORY "/Library/Preferences/SystemConfiguration"
+#define SYSTEM_PREFERENCES_PATH SYSTEM_PREFERENCES_DIRECTORY "/preferences.plist"
+
 void
 print_scerror(const char *message)
 {
     fprintf(stderr, "%s: %s (%d)\n", message, SCErrorString(SCError()), SCError());
+    record_metrics_failure("SCError", SCError());
 }
 
 CFStringRef
@@ -15,9 +25,21 @@ create_shared_secret_id(CFStringRef service_id)
     return CFStringCreateWithFormat(NULL, NULL, CFSTR("%@.SS"), service_id);
 }
 
+CFStringRef
+create_service_id_for_keychain_service(CFStringRef keychain_service)
+{
+    CFIndex length = CFStringGetLength(keychain_service);
+    if (CFStringHasSuffix(keychain_service, CFSTR(".SS"))) {
+        length -= 3;
+    }
+    return CFStringCreateWithSubstring(NULL, keychain_service, CFRangeMake(0, length));
+}
+
 SCNetworkServiceRef
 create_vpn_service(SCPreferencesRef preferences)
 {
+    uint64_t start_time = trace_begin();
+    
     SCNetworkInterfaceRef l2tp_interface = SCNetworkInterfaceCreateWithInterface(
         kSCNetworkInterfaceIPv4, kSCNetworkInterfaceTypeL2TP
     );
@@ -34,6 +56,7 @@ create_vpn_service(SCPreferencesRef preferences)
     CFRelease(ppp_interface);
     CFRelease(l2tp_interface);
     
+    trace_end("create_vpn_service", start_time);
     return vpn_service;
 }
 
@@ -76,30 +99,29 @@ set_ppp_config(SCNetworkInterfaceRef vpn_interface, L2TPConfigRef config)
         return TRUE;
     }
     
-    const void *keys[3] = {
-        kSCPropNetPPPAuthPasswordEncryption
-    };
-    
-    const void *values[3] = {
-        kSCValNetPPPAuthPasswordEncryptionKeychain
-    };
+    /* Merge into the existing config so that fields we aren't changing
+     * keep their values */
+    CFDictionaryRef current_config = SCNetworkInterfaceGetConfiguration(vpn_interface);
+    CFMutableDictionaryRef ppp_config;
+    if (current_config != NULL) {
+        ppp_config = CFDictionaryCreateMutableCopy(NULL, 0, current_config);
+    } else {
+        ppp_config = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    }
     
-    int index = 1;
+    CFDictionarySetValue(ppp_config, kSCPropNetPPPAuthPasswordEncryption, kSCValNetPPPAuthPasswordEncryptionKeychain);
     
     if (server_address != NULL) {
-        keys[index] = kSCPropNetPPPCommRemoteAddress;
-        values[index] = server_address;
-        index++;
+        CFDictionarySetValue(ppp_config, kSCPropNetPPPCommRemoteAddress, server_address);
     }
     
     if (username != NULL) {
-        keys[index] = kSCPropNetPPPAuthName;
-        values[index] = username;
-        index++;
+        CFDictionarySetValue(ppp_config, kSCPropNetPPPAuthName, username);
     }
     
-    CFDictionaryRef ppp_config = CFDictionaryCreate(NULL, keys, values, index, NULL, NULL);
+    uint64_t start_time = trace_begin();
     Boolean success = SCNetworkInterfaceSetConfiguration(vpn_interface, ppp_config);
+    trace_end("set_ppp_config", start_time);
     CFRelease(ppp_config);
     
     if (!success) {
@@ -110,7 +132,7 @@ set_ppp_config(SCNetworkInterfaceRef vpn_interface, L2TPConfigRef config)
 }
 
 Boolean
-set_ipsec_config(SCNetworkInterfaceRef vpn_interface, CFStringRef shared_secret_id)
+set_ipsec_config(SCNetworkInterfaceRef vpn_interface, CFStringRef shared_secret_id, Boolean *changed)
 {
     const void *keys[3] = {
         kSCPropNetIPSecAuthenticationMethod,
@@ -124,14 +146,26 @@ set_ipsec_config(SCNetworkInterfaceRef vpn_interface, CFStringRef shared_secret_
         shared_secret_id
     };
     
-    CFDictionaryRef ipsec_config = CFDictionaryCreate(NULL, keys, values, 3, NULL, NULL);
+    CFDictionaryRef ipsec_config = CFDictionaryCreate(NULL, keys, values, 3, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    
+    /* The IPSec config only depends on the service ID, so it is almost
+     * always already what we want when editing */
+    CFDictionaryRef current_config = SCNetworkInterfaceGetExtendedConfiguration(vpn_interface, CFSTR("IPSec"));
+    if (current_config != NULL && CFEqual(current_config, ipsec_config)) {
+        CFRelease(ipsec_config);
+        return TRUE;
+    }
+    
+    uint64_t start_time = trace_begin();
     Boolean success = SCNetworkInterfaceSetExtendedConfiguration(vpn_interface, CFSTR("IPSec"), ipsec_config);
+    trace_end("set_ipsec_config", start_time);
     CFRelease(ipsec_config);
     
     if (!success) {
         print_scerror("Failed to set IPSec config");
     }
     
+    *changed = TRUE;
     return success;
 }
 
@@ -152,17 +186,16 @@ set_ipv4_config(SCNetworkServiceRef vpn_service, L2TPConfigRef config)
         goto exit;
     }
     
-    const void *keys[2] = {
-        kSCPropNetIPv4ConfigMethod,
-        kSCPropNetOverridePrimary
-    };
-    
-    const void *values[2] = {
-        kSCValNetIPv4ConfigMethodPPP,
-        send_all_traffic
-    };
+    CFDictionaryRef current_config = SCNetworkProtocolGetConfiguration(protocol);
+    CFMutableDictionaryRef ipv4_config;
+    if (current_config != NULL) {
+        ipv4_config = CFDictionaryCreateMutableCopy(NULL, 0, current_config);
+    } else {
+        ipv4_config = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    }
     
-    CFDictionaryRef ipv4_config = CFDictionaryCreate(NULL, keys, values, 2, NULL, NULL);
+    CFDictionarySetValue(ipv4_config, kSCPropNetIPv4ConfigMethod, kSCValNetIPv4ConfigMethodPPP);
+    CFDictionarySetValue(ipv4_config, kSCPropNetOverridePrimary, send_all_traffic);
     
     if (!SCNetworkProtocolSetConfiguration(protocol, ipv4_config)) {
         print_scerror("Failed to set IPv4 config");
@@ -173,6 +206,7 @@ set_ipv4_config(SCNetworkServiceRef vpn_service, L2TPConfigRef config)
     
 release_ipv4_config:
     CFRelease(ipv4_config);
+    CFRelease(protocol);
 exit:
     return success;
 }
@@ -191,109 +225,854 @@ configure_new_vpn_service(SCPreferencesRef preferences, SCNetworkServiceRef vpn_
         return FALSE;
     }
     
-    if (!SCNetworkSetAddService(current_services, vpn_service)) {
+    Boolean success = SCNetworkSetAddService(current_services, vpn_service);
+    CFRelease(current_services);
+    
+    if (!success) {
         print_scerror("Failed to add VPN service");
-        return FALSE;
     }
+    
+    return success;
+}
 
-    return TRUE;
+/* Returns the new value if it differs from the current one, or NULL if
+ * there is nothing to change. */
+CFTypeRef
+changed_value(CFTypeRef value, CFTypeRef current_value)
+{
+    if (value == NULL || (current_value != NULL && CFEqual(value, current_value))) {
+        return NULL;
+    }
+    return value;
+}
+
+CFTypeRef
+get_config_value(CFDictionaryRef config, CFStringRef key)
+{
+    return (config == NULL) ? NULL : CFDictionaryGetValue(config, key);
+}
+
+/* Fills in the SC fields of config that differ from the existing service's
+ * configuration. Fields that are already up to date are left NULL. Secrets
+ * are not touched, since they are compared before taking the lock. */
+void
+diff_vpn_config(SCNetworkServiceRef vpn_service, L2TPConfigRef config, L2TPConfig *changes)
+{
+    SCNetworkInterfaceRef vpn_interface = SCNetworkServiceGetInterface(vpn_service);
+    CFDictionaryRef ppp_config = (vpn_interface == NULL) ? NULL : SCNetworkInterfaceGetConfiguration(vpn_interface);
+    
+    CFDictionaryRef ipv4_config = NULL;
+    SCNetworkProtocolRef protocol = SCNetworkServiceCopyProtocol(vpn_service, kSCNetworkProtocolTypeIPv4);
+    if (protocol != NULL) {
+        ipv4_config = SCNetworkProtocolGetConfiguration(protocol);
+    }
+    
+    changes->service_name = changed_value(config->service_name, SCNetworkServiceGetName(vpn_service));
+    changes->server_address = changed_value(config->server_address, get_config_value(ppp_config, kSCPropNetPPPCommRemoteAddress));
+    changes->username = changed_value(config->username, get_config_value(ppp_config, kSCPropNetPPPAuthName));
+    changes->send_all_traffic = changed_value(config->send_all_traffic, get_config_value(ipv4_config, kSCPropNetOverridePrimary));
+    
+    if (protocol != NULL) {
+        CFRelease(protocol);
+    }
+}
+
+void
+remove_unchanged_vpn_secrets(CFStringRef service_id, L2TPConfig *config)
+{
+    if (config->password != NULL && keychain_password_matches(service_id, config->password)) {
+        config->password = NULL;
+    }
+    
+    if (config->shared_secret != NULL) {
+        CFStringRef shared_secret_id = create_shared_secret_id(service_id);
+        if (keychain_password_matches(shared_secret_id, config->shared_secret)) {
+            config->shared_secret = NULL;
+        }
+        CFRelease(shared_secret_id);
+    }
+}
+
+void
+copy_vpn_secrets(CFStringRef service_id, CFStringRef *password, CFStringRef *shared_secret)
+{
+    *password = copy_keychain_password(service_id);
+    
+    CFStringRef shared_secret_id = create_shared_secret_id(service_id);
+    *shared_secret = copy_keychain_password(shared_secret_id);
+    CFRelease(shared_secret_id);
+}
+
+typedef struct {
+    /* TRUE to delete the service, FALSE to create or edit it. */
+    Boolean is_delete;
+    
+    /* The service ID, or NULL for a service that hasn't been created yet. */
+    CFStringRef service_id;
+    
+    /* Where the caller wants the ID of a new service, or NULL. */
+    CFStringRef *service_id_out;
+    
+    /* The requested configuration. All strings are retained. */
+    L2TPConfig config;
+    
+    /* The configuration with secrets that already match the keychain
+     * removed, and after the SC phase, unchanged SC fields removed too. */
+    L2TPConfig changes;
+    
+    /* Whether the service was created by this transaction. */
+    Boolean is_new_service;
+} StagedOperation;
+
+struct VPNTransaction {
+    /* The preferences object that all changes are made in. */
+    SCPreferencesRef preferences;
+    
+    /* The operations to perform, in order. */
+    StagedOperation *operations;
+    CFIndex operation_count;
+    CFIndex operation_capacity;
+    
+    /* Whether the staged changes have been committed to the store. */
+    Boolean committed;
+};
+
+void
+retain_l2tp_config(L2TPConfig *config)
+{
+    const void *fields[6] = {
+        config->service_name, config->server_address, config->username,
+        config->password, config->shared_secret, config->send_all_traffic
+    };
+    
+    for (int i = 0; i < 6; ++i) {
+        if (fields[i] != NULL) {
+            CFRetain(fields[i]);
+        }
+    }
+}
+
+void
+release_l2tp_config(L2TPConfig *config)
+{
+    const void *fields[6] = {
+        config->service_name, config->server_address, config->username,
+        config->password, config->shared_secret, config->send_all_traffic
+    };
+    
+    for (int i = 0; i < 6; ++i) {
+        if (fields[i] != NULL) {
+            CFRelease(fields[i]);
+        }
+    }
+}
+
+SCPreferencesRef
+create_system_preferences(CFStringRef prefs_id)
+{
+    return SCPreferencesCreate(NULL, CFSTR("VPNHelper"), prefs_id);
+}
+
+void
+synchronize_system_preferences(SCPreferencesRef preferences)
+{
+    SCPreferencesSynchronize(preferences);
+}
+
+const PreferencesBackend system_preferences_backend = {
+    create_system_preferences,
+    SCPreferencesLock,
+    SCPreferencesUnlock,
+    SCPreferencesCommitChanges,
+    SCPreferencesApplyChanges,
+    synchronize_system_preferences
+};
+
+const PreferencesBackend *preferences_backend = &system_preferences_backend;
+
+CFStringRef preferences_id = NULL;
+
+/* Kept alive between transactions so that a long-running process only
+ * reads the preferences store again when another process changes it. */
+SCPreferencesRef cached_preferences = NULL;
+
+void
+set_vpn_preferences_id(CFStringRef prefs_id)
+{
+    if (preferences_id != NULL) {
+        CFRelease(preferences_id);
+    }
+    preferences_id = (prefs_id == NULL) ? NULL : CFRetain(prefs_id);
+    
+    if (cached_preferences != NULL) {
+        CFRelease(cached_preferences);
+        cached_preferences = NULL;
+    }
+}
+
+void
+set_preferences_backend(const PreferencesBackend *backend)
+{
+    if (cached_preferences != NULL) {
+        CFRelease(cached_preferences);
+        cached_preferences = NULL;
+    }
+    
+    preferences_backend = (backend == NULL) ? &system_preferences_backend : backend;
+}
+
+SCPreferencesRef
+copy_preferences(void)
+{
+    if (cached_preferences == NULL) {
+        cached_preferences = preferences_backend->create(preferences_id);
+        if (cached_preferences == NULL) {
+            print_scerror("Failed to create preferences object");
+            return NULL;
+        }
+    }
+    
+    return CFRetain(cached_preferences);
 }
 
 Boolean
-create_vpn(CFStringRef *service_id, L2TPConfigRef config)
+lock_preferences(SCPreferencesRef preferences)
 {
-    Boolean success = FALSE;
+    uint64_t start_time = trace_begin();
+    Boolean locked = preferences_backend->lock(preferences, TRUE);
     
-    SCPreferencesRef preferences = SCPreferencesCreate(NULL, CFSTR("VPNHelper"), NULL);
-    if (preferences == NULL) {
-        print_scerror("Failed to create preferences object");
-        goto exit;
+    /* Someone else committed since we last read the store; drop our
+     * cached copy and try again against the fresh contents. */
+    if (!locked && SCError() == kSCStatusStale) {
+        preferences_backend->synchronize(preferences);
+        locked = preferences_backend->lock(preferences, TRUE);
     }
     
-    if (!SCPreferencesLock(preferences, TRUE)) {
+    trace_end("lock_wait", start_time);
+    
+    if (!locked) {
         print_scerror("Failed to obtain preferences lock");
-        goto release_prefs;
     }
     
-    SCNetworkServiceRef vpn_service;
-    if (service_id != NULL && *service_id != NULL) {
-        vpn_service = copy_vpn_service(preferences, *service_id);
-    } else {
-        vpn_service = create_vpn_service(preferences);
+    return locked;
+}
+
+/* How many times, and for how long in total, transactions in this process
+ * have held the preferences lock. */
+unsigned int lock_hold_count = 0;
+uint64_t lock_hold_time = 0;
+
+void
+get_vpn_lock_stats(unsigned int *count, double *total_ms)
+{
+    *count = lock_hold_count;
+    *total_ms = mach_time_to_ms(lock_hold_time);
+}
+
+VPNTransactionRef
+begin_vpn_transaction(void)
+{
+    SCPreferencesRef preferences = copy_preferences();
+    if (preferences == NULL) {
+        return NULL;
     }
     
-    if (vpn_service == NULL) {
-        goto release_prefs;
+    VPNTransactionRef transaction = malloc(sizeof(*transaction));
+    transaction->preferences = preferences;
+    transaction->operations = NULL;
+    transaction->operation_count = 0;
+    transaction->operation_capacity = 0;
+    transaction->committed = FALSE;
+    return transaction;
+}
+
+StagedOperation *
+add_staged_operation(VPNTransactionRef transaction)
+{
+    if (transaction->operation_count == transaction->operation_capacity) {
+        transaction->operation_capacity = (transaction->operation_capacity == 0) ? 8 : transaction->operation_capacity * 2;
+        transaction->operations = realloc(transaction->operations, transaction->operation_capacity * sizeof(StagedOperation));
     }
     
-    if (!set_service_name(vpn_service, config)) {
-        goto release_service;
+    StagedOperation *operation = &transaction->operations[transaction->operation_count++];
+    memset(operation, 0, sizeof(*operation));
+    return operation;
+}
+
+Boolean
+create_vpn_in_transaction(VPNTransactionRef transaction, CFStringRef *service_id, L2TPConfigRef config)
+{
+    StagedOperation *operation = add_staged_operation(transaction);
+    operation->is_delete = FALSE;
+    operation->service_id = (service_id == NULL || *service_id == NULL) ? NULL : CFRetain(*service_id);
+    operation->service_id_out = service_id;
+    operation->config = *config;
+    retain_l2tp_config(&operation->config);
+    operation->changes = *config;
+    
+    /* Comparing secrets means reading the keychain, which is slow, so it
+     * happens now rather than while holding the preferences lock */
+    if (operation->service_id != NULL) {
+        remove_unchanged_vpn_secrets(operation->service_id, &operation->changes);
     }
     
-    SCNetworkInterfaceRef vpn_interface = SCNetworkServiceGetInterface(vpn_service);
-    if (vpn_interface == NULL) {
-        print_scerror("Failed to get VPN interface");
-        goto release_service;
+    return TRUE;
+}
+
+Boolean
+edit_vpn_in_transaction(VPNTransactionRef transaction, CFStringRef service_id, L2TPConfigRef config)
+{
+    CFStringRef edited_id = service_id;
+    Boolean staged = create_vpn_in_transaction(transaction, &edited_id, config);
+    
+    /* Nothing is written back for an existing service, so the caller
+     * needn't keep anywhere to write it */
+    transaction->operations[transaction->operation_count - 1].service_id_out = NULL;
+    return staged;
+}
+
+Boolean
+delete_vpn_in_transaction(VPNTransactionRef transaction, CFStringRef service_id)
+{
+    StagedOperation *operation = add_staged_operation(transaction);
+    operation->is_delete = TRUE;
+    operation->service_id = CFRetain(service_id);
+    return TRUE;
+}
+
+/* Applies a create or edit to the preferences. Must hold the lock. */
+Boolean
+apply_staged_create(SCPreferencesRef preferences, StagedOperation *operation, Boolean *dirty)
+{
+    Boolean success = FALSE;
+    
+    operation->is_new_service = (operation->service_id == NULL);
+    
+    SCNetworkServiceRef vpn_service;
+    if (!operation->is_new_service) {
+        vpn_service = copy_vpn_service(preferences, operation->service_id);
+    } else {
+        vpn_service = create_vpn_service(preferences);
     }
     
-    if (!set_ppp_config(vpn_interface, config)) {
-        goto release_service;
+    if (vpn_service == NULL) {
+        goto exit;
     }
     
-    CFStringRef vpn_service_id = (service_id == NULL) ? NULL : *service_id;
-    if (vpn_service_id == NULL) {
-        vpn_service_id = SCNetworkServiceGetServiceID(vpn_service);
+    if (operation->is_new_service) {
+        operation->service_id = CFRetain(SCNetworkServiceGetServiceID(vpn_service));
     }
+    CFStringRef vpn_shared_secret_id = create_shared_secret_id(operation->service_id);
     
-    CFStringRef vpn_shared_secret_id = create_shared_secret_id(vpn_service_id);
+    /* When editing, only touch what actually differs from what's stored */
+    L2TPConfig *changes = &operation->changes;
+    if (!operation->is_new_service) {
+        diff_vpn_config(vpn_service, &operation->config, changes);
+    }
     
-    if (!set_ipsec_config(vpn_interface, vpn_shared_secret_id)) {
+    Boolean changed = operation->is_new_service ||
+        changes->service_name != NULL ||
+        changes->server_address != NULL ||
+        changes->username != NULL ||
+        changes->send_all_traffic != NULL;
+    
+    if (!set_service_name(vpn_service, changes)) {
         goto release_shared_secret_id;
     }
     
-    if (!configure_new_vpn_service(preferences, vpn_service)) {
+    SCNetworkInterfaceRef vpn_interface = SCNetworkServiceGetInterface(vpn_service);
+    if (vpn_interface == NULL) {
+        print_scerror("Failed to get VPN interface");
         goto release_shared_secret_id;
     }
     
-    if (!set_ipv4_config(vpn_service, config)) {
+    if (!set_ppp_config(vpn_interface, changes)) {
         goto release_shared_secret_id;
     }
     
-    if (!configure_keychain(config, vpn_service_id, vpn_shared_secret_id)) {
+    if (!set_ipsec_config(vpn_interface, vpn_shared_secret_id, &changed)) {
         goto release_shared_secret_id;
     }
     
-    if (!SCPreferencesCommitChanges(preferences)) {
-        print_scerror("Failed to commit changes");
+    if (operation->is_new_service && !configure_new_vpn_service(preferences, vpn_service)) {
         goto release_shared_secret_id;
     }
     
-    if (!SCPreferencesApplyChanges(preferences)) {
-        print_scerror("Failed to apply changes");
+    if (!set_ipv4_config(vpn_service, changes)) {
         goto release_shared_secret_id;
     }
     
-    if (service_id != NULL && *service_id == NULL) {
-        *service_id = CFRetain(vpn_service_id);
+    if (changed) {
+        *dirty = TRUE;
     }
     success = TRUE;
     
 release_shared_secret_id:
     CFRelease(vpn_shared_secret_id);
-release_service:
     CFRelease(vpn_service);
-unlock_prefs:
-    assert(SCPreferencesUnlock(preferences));
-release_prefs:
-    CFRelease(preferences);
 exit:
     return success;
 }
 
+/* Applies a delete to the preferences. Must hold the lock. */
 Boolean
-delete_vpn(CFStringRef service_id)
+apply_staged_delete(SCPreferencesRef preferences, StagedOperation *operation, Boolean *dirty)
+{
+    SCNetworkServiceRef vpn_service = copy_vpn_service(preferences, operation->service_id);
+    if (vpn_service == NULL) {
+        return FALSE;
+    }
+    
+    Boolean success = SCNetworkServiceRemove(vpn_service);
+    CFRelease(vpn_service);
+    
+    if (!success) {
+        print_scerror("Failed to remove VPN service");
+        return FALSE;
+    }
+    
+    *dirty = TRUE;
+    return TRUE;
+}
+
+/* Writes or deletes the keychain items of a committed operation. */
+Boolean
+apply_staged_keychain_changes(StagedOperation *operation)
 {
-    // TODO: Add something here!
+    CFStringRef shared_secret_id = create_shared_secret_id(operation->service_id);
+    Boolean success;
+    
+    if (operation->is_delete) {
+        /* Secrets of deleted services are only useless once the deletion
+         * is on disk, so they aren't removed any earlier */
+        success = delete_keychain_items(operation->service_id, shared_secret_id);
+    } else {
+        /* Only items with a changed label, account or secret are touched.
+         * They are modified in place with the fields we were given, created
+         * if missing, and keep their data when no new secret was given */
+        L2TPConfig *changes = &operation->changes;
+        KeychainItems keychain_items = 0;
+        if (changes->service_name != NULL || changes->username != NULL || changes->password != NULL) {
+            keychain_items |= KeychainItemVPNPassword;
+        }
+        if (changes->service_name != NULL || changes->shared_secret != NULL) {
+            keychain_items |= KeychainItemSharedSecret;
+        }
+        
+        uint64_t start_time = trace_begin();
+        success = configure_keychain(&operation->config, operation->service_id, shared_secret_id, keychain_items);
+        trace_end("configure_keychain", start_time);
+    }
+    
+    CFRelease(shared_secret_id);
+    return success;
+}
+
+/* Removes services that were created by a transaction whose keychain items
+ * could not all be written, along with whatever items they did get, so they
+ * don't linger without credentials. Edits and deletes made by the same
+ * transaction stay committed. */
+void
+roll_back_new_services(VPNTransactionRef transaction)
+{
+    SCPreferencesRef preferences = transaction->preferences;
+    
+    Boolean has_new_services = FALSE;
+    for (CFIndex i = 0; i < transaction->operation_count; ++i) {
+        if (transaction->operations[i].is_new_service) {
+            has_new_services = TRUE;
+        }
+    }
+    
+    if (!has_new_services || !lock_preferences(preferences)) {
+        return;
+    }
+    
+    Boolean dirty = FALSE;
+    for (CFIndex i = 0; i < transaction->operation_count; ++i) {
+        StagedOperation *operation = &transaction->operations[i];
+        if (operation->is_new_service) {
+            apply_staged_delete(preferences, operation, &dirty);
+        }
+    }
+    
+    Boolean rolled_back = dirty && preferences_backend->commit(preferences);
+    if (dirty && !rolled_back) {
+        print_scerror("Failed to roll back new VPN services");
+    }
+    
+    preferences_backend->unlock(preferences);
+    preferences_backend->synchronize(preferences);
+    
+    if (!rolled_back) {
+        return;
+    }
+    
+    preferences_backend->apply(preferences);
+    
+    for (CFIndex i = 0; i < transaction->operation_count; ++i) {
+        StagedOperation *operation = &transaction->operations[i];
+        if (operation->is_new_service) {
+            CFStringRef shared_secret_id = create_shared_secret_id(operation->service_id);
+            delete_keychain_items(operation->service_id, shared_secret_id);
+            CFRelease(shared_secret_id);
+        }
+    }
+}
+
+Boolean
+commit_vpn_transaction(VPNTransactionRef transaction)
+{
+    SCPreferencesRef preferences = transaction->preferences;
+    
+    /* Find out whether the keychain is usable before anything is committed,
+     * since its items are only written once the lock has been released.
+     * Opening it is slow, so only do so if some operation will need it;
+     * edits that only touch the address or routing never do. */
+    Boolean needs_keychain = FALSE;
+    Boolean needs_access = FALSE;
+    for (CFIndex i = 0; i < transaction->operation_count; ++i) {
+        StagedOperation *operation = &transaction->operations[i];
+        L2TPConfig *changes = &operation->changes;
+        if (operation->is_delete) {
+            needs_keychain = TRUE;
+        } else if (operation->service_id == NULL ||
+                   changes->service_name != NULL ||
+                   changes->username != NULL ||
+                   changes->password != NULL ||
+                   changes->shared_secret != NULL) {
+            needs_keychain = TRUE;
+            needs_access = TRUE;
+        }
+    }
     
+    if (needs_keychain && !prepare_keychain(needs_access)) {
+        return FALSE;
+    }
+    
+    if (!lock_preferences(preferences)) {
+        return FALSE;
+    }
+    
+    uint64_t lock_time = mach_absolute_time();
+    Boolean dirty = FALSE;
+    
+    for (CFIndex i = 0; i < transaction->operation_count; ++i) {
+        StagedOperation *operation = &transaction->operations[i];
+        
+        Boolean success;
+        if (operation->is_delete) {
+            success = apply_staged_delete(preferences, operation, &dirty);
+        } else {
+            success = apply_staged_create(preferences, operation, &dirty);
+        }
+        
+        if (!success) {
+            fprintf(stderr, "Failed to apply operation %ld\n", i);
+            goto discard_changes;
+        }
+    }
+    
+    /* Nothing to do, so don't make configd reconfigure the network */
+    if (dirty) {
+        uint64_t start_time = trace_begin();
+        Boolean committed = preferences_backend->commit(preferences);
+        trace_end("commit", start_time);
+        
+        if (!committed) {
+            print_scerror("Failed to commit changes");
+            goto discard_changes;
+        }
+        transaction->committed = TRUE;
+    }
+    
+    assert(preferences_backend->unlock(preferences));
+    
+    uint64_t unlock_time = mach_absolute_time();
+    record_trace_span("lock_hold", lock_time, unlock_time);
+    lock_hold_count++;
+    lock_hold_time += unlock_time - lock_time;
+    
+    if (dirty) {
+        uint64_t start_time = trace_begin();
+        Boolean applied = preferences_backend->apply(preferences);
+        trace_end("apply", start_time);
+        
+        /* The store is already committed, and configd picks it up on its
+         * own eventually, so carry on and write the keychain items */
+        if (!applied) {
+            print_scerror("Failed to apply changes");
+        }
+    }
+    
+    Boolean success = TRUE;
+    for (CFIndex i = 0; i < transaction->operation_count; ++i) {
+        if (!apply_staged_keychain_changes(&transaction->operations[i])) {
+            success = FALSE;
+            break;
+        }
+    }
+    
+    if (!success) {
+        roll_back_new_services(transaction);
+        return FALSE;
+    }
+    
+    for (CFIndex i = 0; i < transaction->operation_count; ++i) {
+        StagedOperation *operation = &transaction->operations[i];
+        if (operation->is_new_service && operation->service_id_out != NULL) {
+            *operation->service_id_out = CFRetain(operation->service_id);
+        }
+    }
+    
+    return TRUE;
+    
+discard_changes:
+    assert(preferences_backend->unlock(preferences));
+    
+    /* The preferences object outlives the transaction, so throw away
+     * anything that was changed but never committed */
+    preferences_backend->synchronize(preferences);
     return FALSE;
 }
+
+Boolean
+is_vpn_transaction_committed(VPNTransactionRef transaction)
+{
+    return transaction->committed;
+}
+
+void
+end_vpn_transaction(VPNTransactionRef transaction)
+{
+    for (CFIndex i = 0; i < transaction->operation_count; ++i) {
+        StagedOperation *operation = &transaction->operations[i];
+        if (operation->service_id != NULL) {
+            CFRelease(operation->service_id);
+        }
+        if (!operation->is_delete) {
+            release_l2tp_config(&operation->config);
+        }
+    }
+    
+    free(transaction->operations);
+    CFRelease(transaction->preferences);
+    free(transaction);
+}
+
+Boolean
+create_vpn(CFStringRef *service_id, L2TPConfigRef config)
+{
+    Boolean success = FALSE;
+    
+    VPNTransactionRef transaction = begin_vpn_transaction();
+    if (transaction == NULL) {
+        goto exit;
+    }
+    
+    if (!create_vpn_in_transaction(transaction, service_id, config)) {
+        goto end_transaction;
+    }
+    
+    success = commit_vpn_transaction(transaction);
+    
+end_transaction:
+    end_vpn_transaction(transaction);
+exit:
+    return success;
+}
+
+Boolean
+delete_vpns(CFArrayRef service_ids)
+{
+    Boolean success = FALSE;
+    
+    VPNTransactionRef transaction = begin_vpn_transaction();
+    if (transaction == NULL) {
+        goto exit;
+    }
+    
+    for (CFIndex i = 0; i < CFArrayGetCount(service_ids); ++i) {
+        if (!delete_vpn_in_transaction(transaction, CFArrayGetValueAtIndex(service_ids, i))) {
+            goto end_transaction;
+        }
+    }
+    
+    success = commit_vpn_transaction(transaction);
+    
+end_transaction:
+    end_vpn_transaction(transaction);
+exit:
+    return success;
+}
+
+Boolean
+delete_vpn(CFStringRef service_id)
+{
+    CFArrayRef service_ids = CFArrayCreate(NULL, (const void **)&service_id, 1, &kCFTypeArrayCallBacks);
+    Boolean success = delete_vpns(service_ids);
+    CFRelease(service_ids);
+    return success;
+}
+
+Boolean
+is_l2tp_service(SCNetworkServiceRef service)
+{
+    SCNetworkInterfaceRef interface = SCNetworkServiceGetInterface(service);
+    if (interface == NULL || !CFEqual(SCNetworkInterfaceGetInterfaceType(interface), kSCNetworkInterfaceTypePPP)) {
+        return FALSE;
+    }
+    
+    SCNetworkInterfaceRef lower_interface = SCNetworkInterfaceGetInterface(interface);
+    return lower_interface != NULL && CFEqual(SCNetworkInterfaceGetInterfaceType(lower_interface), kSCNetworkInterfaceTypeL2TP);
+}
+
+CFDictionaryRef
+create_vpn_description(SCNetworkServiceRef service)
+{
+    CFMutableDictionaryRef description = CFDictionaryCreateMutable(
+        NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+    );
+    
+    CFDictionarySetValue(description, CFSTR("id"), SCNetworkServiceGetServiceID(service));
+    
+    CFStringRef service_name = SCNetworkServiceGetName(service);
+    if (service_name != NULL) {
+        CFDictionarySetValue(description, CFSTR("name"), service_name);
+    }
+    
+    CFDictionaryRef ppp_config = SCNetworkInterfaceGetConfiguration(SCNetworkServiceGetInterface(service));
+    CFTypeRef server_address = get_config_value(ppp_config, kSCPropNetPPPCommRemoteAddress);
+    if (server_address != NULL) {
+        CFDictionarySetValue(description, CFSTR("address"), server_address);
+    }
+    
+    CFTypeRef username = get_config_value(ppp_config, kSCPropNetPPPAuthName);
+    if (username != NULL) {
+        CFDictionarySetValue(description, CFSTR("username"), username);
+    }
+    
+    CFTypeRef send_all_traffic = kCFBooleanFalse;
+    SCNetworkProtocolRef protocol = SCNetworkServiceCopyProtocol(service, kSCNetworkProtocolTypeIPv4);
+    if (protocol != NULL) {
+        CFTypeRef override_primary = get_config_value(SCNetworkProtocolGetConfiguration(protocol), kSCPropNetOverridePrimary);
+        if (override_primary != NULL) {
+            send_all_traffic = override_primary;
+        }
+    }
+    CFDictionarySetValue(description, CFSTR("send_all_traffic"), send_all_traffic);
+    if (protocol != NULL) {
+        CFRelease(protocol);
+    }
+    
+    return description;
+}
+
+CFArrayRef
+copy_vpn_list(void)
+{
+    SCPreferencesRef preferences = copy_preferences();
+    if (preferences == NULL) {
+        return NULL;
+    }
+    
+    /* We don't hold the lock, so make sure we aren't looking at an old copy */
+    preferences_backend->synchronize(preferences);
+    
+    CFMutableArrayRef vpn_list = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    
+    CFArrayRef services = SCNetworkServiceCopyAll(preferences);
+    if (services != NULL) {
+        for (CFIndex i = 0; i < CFArrayGetCount(services); ++i) {
+            SCNetworkServiceRef service = CFArrayGetValueAtIndex(services, i);
+            if (!is_l2tp_service(service)) {
+                continue;
+            }
+            
+            CFDictionaryRef description = create_vpn_description(service);
+            CFArrayAppendValue(vpn_list, description);
+            CFRelease(description);
+        }
+        CFRelease(services);
+    }
+    
+    CFRelease(preferences);
+    return vpn_list;
+}
+
+CFDictionaryRef
+copy_network_service_sizes(void)
+{
+    SCPreferencesRef preferences = copy_preferences();
+    if (preferences == NULL) {
+        return NULL;
+    }
+    
+    preferences_backend->synchronize(preferences);
+    
+    CFMutableDictionaryRef sizes = CFDictionaryCreateMutable(
+        NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+    );
+    
+    CFDictionaryRef services = SCPreferencesGetValue(preferences, kSCPrefNetworkServices);
+    if (services != NULL && CFGetTypeID(services) == CFDictionaryGetTypeID()) {
+        CFIndex count = CFDictionaryGetCount(services);
+        const void **keys = malloc((count + 1) * sizeof(void *));
+        const void **values = malloc((count + 1) * sizeof(void *));
+        CFDictionaryGetKeysAndValues(services, keys, values);
+        
+        /* The store is written as XML, so that is what each service costs */
+        for (CFIndex i = 0; i < count; ++i) {
+            CFDataRef data = CFPropertyListCreateData(NULL, values[i], kCFPropertyListXMLFormat_v1_0, 0, NULL);
+            CFIndex size = (data != NULL) ? CFDataGetLength(data) : 0;
+            CFNumberRef size_number = CFNumberCreate(NULL, kCFNumberCFIndexType, &size);
+            CFDictionarySetValue(sizes, keys[i], size_number);
+            CFRelease(size_number);
+            if (data != NULL) {
+                CFRelease(data);
+            }
+        }
+        
+        free(values);
+        free(keys);
+    }
+    
+    CFRelease(preferences);
+    return sizes;
+}
+
+CFDataRef
+copy_vpn_preferences_signature(void)
+{
+    char path[PATH_MAX];
+    
+    if (preferences_id == NULL) {
+        strlcpy(path, SYSTEM_PREFERENCES_PATH, sizeof(path));
+    } else {
+        char id_path[PATH_MAX];
+        if (!CFStringGetFileSystemRepresentation(preferences_id, id_path, sizeof(id_path))) {
+            return NULL;
+        }
+        
+        if (id_path[0] == '/') {
+            strlcpy(path, id_path, sizeof(path));
+        } else {
+            snprintf(path, sizeof(path), "%s/%s", SYSTEM_PREFERENCES_DIRECTORY, id_path);
+        }
+    }
+    
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return NULL;
+    }
+    
+    /* The same fields SCPreferencesGetSignature() uses, plus the path so
+     * that different stores never share a signature */
+    CFMutableDataRef signature = CFDataCreateMutable(NULL, 0);
+    CFDataAppendBytes(signature, (const UInt8 *)&st.st_dev, sizeof(st.st_dev));
+    CFDataAppendBytes(signature, (const UInt8 *)&st.st_ino, sizeof(st.st_ino));
+    CFDataAppendBytes(signature, (const UInt8 *)&st.st_mtimespec, sizeof(st.st_mtimespec));
+    CFDataAppendBytes(signature, (const UInt8 *)&st.st_size, sizeof(st.st_size));
+    CFDataAppendBytes(signature, (const UInt8 *)path, (CFIndex)strlen(path));
+    return signature;
+}
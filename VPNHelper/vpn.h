@@ -2,6 +2,7 @@
 #define VPNHELPER_VPN_H
 
 #include <CoreFoundation/CoreFoundation.h>
+#include <SystemConfiguration/SystemConfiguration.h>
 
 typedef struct {
     /* The name of the VPN connection. */
@@ -25,6 +26,108 @@ typedef struct {
 
 typedef const L2TPConfig *L2TPConfigRef;
 
+typedef struct VPNTransaction *VPNTransactionRef;
+
+/* Releases every field of a configuration that isn't NULL.
+ * @param config The configuration to release.
+ */
+void release_l2tp_config(L2TPConfig *config);
+
+/* Selects the preferences store used by subsequent operations.
+ * @param prefs_id The path of a preferences file to operate on instead of
+ *     the system network configuration, or NULL to use the system store.
+ *     A file path is useful for trying out a manifest without touching
+ *     the live configuration.
+ */
+void set_vpn_preferences_id(CFStringRef prefs_id);
+
+/* The SCPreferences calls that open, lock, commit and apply the preferences
+ * store, so that a benchmark can stand in for configd. Each behaves like
+ * the call it replaces. */
+typedef struct {
+    /* Opens the store with a preferences ID, which may be NULL. */
+    SCPreferencesRef (*create)(CFStringRef prefs_id);
+    
+    /* Takes the lock on the store, waiting for it if wait is TRUE. */
+    Boolean (*lock)(SCPreferencesRef preferences, Boolean wait);
+    
+    /* Releases the lock on the store. */
+    Boolean (*unlock)(SCPreferencesRef preferences);
+    
+    /* Writes the changes made to the store. */
+    Boolean (*commit)(SCPreferencesRef preferences);
+    
+    /* Asks configd to reconfigure the network from the committed store. */
+    Boolean (*apply)(SCPreferencesRef preferences);
+    
+    /* Throws away the cached contents of the store. */
+    void (*synchronize)(SCPreferencesRef preferences);
+} PreferencesBackend;
+
+/* Replaces the calls used to open, lock, commit and apply the preferences
+ * store. The preferences object kept between transactions is released.
+ * @param backend The calls to use, or NULL to go back to SCPreferences.
+ *     It must outlive every later call.
+ */
+void set_preferences_backend(const PreferencesBackend *backend);
+
+/* Opens the preferences store. All operations made in the transaction are
+ * committed and applied together, so that configd only has to reconfigure
+ * the network stack once. The preferences object is reused by later
+ * transactions in the same process, and is only reloaded once another
+ * process has committed changes to the store.
+ * @result The transaction, or NULL if the preferences could not be opened.
+ */
+VPNTransactionRef begin_vpn_transaction(void);
+
+/* Stages the creation or modification of a VPN connection in a transaction.
+ * Takes the same arguments as create_vpn(), except that the service ID of
+ * a new connection is only filled in once the transaction is committed.
+ * Secrets are compared against the keychain here, before any lock is taken.
+ * The config strings are retained, so the caller may release them.
+ * @result TRUE if the operation is successful; FALSE otherwise.
+ */
+Boolean create_vpn_in_transaction(VPNTransactionRef transaction, CFStringRef *service_id, L2TPConfigRef config);
+
+/* Stages the modification of an existing VPN connection in a transaction,
+ * like create_vpn_in_transaction() with a service ID.
+ * @param service_id The service ID of the VPN connection.
+ * @param config The settings to change.
+ * @result TRUE if the operation is successful; FALSE otherwise.
+ */
+Boolean edit_vpn_in_transaction(VPNTransactionRef transaction, CFStringRef service_id, L2TPConfigRef config);
+
+/* Stages the deletion of a VPN connection in a transaction. Its keychain
+ * items are deleted once the transaction has been committed.
+ * @param service_id The service ID of the VPN connection.
+ * @result TRUE if the operation is successful; FALSE otherwise.
+ */
+Boolean delete_vpn_in_transaction(VPNTransactionRef transaction, CFStringRef service_id);
+
+/* Commits and applies all changes staged in a transaction. The preferences
+ * lock is only held while the staged changes are made and committed;
+ * keychain items are written once it has been released. If they can't be,
+ * any connections the transaction created are removed again, along with
+ * their keychain items. Only new connections are rolled back: edits and
+ * deletes in the same transaction stay committed. Failing to apply the
+ * committed changes is reported but not treated as a failure.
+ * @result TRUE if the operation is successful; FALSE otherwise.
+ */
+Boolean commit_vpn_transaction(VPNTransactionRef transaction);
+
+/* Finds out whether a transaction got as far as committing the preferences
+ * store. A failed transaction that was not committed changed nothing but
+ * possibly keychain items of edited connections, so its operations can be
+ * retried; one that was committed may have left some of them in place.
+ * @result TRUE if commit_vpn_transaction() committed the store; FALSE
+ *     otherwise.
+ */
+Boolean is_vpn_transaction_committed(VPNTransactionRef transaction);
+
+/* Frees the transaction. Any changes that were not committed are discarded.
+ */
+void end_vpn_transaction(VPNTransactionRef transaction);
+
 /* Creates a new VPN connection, or modifies an existing one.
  * @param service_id A pointer to a string containing the service ID of the
  *     VPN connection. If this or the value it points to is NULL, a new
@@ -34,7 +137,8 @@ typedef const L2TPConfig *L2TPConfigRef;
  *     connection with the specified service ID.
  * @param config The VPN connection configuration. If creating a new connection, 
  *     all members must have values; otherwise, only those with values will 
- *     be updated.
+ *     be updated. Values that match the existing configuration are skipped,
+ *     and if nothing changes, nothing is committed.
  * @result TRUE if the operation is successful; FALSE otherwise.
  */
 Boolean create_vpn(CFStringRef *service_id, L2TPConfigRef config);
@@ -45,4 +149,62 @@ Boolean create_vpn(CFStringRef *service_id, L2TPConfigRef config);
  */
 Boolean delete_vpn(CFStringRef service_id);
 
+/* Deletes several existing VPN connections in a single transaction. If any
+ * of them can't be deleted, none of them are.
+ * @param service_ids The service IDs of the VPN connections.
+ * @result TRUE if the operation is successful; FALSE otherwise.
+ */
+Boolean delete_vpns(CFArrayRef service_ids);
+
+/* Clears the password and shared secret of a configuration if the keychain
+ * already holds the same values for a VPN connection.
+ * @param service_id The service ID of the VPN connection.
+ * @param config The configuration to update.
+ */
+void remove_unchanged_vpn_secrets(CFStringRef service_id, L2TPConfig *config);
+
+/* Reads the password and shared secret of a VPN connection from the
+ * system keychain.
+ * @param service_id The service ID of the VPN connection.
+ * @param password Receives the password, or NULL if there is none.
+ * @param shared_secret Receives the shared secret, or NULL if there is none.
+ *     The caller is responsible for releasing both.
+ */
+void copy_vpn_secrets(CFStringRef service_id, CFStringRef *password, CFStringRef *shared_secret);
+
+/* Gets the number of times transactions in this process have held the
+ * preferences lock, and the total time it was held for.
+ * @param count Receives the number of times the lock was held.
+ * @param total_ms Receives the total time it was held, in milliseconds.
+ */
+void get_vpn_lock_stats(unsigned int *count, double *total_ms);
+
+/* Describes every L2TP VPN connection in the preferences store.
+ * @result An array of dictionaries with the keys "id", "name", "address",
+ *     "username" and "send_all_traffic", or NULL if the preferences could
+ *     not be read. The caller is responsible for releasing it.
+ */
+CFArrayRef copy_vpn_list(void);
+
+/* Measures every network service in the preferences store, of any type.
+ * @result A dictionary mapping each service ID to the number of bytes its
+ *     configuration takes up in the store, or NULL if the preferences could
+ *     not be read. The caller is responsible for releasing it.
+ */
+CFDictionaryRef copy_network_service_sizes(void);
+
+/* Finds the VPN connection a keychain item belongs to, from the item's
+ * service name, which is either the service ID or the shared secret ID.
+ * @param keychain_service The service name of the keychain item.
+ * @result The service ID. The caller is responsible for releasing it.
+ */
+CFStringRef create_service_id_for_keychain_service(CFStringRef keychain_service);
+
+/* Gets a value that changes whenever the preferences store is modified,
+ * without reading the store itself.
+ * @result The signature, or NULL if the store doesn't exist. The caller is
+ *     responsible for releasing it.
+ */
+CFDataRef copy_vpn_preferences_signature(void);
+
 #endif
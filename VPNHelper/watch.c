@@ -0,0 +1,164 @@
+#include "watch.h"
+#include "connection.h"
+#include "json.h"
+#include <sys/time.h>
+#include <time.h>
+
+typedef struct {
+    FILE *output;
+    
+    /* The last status reported for each service ID. */
+    CFMutableDictionaryRef statuses;
+} WatchState;
+
+typedef struct {
+    CFStringRef service_id;
+    SCNetworkConnectionRef connection;
+    ConnectionEventCallback callback;
+    void *info;
+} ConnectionWatch;
+
+CFStringRef
+get_connection_status_name(SCNetworkConnectionStatus status)
+{
+    switch (status) {
+        case kSCNetworkConnectionDisconnected:
+            return CFSTR("disconnected");
+        case kSCNetworkConnectionConnecting:
+            return CFSTR("connecting");
+        case kSCNetworkConnectionConnected:
+            return CFSTR("connected");
+        case kSCNetworkConnectionDisconnecting:
+            return CFSTR("disconnecting");
+        case kSCNetworkConnectionInvalid:
+        default:
+            return CFSTR("invalid");
+    }
+}
+
+CFStringRef
+create_timestamp(void)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    
+    struct tm utc;
+    gmtime_r(&now.tv_sec, &utc);
+    
+    char buffer[32];
+    size_t length = strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(buffer + length, sizeof(buffer) - length, ".%03dZ", (int)(now.tv_usec / 1000));
+    return CFStringCreateWithCString(NULL, buffer, kCFStringEncodingUTF8);
+}
+
+void
+connection_event_received(CFStringRef service_id, SCNetworkConnectionStatus status, int last_cause, void *info)
+{
+    WatchState *state = info;
+    
+    /* Notifications can repeat a status, which isn't a transition */
+    CFNumberRef previous = CFDictionaryGetValue(state->statuses, service_id);
+    SCNetworkConnectionStatus previous_status = kSCNetworkConnectionInvalid;
+    if (previous != NULL) {
+        CFNumberGetValue(previous, kCFNumberIntType, &previous_status);
+        if (previous_status == status) {
+            return;
+        }
+    }
+    
+    int raw_status = status;
+    CFNumberRef current = CFNumberCreate(NULL, kCFNumberIntType, &raw_status);
+    CFDictionarySetValue(state->statuses, service_id, current);
+    CFRelease(current);
+    
+    CFMutableDictionaryRef event = CFDictionaryCreateMutable(
+        NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+    );
+    
+    CFStringRef timestamp = create_timestamp();
+    CFNumberRef cause = CFNumberCreate(NULL, kCFNumberIntType, &last_cause);
+    CFDictionarySetValue(event, CFSTR("time"), timestamp);
+    CFDictionarySetValue(event, CFSTR("id"), service_id);
+    CFDictionarySetValue(event, CFSTR("state"), get_connection_status_name(status));
+    CFDictionarySetValue(event, CFSTR("last_cause"), cause);
+    if (previous != NULL) {
+        CFDictionarySetValue(event, CFSTR("previous"), get_connection_status_name(previous_status));
+    }
+    
+    write_json_value(state->output, event);
+    fputc('\n', state->output);
+    fflush(state->output);
+    
+    CFRelease(cause);
+    CFRelease(timestamp);
+    CFRelease(event);
+}
+
+void
+connection_watch_status_changed(SCNetworkConnectionRef connection, SCNetworkConnectionStatus status, void *info)
+{
+    ConnectionWatch *watch = info;
+    int last_cause = (status == kSCNetworkConnectionDisconnected) ? get_connection_last_cause(connection) : 0;
+    watch->callback(watch->service_id, status, last_cause, watch->info);
+}
+
+/* Runs on the event queue, so the initial status is never reported after
+ * a change that followed it. */
+void
+report_initial_connection_status(void *info)
+{
+    ConnectionWatch *watch = info;
+    connection_watch_status_changed(watch->connection, SCNetworkConnectionGetStatus(watch->connection), watch);
+}
+
+Boolean
+watch_connection_events(CFArrayRef service_ids, dispatch_queue_t queue, ConnectionEventCallback callback, void *info)
+{
+    for (CFIndex i = 0; i < CFArrayGetCount(service_ids); ++i) {
+        /* Watches last until the process exits, so they are never freed */
+        ConnectionWatch *watch = calloc(1, sizeof(ConnectionWatch));
+        watch->service_id = CFRetain(CFArrayGetValueAtIndex(service_ids, i));
+        watch->callback = callback;
+        watch->info = info;
+        
+        SCNetworkConnectionContext context = {0, watch, NULL, NULL, NULL};
+        watch->connection = SCNetworkConnectionCreateWithServiceID(NULL, watch->service_id, connection_watch_status_changed, &context);
+        if (watch->connection == NULL) {
+            fprintf(stderr, "Failed to create connection: %s (%d)\n", SCErrorString(SCError()), SCError());
+            return FALSE;
+        }
+        
+        if (!SCNetworkConnectionSetDispatchQueue(watch->connection, queue)) {
+            fprintf(stderr, "Failed to watch connection: %s (%d)\n", SCErrorString(SCError()), SCError());
+            return FALSE;
+        }
+        
+        dispatch_async_f(queue, watch, report_initial_connection_status);
+    }
+    
+    return TRUE;
+}
+
+Boolean
+start_watch(CFArrayRef service_ids, ConnectionEventSource source, FILE *output, dispatch_queue_t queue)
+{
+    /* The state lives as long as the events keep coming, so it is never freed */
+    WatchState *state = malloc(sizeof(WatchState));
+    state->output = output;
+    state->statuses = CFDictionaryCreateMutable(
+        NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+    );
+    
+    return source(service_ids, queue, connection_event_received, state);
+}
+
+int
+run_watch(CFArrayRef service_ids, ConnectionEventSource source, FILE *output)
+{
+    dispatch_queue_t queue = dispatch_queue_create("VPNHelper.watch", DISPATCH_QUEUE_SERIAL);
+    if (!start_watch(service_ids, source, output, queue)) {
+        return 1;
+    }
+    
+    dispatch_main();
+}
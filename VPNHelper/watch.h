@@ -0,0 +1,58 @@
+#ifndef VPNHELPER_WATCH_H
+#define VPNHELPER_WATCH_H
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <SystemConfiguration/SystemConfiguration.h>
+#include <dispatch/dispatch.h>
+#include <stdio.h>
+
+/* Receives the status of a watched VPN connection, once when watching
+ * starts and again every time it changes.
+ * @param service_id The service ID of the VPN connection.
+ * @param status The new status.
+ * @param last_cause The PPP last cause code if the connection went down,
+ *     or 0.
+ * @param info The pointer given to the event source.
+ */
+typedef void (*ConnectionEventCallback)(CFStringRef service_id, SCNetworkConnectionStatus status, int last_cause, void *info);
+
+/* Starts delivering status events for VPN connections. Watching continues
+ * until the process exits. run_watch() only learns about connections through
+ * a source, so a scripted one can stand in for SystemConfiguration.
+ * @param service_ids The service IDs of the VPN connections.
+ * @param queue The serial queue to deliver events on.
+ * @param callback The function to call for each event.
+ * @param info A pointer to pass to the callback.
+ * @result TRUE if every connection is being watched; FALSE otherwise.
+ */
+typedef Boolean (*ConnectionEventSource)(CFArrayRef service_ids, dispatch_queue_t queue, ConnectionEventCallback callback, void *info);
+
+/* The event source backed by SCNetworkConnection status notifications,
+ * which cost nothing while the connections are idle.
+ */
+Boolean watch_connection_events(CFArrayRef service_ids, dispatch_queue_t queue, ConnectionEventCallback callback, void *info);
+
+/* Starts printing the state transitions of VPN connections, in the format
+ * described for run_watch(), and returns without waiting for any.
+ * @param service_ids The service IDs of the VPN connections.
+ * @param source Where the status events come from.
+ * @param output The file to write transitions to.
+ * @param queue The serial queue that events are handled on. Transitions
+ *     have been written once the queue has drained.
+ * @result TRUE if every connection is being watched; FALSE otherwise.
+ */
+Boolean start_watch(CFArrayRef service_ids, ConnectionEventSource source, FILE *output, dispatch_queue_t queue);
+
+/* Prints the state transitions of VPN connections as they happen, one JSON
+ * object per line of the form {"time": ..., "id": ..., "state": ...,
+ * "previous": ..., "last_cause": ...}. The time is in ISO 8601 format with
+ * milliseconds, and the first line for each connection has no "previous".
+ * Does not return unless the connections could not be watched.
+ * @param service_ids The service IDs of the VPN connections.
+ * @param source Where the status events come from.
+ * @param output The file to write transitions to.
+ * @result Nonzero on failure.
+ */
+int run_watch(CFArrayRef service_ids, ConnectionEventSource source, FILE *output);
+
+#endif
@@ -0,0 +1,46 @@
+#include "bench_preferences.h"
+#include <unistd.h>
+
+BenchPreferences bench_preferences = {0};
+
+SCPreferencesRef
+create_bench_preferences(CFStringRef prefs_id)
+{
+    return SCPreferencesCreate(NULL, CFSTR("VPNHelperBench"), prefs_id);
+}
+
+Boolean
+lock_bench_preferences(SCPreferencesRef preferences, Boolean wait)
+{
+    usleep(bench_preferences.lock_latency);
+    return SCPreferencesLock(preferences, wait);
+}
+
+Boolean
+commit_bench_preferences(SCPreferencesRef preferences)
+{
+    usleep(bench_preferences.commit_latency);
+    return SCPreferencesCommitChanges(preferences);
+}
+
+Boolean
+apply_bench_preferences(SCPreferencesRef preferences)
+{
+    usleep(bench_preferences.apply_latency);
+    return TRUE;
+}
+
+void
+synchronize_bench_preferences(SCPreferencesRef preferences)
+{
+    SCPreferencesSynchronize(preferences);
+}
+
+const PreferencesBackend bench_preferences_backend = {
+    create_bench_preferences,
+    lock_bench_preferences,
+    SCPreferencesUnlock,
+    commit_bench_preferences,
+    apply_bench_preferences,
+    synchronize_bench_preferences
+};
@@ -0,0 +1,22 @@
+#ifndef VPNHELPER_BENCH_PREFERENCES_H
+#define VPNHELPER_BENCH_PREFERENCES_H
+
+#include "vpn.h"
+
+/* How long the calls that configd serves take, in microseconds. Reads and
+ * writes of the store itself go to a real preferences file. */
+typedef struct {
+    unsigned int lock_latency;
+    unsigned int commit_latency;
+    unsigned int apply_latency;
+} BenchPreferences;
+
+extern BenchPreferences bench_preferences;
+
+/* The calls to pass to set_preferences_backend() to stand in for configd.
+ * They work on the preferences file selected with set_vpn_preferences_id(),
+ * wait for the configured latency on lock, commit and apply, and never ask
+ * configd to apply anything. */
+extern const PreferencesBackend bench_preferences_backend;
+
+#endif
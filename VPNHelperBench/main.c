@@ -0,0 +1,119 @@
+#include "scale_bench.h"
+#include "bench_preferences.h"
+#include "fake_keychain.h"
+#include "keychain.h"
+#include "vpn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+/* The most store sizes a run measures at. */
+#define MAX_SCALE_BENCH_SIZES 16
+
+void
+usage(char *name)
+{
+    fprintf(stderr, "usage: %s [--sizes 1,100,1000,10000] [--iterations count]\n\
+       [--keychain-latency ms] [--lock-latency ms] [--commit-latency ms]\n\
+       [--apply-latency ms]\n", name);
+}
+
+/* Converts a latency given in milliseconds on the command line to the
+ * microseconds the fake backends wait for. */
+unsigned int
+parse_latency(const char *value)
+{
+    double ms = atof(value);
+    return ms > 0 ? (unsigned int)(ms * 1000) : 0;
+}
+
+/* Splits a comma-separated list of store sizes.
+ * @result The number of sizes, or 0 if they aren't positive and increasing.
+ */
+int
+parse_sizes(const char *size_string, int *sizes)
+{
+    int size_count = 0;
+    
+    /* strtok() writes into the string, and the default is a literal.
+     * Each size adds to the connections of the one before it. */
+    char *size_list = strdup(size_string);
+    for (char *size = strtok(size_list, ","); size != NULL; size = strtok(NULL, ",")) {
+        int value = atoi(size);
+        if (value <= 0 || size_count == MAX_SCALE_BENCH_SIZES || (size_count > 0 && value < sizes[size_count - 1])) {
+            size_count = 0;
+            break;
+        }
+        sizes[size_count++] = value;
+    }
+    free(size_list);
+    
+    return size_count;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char *size_string = DEFAULT_SCALE_BENCH_SIZES;
+    int iterations = 20;
+    
+    const struct option long_options[] = {
+        {"sizes",            required_argument, NULL, 'z'},
+        {"iterations",       required_argument, NULL, 'e'},
+        {"keychain-latency", required_argument, NULL, 'K'},
+        {"lock-latency",     required_argument, NULL, 'L'},
+        {"commit-latency",   required_argument, NULL, 'C'},
+        {"apply-latency",    required_argument, NULL, 'A'},
+        {NULL,               no_argument,       NULL, 0  }
+    };
+    
+    int opt;
+    int opt_index = 0;
+    while ((opt = getopt_long(argc, argv, "z:e:K:L:C:A:", long_options, &opt_index)) != -1) {
+        switch (opt) {
+            case 'z':
+                size_string = optarg;
+                break;
+            case 'e':
+                iterations = atoi(optarg);
+                break;
+            case 'K':
+                fake_keychain.read_latency = parse_latency(optarg);
+                fake_keychain.write_latency = fake_keychain.read_latency;
+                break;
+            case 'L':
+                bench_preferences.lock_latency = parse_latency(optarg);
+                break;
+            case 'C':
+                bench_preferences.commit_latency = parse_latency(optarg);
+                break;
+            case 'A':
+                bench_preferences.apply_latency = parse_latency(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    
+    int sizes[MAX_SCALE_BENCH_SIZES];
+    int size_count = parse_sizes(size_string, sizes);
+    if (size_count == 0) {
+        fprintf(stderr, "Sizes (--sizes) must be up to %d positive numbers in increasing order\n", MAX_SCALE_BENCH_SIZES);
+        return 1;
+    }
+    
+    if (iterations <= 0) {
+        fprintf(stderr, "Must specify at least one iteration (--iterations)\n");
+        return 1;
+    }
+    
+    /* Both are installed before anything is opened, so the System keychain
+     * and configd are never touched */
+    reset_fake_keychain();
+    set_keychain_backend(&fake_keychain_backend);
+    set_preferences_backend(&bench_preferences_backend);
+    
+    return run_scale_bench(sizes, size_count, iterations);
+}
@@ -0,0 +1,276 @@
+#include "scale_bench.h"
+#include "bench.h"
+#include "json.h"
+#include "trace.h"
+#include "vpn.h"
+#include <dirent.h>
+#include <signal.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+typedef enum {
+    ScaleBenchCreate,
+    ScaleBenchEditAddress,
+    ScaleBenchEditPassword,
+    ScaleBenchList,
+    ScaleBenchDelete,
+    ScaleBenchOperationCount
+} ScaleBenchOperation;
+
+const CFStringRef scale_bench_operation_names[ScaleBenchOperationCount] = {
+    CFSTR("create"), CFSTR("edit_address"), CFSTR("edit_password"), CFSTR("list"), CFSTR("delete")
+};
+
+/* Set by SIGINT and SIGTERM, so that the run stops between operations and
+ * still removes the scratch preferences file. */
+volatile sig_atomic_t scale_bench_interrupted = 0;
+
+void
+handle_scale_bench_signal(int signal)
+{
+    scale_bench_interrupted = 1;
+}
+
+/* Adds connections in a single transaction until the store holds count of
+ * them, like a host that has been provisioned over time. They have no name,
+ * username or secrets, so they get no keychain items. */
+Boolean
+seed_services(CFMutableArrayRef seeded_ids, int count)
+{
+    CFIndex existing = CFArrayGetCount(seeded_ids);
+    if (count <= existing) {
+        return TRUE;
+    }
+    
+    Boolean success = FALSE;
+    CFIndex new_count = count - existing;
+    CFStringRef *new_ids = calloc(new_count, sizeof(CFStringRef));
+    
+    VPNTransactionRef transaction = begin_vpn_transaction();
+    if (transaction == NULL) {
+        goto free_ids;
+    }
+    
+    for (CFIndex i = 0; i < new_count; ++i) {
+        CFStringRef address = CFStringCreateWithFormat(NULL, NULL, CFSTR("vpn%ld.example.com"), existing + i);
+        L2TPConfig config = {
+            .server_address = address,
+            .send_all_traffic = kCFBooleanFalse
+        };
+        
+        Boolean staged = create_vpn_in_transaction(transaction, &new_ids[i], &config);
+        CFRelease(address);
+        
+        if (!staged || scale_bench_interrupted) {
+            goto end_transaction;
+        }
+    }
+    
+    success = commit_vpn_transaction(transaction);
+    
+end_transaction:
+    end_vpn_transaction(transaction);
+free_ids:
+    for (CFIndex i = 0; i < new_count; ++i) {
+        if (new_ids[i] != NULL) {
+            CFArrayAppendValue(seeded_ids, new_ids[i]);
+            CFRelease(new_ids[i]);
+        }
+    }
+    free(new_ids);
+    return success;
+}
+
+/* Times each operation on a connection of its own, so the store is the
+ * same size for every iteration. times holds iterations entries for each
+ * operation in turn. */
+Boolean
+time_operations(int iterations, double *times)
+{
+    for (int i = 0; i < iterations; ++i) {
+        if (scale_bench_interrupted) {
+            return FALSE;
+        }
+        
+        CFStringRef service_id = NULL;
+        CFStringRef name = CFStringCreateWithFormat(NULL, NULL, CFSTR("Bench %d"), i);
+        L2TPConfig config = {
+            .service_name = name,
+            .server_address = CFSTR("vpn.example.com"),
+            .username = CFSTR("user"),
+            .password = CFSTR("password"),
+            .shared_secret = CFSTR("secret"),
+            .send_all_traffic = kCFBooleanFalse
+        };
+        L2TPConfig address_change = {.server_address = CFSTR("vpn2.example.com")};
+        L2TPConfig password_change = {.password = CFSTR("password2")};
+        
+        uint64_t start_time = mach_absolute_time();
+        Boolean created = create_vpn(&service_id, &config);
+        times[ScaleBenchCreate * iterations + i] = mach_time_to_ms(mach_absolute_time() - start_time);
+        CFRelease(name);
+        
+        if (!created) {
+            return FALSE;
+        }
+        
+        start_time = mach_absolute_time();
+        Boolean success = create_vpn(&service_id, &address_change);
+        times[ScaleBenchEditAddress * iterations + i] = mach_time_to_ms(mach_absolute_time() - start_time);
+        
+        start_time = mach_absolute_time();
+        success = create_vpn(&service_id, &password_change) && success;
+        times[ScaleBenchEditPassword * iterations + i] = mach_time_to_ms(mach_absolute_time() - start_time);
+        
+        start_time = mach_absolute_time();
+        CFArrayRef vpn_list = copy_vpn_list();
+        times[ScaleBenchList * iterations + i] = mach_time_to_ms(mach_absolute_time() - start_time);
+        if (vpn_list != NULL) {
+            CFRelease(vpn_list);
+        } else {
+            success = FALSE;
+        }
+        
+        start_time = mach_absolute_time();
+        success = delete_vpn(service_id) && success;
+        times[ScaleBenchDelete * iterations + i] = mach_time_to_ms(mach_absolute_time() - start_time);
+        
+        CFRelease(service_id);
+        if (!success) {
+            return FALSE;
+        }
+    }
+    
+    return TRUE;
+}
+
+CFDictionaryRef
+create_latency_summary(double *times, int count)
+{
+    CFMutableDictionaryRef summary = CFDictionaryCreateMutable(
+        NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+    );
+    
+    double total = 0;
+    for (int i = 0; i < count; ++i) {
+        total += times[i];
+    }
+    
+    qsort(times, count, sizeof(double), compare_doubles);
+    set_bench_number(summary, CFSTR("mean_ms"), total / count);
+    set_bench_number(summary, CFSTR("p50_ms"), get_percentile(times, count, 0.5));
+    set_bench_number(summary, CFSTR("p99_ms"), get_percentile(times, count, 0.99));
+    set_bench_number(summary, CFSTR("max_ms"), times[count - 1]);
+    set_bench_number(summary, CFSTR("ops_per_sec"), count * 1000 / total);
+    return summary;
+}
+
+/* Removes the scratch preferences file and anything SCPreferences left
+ * next to it. */
+void
+remove_scratch_directory(const char *path)
+{
+    DIR *dir = opendir(path);
+    if (dir != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            
+            char entry_path[PATH_MAX];
+            snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->d_name);
+            unlink(entry_path);
+        }
+        closedir(dir);
+    }
+    
+    rmdir(path);
+}
+
+int
+run_scale_bench(const int *sizes, int size_count, int iterations)
+{
+    int err = 1;
+    
+    char scratch_path[] = "/tmp/vpnhelper-scale.XXXXXX";
+    if (mkdtemp(scratch_path) == NULL) {
+        perror("Failed to create scratch directory");
+        return 1;
+    }
+    
+    char prefs_path[PATH_MAX];
+    snprintf(prefs_path, sizeof(prefs_path), "%s/preferences.plist", scratch_path);
+    CFStringRef prefs_id = CFStringCreateWithCString(NULL, prefs_path, kCFStringEncodingUTF8);
+    set_vpn_preferences_id(prefs_id);
+    CFRelease(prefs_id);
+    
+    CFMutableArrayRef seeded_ids = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    CFMutableArrayRef results = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    double *times = calloc((size_t)iterations * ScaleBenchOperationCount, sizeof(double));
+    
+    /* Restarting interrupted calls keeps SystemConfiguration from seeing
+     * EINTR */
+    struct sigaction action = {.sa_handler = handle_scale_bench_signal, .sa_flags = SA_RESTART};
+    struct sigaction old_int_action, old_term_action;
+    sigemptyset(&action.sa_mask);
+    scale_bench_interrupted = 0;
+    sigaction(SIGINT, &action, &old_int_action);
+    sigaction(SIGTERM, &action, &old_term_action);
+    
+    for (int i = 0; i < size_count; ++i) {
+        fprintf(stderr, "Measuring with %d existing connections\n", sizes[i]);
+        
+        uint64_t start_time = mach_absolute_time();
+        if (!seed_services(seeded_ids, sizes[i])) {
+            fprintf(stderr, "Failed to add connections to the store\n");
+            goto cleanup;
+        }
+        double seed_ms = mach_time_to_ms(mach_absolute_time() - start_time);
+        
+        if (!time_operations(iterations, times)) {
+            fprintf(stderr, "Failed to time operations\n");
+            goto cleanup;
+        }
+        
+        CFMutableDictionaryRef result = CFDictionaryCreateMutable(
+            NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+        );
+        set_bench_number(result, CFSTR("existing"), sizes[i]);
+        set_bench_number(result, CFSTR("iterations"), iterations);
+        set_bench_number(result, CFSTR("seed_ms"), seed_ms);
+        
+        for (int operation = 0; operation < ScaleBenchOperationCount; ++operation) {
+            CFDictionaryRef summary = create_latency_summary(&times[operation * iterations], iterations);
+            CFDictionarySetValue(result, scale_bench_operation_names[operation], summary);
+            CFRelease(summary);
+        }
+        
+        CFArrayAppendValue(results, result);
+        CFRelease(result);
+    }
+    
+    write_json_value(stdout, results);
+    printf("\n");
+    err = 0;
+    
+cleanup:
+    if (scale_bench_interrupted) {
+        fprintf(stderr, "Interrupted\n");
+    }
+    
+    set_vpn_preferences_id(NULL);
+    remove_scratch_directory(scratch_path);
+    
+    sigaction(SIGTERM, &old_term_action, NULL);
+    sigaction(SIGINT, &old_int_action, NULL);
+    
+    free(times);
+    CFRelease(results);
+    CFRelease(seeded_ids);
+    return err;
+}
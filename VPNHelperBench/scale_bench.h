@@ -0,0 +1,20 @@
+#ifndef VPNHELPER_SCALE_BENCH_H
+#define VPNHELPER_SCALE_BENCH_H
+
+/* The store sizes measured at if none are given. */
+#define DEFAULT_SCALE_BENCH_SIZES "1,100,1000,10000"
+
+/* Measures how the latency of create, edit, list and delete changes as the
+ * preferences store grows. It works on a scratch preferences file, which is
+ * filled with connections up to each size in turn, through whichever
+ * keychain and preferences backends are installed. The results are printed
+ * as a JSON array with one object per size.
+ * @param sizes How many connections to have in the store for each round,
+ *     from smallest to largest.
+ * @param size_count The number of sizes.
+ * @param iterations How many times to time each operation at each size.
+ * @result Nonzero on failure.
+ */
+int run_scale_bench(const int *sizes, int size_count, int iterations);
+
+#endif
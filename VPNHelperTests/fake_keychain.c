@@ -0,0 +1,250 @@
+#include "fake_keychain.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+FakeKeychain fake_keychain = {0};
+
+void
+copy_fake_field(char *field, const void *value, UInt32 length)
+{
+    if (length >= FAKE_FIELD_SIZE) {
+        length = FAKE_FIELD_SIZE - 1;
+    }
+    if (length > 0) {
+        memcpy(field, value, length);
+    }
+    field[length] = '\0';
+}
+
+void
+set_fake_attributes(FakeKeychainItem *item, const SecKeychainAttributeList *attributes)
+{
+    for (UInt32 i = 0; i < attributes->count; ++i) {
+        const SecKeychainAttribute *attribute = &attributes->attr[i];
+        switch (attribute->tag) {
+            case kSecServiceItemAttr:
+                copy_fake_field(item->service, attribute->data, attribute->length);
+                break;
+            case kSecDescriptionItemAttr:
+                copy_fake_field(item->description, attribute->data, attribute->length);
+                break;
+            case kSecLabelItemAttr:
+                copy_fake_field(item->label, attribute->data, attribute->length);
+                break;
+            case kSecAccountItemAttr:
+                copy_fake_field(item->account, attribute->data, attribute->length);
+                break;
+        }
+    }
+}
+
+FakeKeychainItem *
+append_fake_item(void)
+{
+    if (fake_keychain.count == fake_keychain.capacity) {
+        fake_keychain.capacity = (fake_keychain.capacity == 0) ? 16 : fake_keychain.capacity * 2;
+        fake_keychain.items = realloc(fake_keychain.items, fake_keychain.capacity * sizeof(FakeKeychainItem));
+    }
+    
+    FakeKeychainItem *item = &fake_keychain.items[fake_keychain.count++];
+    memset(item, 0, sizeof(FakeKeychainItem));
+    item->exists = TRUE;
+    return item;
+}
+
+FakeKeychainItem *
+add_fake_keychain_item(const char *service, const char *label, const char *account, const char *data)
+{
+    FakeKeychainItem *item = append_fake_item();
+    copy_fake_field(item->service, service, (UInt32)strlen(service));
+    if (label != NULL) {
+        copy_fake_field(item->label, label, (UInt32)strlen(label));
+    }
+    if (account != NULL) {
+        copy_fake_field(item->account, account, (UInt32)strlen(account));
+    }
+    copy_fake_field(item->data, data, (UInt32)strlen(data));
+    return item;
+}
+
+FakeKeychainItem *
+find_fake_item(const char *service)
+{
+    for (CFIndex i = 0; i < fake_keychain.count; ++i) {
+        if (fake_keychain.items[i].exists && strcmp(fake_keychain.items[i].service, service) == 0) {
+            return &fake_keychain.items[i];
+        }
+    }
+    return NULL;
+}
+
+FakeKeychainItem *
+get_fake_item(SecKeychainItemRef item)
+{
+    CFIndex index;
+    CFNumberGetValue((CFNumberRef)item, kCFNumberCFIndexType, &index);
+    return &fake_keychain.items[index];
+}
+
+SecKeychainItemRef
+create_fake_item_ref(FakeKeychainItem *item)
+{
+    CFIndex index = item - fake_keychain.items;
+    return (SecKeychainItemRef)CFNumberCreate(NULL, kCFNumberCFIndexType, &index);
+}
+
+void
+reset_fake_keychain_counts(void)
+{
+    fake_keychain.finds = 0;
+    fake_keychain.lists = 0;
+    fake_keychain.modifies = 0;
+    fake_keychain.creates = 0;
+    fake_keychain.deletes = 0;
+}
+
+void
+reset_fake_keychain(void)
+{
+    free(fake_keychain.items);
+    fake_keychain.items = NULL;
+    fake_keychain.count = 0;
+    fake_keychain.capacity = 0;
+    reset_fake_keychain_counts();
+}
+
+OSStatus
+copy_fake_keychain(SecKeychainRef *keychain)
+{
+    *keychain = (SecKeychainRef)CFRetain(CFSTR("fake keychain"));
+    return errSecSuccess;
+}
+
+OSStatus
+create_fake_access(SecAccessRef *access)
+{
+    *access = (SecAccessRef)CFRetain(CFSTR("fake access"));
+    return errSecSuccess;
+}
+
+OSStatus
+find_fake_keychain_item(SecKeychainRef keychain, const char *service, UInt32 *length, void **data, SecKeychainItemRef *item)
+{
+    fake_keychain.finds++;
+    usleep(fake_keychain.read_latency);
+    
+    FakeKeychainItem *found = find_fake_item(service);
+    if (found == NULL) {
+        return errSecItemNotFound;
+    }
+    
+    if (data != NULL) {
+        *length = (UInt32)strlen(found->data);
+        *data = strdup(found->data);
+    }
+    if (item != NULL) {
+        *item = create_fake_item_ref(found);
+    }
+    return errSecSuccess;
+}
+
+void
+free_fake_keychain_data(void *data)
+{
+    free(data);
+}
+
+void
+set_fake_string_attribute(CFMutableDictionaryRef attributes, CFStringRef key, const char *value)
+{
+    CFStringRef string = CFStringCreateWithCString(NULL, value, kCFStringEncodingUTF8);
+    CFDictionarySetValue(attributes, key, string);
+    CFRelease(string);
+}
+
+OSStatus
+list_fake_keychain_items(SecKeychainRef keychain, CFArrayRef *items)
+{
+    fake_keychain.lists++;
+    usleep(fake_keychain.read_latency);
+    
+    CFMutableArrayRef list = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    for (CFIndex i = 0; i < fake_keychain.count; ++i) {
+        FakeKeychainItem *item = &fake_keychain.items[i];
+        if (!item->exists) {
+            continue;
+        }
+        
+        CFMutableDictionaryRef attributes = CFDictionaryCreateMutable(
+            NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+        );
+        set_fake_string_attribute(attributes, kSecAttrService, item->service);
+        set_fake_string_attribute(attributes, kSecAttrDescription, item->description);
+        set_fake_string_attribute(attributes, kSecAttrLabel, item->label);
+        set_fake_string_attribute(attributes, kSecAttrAccount, item->account);
+        
+        SecKeychainItemRef item_ref = create_fake_item_ref(item);
+        CFDictionarySetValue(attributes, kSecValueRef, item_ref);
+        CFRelease(item_ref);
+        
+        CFArrayAppendValue(list, attributes);
+        CFRelease(attributes);
+    }
+    
+    if (CFArrayGetCount(list) == 0) {
+        CFRelease(list);
+        *items = NULL;
+        return errSecItemNotFound;
+    }
+    
+    *items = list;
+    return errSecSuccess;
+}
+
+OSStatus
+modify_fake_keychain_item(SecKeychainItemRef item, const SecKeychainAttributeList *attributes, UInt32 length, const void *data)
+{
+    fake_keychain.modifies++;
+    usleep(fake_keychain.write_latency);
+    
+    FakeKeychainItem *fake_item = get_fake_item(item);
+    set_fake_attributes(fake_item, attributes);
+    if (data != NULL) {
+        copy_fake_field(fake_item->data, data, length);
+    }
+    return errSecSuccess;
+}
+
+OSStatus
+create_fake_keychain_item(SecKeychainRef keychain, SecAccessRef access, SecKeychainAttributeList *attributes, UInt32 length, const void *data)
+{
+    fake_keychain.creates++;
+    usleep(fake_keychain.write_latency);
+    
+    FakeKeychainItem *item = append_fake_item();
+    set_fake_attributes(item, attributes);
+    copy_fake_field(item->data, data, data == NULL ? 0 : length);
+    return errSecSuccess;
+}
+
+OSStatus
+delete_fake_keychain_item(SecKeychainItemRef item)
+{
+    fake_keychain.deletes++;
+    usleep(fake_keychain.write_latency);
+    
+    get_fake_item(item)->exists = FALSE;
+    return errSecSuccess;
+}
+
+const KeychainBackend fake_keychain_backend = {
+    copy_fake_keychain,
+    create_fake_access,
+    find_fake_keychain_item,
+    free_fake_keychain_data,
+    list_fake_keychain_items,
+    modify_fake_keychain_item,
+    create_fake_keychain_item,
+    delete_fake_keychain_item
+};
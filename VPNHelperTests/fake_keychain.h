@@ -0,0 +1,66 @@
+#ifndef VPNHELPER_FAKE_KEYCHAIN_H
+#define VPNHELPER_FAKE_KEYCHAIN_H
+
+#include "keychain.h"
+
+/* The longest service, label, account or secret the fake keychain keeps;
+ * anything longer is cut short. */
+#define FAKE_FIELD_SIZE 128
+
+typedef struct {
+    Boolean exists;
+    char service[FAKE_FIELD_SIZE];
+    char description[FAKE_FIELD_SIZE];
+    char label[FAKE_FIELD_SIZE];
+    char account[FAKE_FIELD_SIZE];
+    char data[FAKE_FIELD_SIZE];
+} FakeKeychainItem;
+
+/* An in-memory keychain that counts the calls made to it, for the tests and
+ * the benchmark. Item references handed out are CFNumbers holding the index
+ * of the item, so the code using them can release them as it would real
+ * ones. Deleted items keep their index, so references stay valid. */
+typedef struct {
+    FakeKeychainItem *items;
+    CFIndex count;
+    CFIndex capacity;
+    
+    unsigned int finds;
+    unsigned int lists;
+    unsigned int modifies;
+    unsigned int creates;
+    unsigned int deletes;
+    
+    /* How long each call that reads or writes items takes, in
+     * microseconds, to stand in for the cost of the system keychain. */
+    unsigned int read_latency;
+    unsigned int write_latency;
+} FakeKeychain;
+
+extern FakeKeychain fake_keychain;
+
+/* The calls to pass to set_keychain_backend() to use the fake keychain. */
+extern const KeychainBackend fake_keychain_backend;
+
+/* Removes every item and zeroes the call counts. Latencies are kept. */
+void reset_fake_keychain(void);
+
+/* Zeroes the call counts. */
+void reset_fake_keychain_counts(void);
+
+/* Adds an item directly, without counting a call.
+ * @param service The service name of the item.
+ * @param label The label, or NULL for none.
+ * @param account The account, or NULL for none.
+ * @param data The secret.
+ * @result The new item.
+ */
+FakeKeychainItem *add_fake_keychain_item(const char *service, const char *label, const char *account, const char *data);
+
+/* Looks up the first item with a service name, without counting a call.
+ * @param service The service name.
+ * @result The item, or NULL if there is none.
+ */
+FakeKeychainItem *find_fake_item(const char *service);
+
+#endif
@@ -0,0 +1,134 @@
+#include "tests.h"
+#include "fake_keychain.h"
+#include <string.h>
+
+/* Gives each test an empty fake keychain, which it fills as it needs. */
+void
+use_empty_fake_keychain(void)
+{
+    reset_fake_keychain();
+    set_keychain_backend(&fake_keychain_backend);
+}
+
+/* Gives a connection both of its items, as creating it would have. */
+void
+add_connection_items(void)
+{
+    add_fake_keychain_item("SERVICE", "Office", "alice", "password");
+    add_fake_keychain_item("SERVICE.SS", "Office", NULL, "secret");
+}
+
+/* Creating a connection finds nothing, so both items are created. */
+void
+test_create_writes_new_items(void)
+{
+    use_empty_fake_keychain();
+    L2TPConfig config = {CFSTR("Office"), NULL, CFSTR("alice"), CFSTR("password"), CFSTR("secret"), NULL};
+    
+    CHECK(configure_keychain(&config, CFSTR("SERVICE"), CFSTR("SERVICE.SS"), KeychainItemVPNPassword | KeychainItemSharedSecret));
+    CHECK(fake_keychain.finds == 2);
+    CHECK(fake_keychain.creates == 2);
+    CHECK(fake_keychain.modifies == 0);
+    
+    FakeKeychainItem *password = find_fake_item("SERVICE");
+    FakeKeychainItem *secret = find_fake_item("SERVICE.SS");
+    CHECK(password != NULL && strcmp(password->data, "password") == 0 && strcmp(password->account, "alice") == 0);
+    CHECK(secret != NULL && strcmp(secret->data, "secret") == 0 && strcmp(secret->label, "Office") == 0);
+}
+
+/* Renaming modifies both items in place and keeps their secrets. */
+void
+test_rename_keeps_secrets(void)
+{
+    use_empty_fake_keychain();
+    add_connection_items();
+    L2TPConfig config = {CFSTR("Home"), NULL, NULL, NULL, NULL, NULL};
+    
+    CHECK(configure_keychain(&config, CFSTR("SERVICE"), CFSTR("SERVICE.SS"), KeychainItemVPNPassword | KeychainItemSharedSecret));
+    CHECK(fake_keychain.finds == 2);
+    CHECK(fake_keychain.modifies == 2);
+    CHECK(fake_keychain.creates == 0);
+    CHECK(fake_keychain.deletes == 0);
+    
+    FakeKeychainItem *password = find_fake_item("SERVICE");
+    FakeKeychainItem *secret = find_fake_item("SERVICE.SS");
+    CHECK(password != NULL && strcmp(password->label, "Home") == 0);
+    CHECK(password != NULL && strcmp(password->data, "password") == 0 && strcmp(password->account, "alice") == 0);
+    CHECK(secret != NULL && strcmp(secret->label, "Home") == 0 && strcmp(secret->data, "secret") == 0);
+}
+
+/* A new password replaces only the data of the password item, and an item
+ * that is missing is created again. */
+void
+test_edit_updates_and_recreates(void)
+{
+    use_empty_fake_keychain();
+    add_fake_keychain_item("SERVICE", "Office", "alice", "password");
+    L2TPConfig config = {NULL, NULL, NULL, CFSTR("new password"), CFSTR("new secret"), NULL};
+    
+    CHECK(configure_keychain(&config, CFSTR("SERVICE"), CFSTR("SERVICE.SS"), KeychainItemVPNPassword | KeychainItemSharedSecret));
+    CHECK(fake_keychain.finds == 2);
+    CHECK(fake_keychain.modifies == 1);
+    CHECK(fake_keychain.creates == 1);
+    
+    FakeKeychainItem *password = find_fake_item("SERVICE");
+    FakeKeychainItem *secret = find_fake_item("SERVICE.SS");
+    CHECK(password != NULL && strcmp(password->data, "new password") == 0);
+    CHECK(password != NULL && strcmp(password->label, "Office") == 0 && strcmp(password->account, "alice") == 0);
+    CHECK(secret != NULL && strcmp(secret->data, "new secret") == 0);
+}
+
+/* Reading and listing go through the backend too. */
+void
+test_reads_use_backend(void)
+{
+    use_empty_fake_keychain();
+    add_connection_items();
+    
+    CHECK(keychain_password_matches(CFSTR("SERVICE"), CFSTR("password")));
+    CHECK(!keychain_password_matches(CFSTR("SERVICE"), CFSTR("other")));
+    CHECK(!keychain_password_matches(CFSTR("MISSING"), CFSTR("password")));
+    
+    CFStringRef secret = copy_keychain_password(CFSTR("SERVICE.SS"));
+    CHECK(secret != NULL && CFEqual(secret, CFSTR("secret")));
+    if (secret != NULL) {
+        CFRelease(secret);
+    }
+    CHECK(copy_keychain_password(CFSTR("MISSING")) == NULL);
+    CHECK(fake_keychain.finds == 5);
+    
+    CFTypeRef item = copy_keychain_item(CFSTR("SERVICE"));
+    CHECK(item != NULL);
+    if (item != NULL) {
+        CHECK(delete_keychain_item(item));
+        CFRelease(item);
+    }
+    CHECK(find_fake_item("SERVICE") == NULL);
+}
+
+/* Deleting removes both items, then stops when neither is found. */
+void
+test_delete_removes_items(void)
+{
+    use_empty_fake_keychain();
+    add_connection_items();
+    
+    CHECK(delete_keychain_items(CFSTR("SERVICE"), CFSTR("SERVICE.SS")));
+    CHECK(fake_keychain.deletes == 2);
+    CHECK(fake_keychain.finds == 4);
+    CHECK(find_fake_item("SERVICE") == NULL);
+    CHECK(find_fake_item("SERVICE.SS") == NULL);
+}
+
+void
+run_keychain_tests(void)
+{
+    test_create_writes_new_items();
+    test_rename_keeps_secrets();
+    test_edit_updates_and_recreates();
+    test_reads_use_backend();
+    test_delete_removes_items();
+    
+    set_keychain_backend(NULL);
+    reset_fake_keychain();
+}
@@ -0,0 +1,41 @@
+#include "tests.h"
+#include <stdio.h>
+
+/* The tests of each module, in the order they run. */
+typedef struct {
+    const char *name;
+    void (*run)(void);
+} TestSuite;
+
+unsigned int check_count = 0;
+unsigned int check_failures = 0;
+
+void
+check_condition(Boolean condition, const char *text, const char *file, int line)
+{
+    check_count++;
+    if (!condition) {
+        check_failures++;
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, text);
+    }
+}
+
+int
+main(int argc, const char *argv[])
+{
+    const TestSuite suites[] = {
+        {"keychain", run_keychain_tests},
+        {"probe", run_probe_tests},
+        {"supervisor", run_supervisor_tests},
+        {"watch", run_watch_tests}
+    };
+    
+    for (size_t i = 0; i < sizeof(suites) / sizeof(suites[0]); ++i) {
+        unsigned int failures = check_failures;
+        suites[i].run();
+        printf("%-12s %s\n", suites[i].name, check_failures == failures ? "passed" : "FAILED");
+    }
+    
+    printf("%u of %u checks failed\n", check_failures, check_count);
+    return check_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+#include "tests.h"
+#include "probe.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <dispatch/dispatch.h>
+
+/* A UDP socket on a loopback address that echoes the first request it
+ * gets, as an IKE server would echo the cookie. */
+typedef struct {
+    int fd;
+    dispatch_semaphore_t done;
+} LoopbackResponder;
+
+void
+run_loopback_responder(void *info)
+{
+    LoopbackResponder *responder = info;
+    
+    uint8_t request[1500];
+    struct sockaddr_storage from;
+    socklen_t from_length = sizeof(from);
+    ssize_t length = recvfrom(responder->fd, request, sizeof(request), 0, (struct sockaddr *)&from, &from_length);
+    if (length > 0) {
+        sendto(responder->fd, request, length, 0, (struct sockaddr *)&from, from_length);
+    }
+    
+    dispatch_semaphore_signal(responder->done);
+}
+
+/* Binds a UDP socket to a loopback address.
+ * @param family AF_INET or AF_INET6.
+ * @param port The port, or 0 for any free one.
+ * @param bound_port Receives the port that was bound.
+ * @result The socket, or -1 on failure.
+ */
+int
+open_loopback_socket(int family, uint16_t port, uint16_t *bound_port)
+{
+    int fd = socket(family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    struct sockaddr_storage address;
+    memset(&address, 0, sizeof(address));
+    socklen_t length;
+    if (family == AF_INET6) {
+        struct sockaddr_in6 *address6 = (struct sockaddr_in6 *)&address;
+        address6->sin6_family = AF_INET6;
+        address6->sin6_addr = in6addr_loopback;
+        address6->sin6_port = htons(port);
+        length = sizeof(struct sockaddr_in6);
+    } else {
+        struct sockaddr_in *address4 = (struct sockaddr_in *)&address;
+        address4->sin_family = AF_INET;
+        address4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address4->sin_port = htons(port);
+        length = sizeof(struct sockaddr_in);
+    }
+    
+    if (bind(fd, (struct sockaddr *)&address, length) < 0 || getsockname(fd, (struct sockaddr *)&address, &length) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    *bound_port = ntohs(family == AF_INET6 ? ((struct sockaddr_in6 *)&address)->sin6_port : ((struct sockaddr_in *)&address)->sin_port);
+    
+    /* The echoing responder gives up if no request ever comes */
+    struct timeval timeout = {3, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+/* Two candidates listen on the same port at different loopback addresses,
+ * one silent and one echoing. Nothing listens on the second port, so those
+ * requests come back as errors. The echoing one is picked well before the
+ * timeout. */
+void
+test_echoing_server_selected(void)
+{
+    uint16_t port, closed_port;
+    LoopbackResponder echoing = {-1, dispatch_semaphore_create(0)};
+    
+    int silent_fd = open_loopback_socket(AF_INET, 0, &port);
+    echoing.fd = open_loopback_socket(AF_INET6, port, &port);
+    int closed_fd = open_loopback_socket(AF_INET, 0, &closed_port);
+    CHECK(silent_fd >= 0 && echoing.fd >= 0 && closed_fd >= 0);
+    if (silent_fd < 0 || echoing.fd < 0 || closed_fd < 0) {
+        goto close_sockets;
+    }
+    close(closed_fd);
+    closed_fd = -1;
+    
+    char port_name[8], closed_port_name[8];
+    snprintf(port_name, sizeof(port_name), "%u", port);
+    snprintf(closed_port_name, sizeof(closed_port_name), "%u", closed_port);
+    const char *saved_ports[IKE_PORT_COUNT] = {ike_ports[0], ike_ports[1]};
+    ike_ports[0] = port_name;
+    ike_ports[1] = closed_port_name;
+    
+    dispatch_async_f(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), &echoing, run_loopback_responder);
+    
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    CFStringRef fastest = copy_fastest_vpn_server(CFSTR("127.0.0.1, ::1"), 2000);
+    CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - start;
+    
+    CHECK(fastest != NULL && CFEqual(fastest, CFSTR("::1")));
+    CHECK(elapsed < 1.0);
+    
+    dispatch_semaphore_wait(echoing.done, DISPATCH_TIME_FOREVER);
+    ike_ports[0] = saved_ports[0];
+    ike_ports[1] = saved_ports[1];
+    if (fastest != NULL) {
+        CFRelease(fastest);
+    }
+    
+close_sockets:
+    if (closed_fd >= 0) {
+        close(closed_fd);
+    }
+    if (echoing.fd >= 0) {
+        close(echoing.fd);
+    }
+    if (silent_fd >= 0) {
+        close(silent_fd);
+    }
+    dispatch_release(echoing.done);
+}
+
+void
+run_probe_tests(void)
+{
+    test_echoing_server_selected();
+}
@@ -0,0 +1,213 @@
+#include "tests.h"
+#include "supervisor.h"
+#include <math.h>
+
+#define SIMULATED_SERVICE_COUNT 3
+#define SIMULATED_MAX_ATTEMPTS 16
+
+typedef struct {
+    double time;
+    int service;
+    int attempt;
+} SimulatedAttempt;
+
+/* A backend with a virtual clock. It records every attempt, and since it
+ * knows the attempt timeout, it can tell how many attempts were in
+ * progress whenever one starts. Randomness is fixed at the middle of the
+ * range, so each delay is three quarters of the full backoff. */
+typedef struct {
+    double now;
+    double wake;
+    double attempt_timeout;
+    
+    /* Whether to refuse to start attempts. */
+    Boolean refuse;
+    
+    /* When each service's attempt in progress times out, or -1. */
+    double attempt_ends[SIMULATED_SERVICE_COUNT];
+    
+    SimulatedAttempt attempts[SIMULATED_MAX_ATTEMPTS];
+    int attempt_count;
+    int max_in_progress;
+} SimulatedBackend;
+
+Boolean
+simulated_connect(int service, int attempt, void *info)
+{
+    SimulatedBackend *sim = info;
+    if (sim->attempt_count < SIMULATED_MAX_ATTEMPTS) {
+        sim->attempts[sim->attempt_count++] = (SimulatedAttempt){sim->now, service, attempt};
+    }
+    
+    if (sim->refuse) {
+        return FALSE;
+    }
+    
+    sim->attempt_ends[service] = sim->now + sim->attempt_timeout;
+    int in_progress = 0;
+    for (int i = 0; i < SIMULATED_SERVICE_COUNT; ++i) {
+        if (sim->attempt_ends[i] > sim->now) {
+            in_progress++;
+        }
+    }
+    if (in_progress > sim->max_in_progress) {
+        sim->max_in_progress = in_progress;
+    }
+    return TRUE;
+}
+
+void
+simulated_wake_at(double when, void *info)
+{
+    SimulatedBackend *sim = info;
+    sim->wake = when;
+}
+
+double
+simulated_now(void *info)
+{
+    SimulatedBackend *sim = info;
+    return sim->now;
+}
+
+double
+simulated_random(void *info)
+{
+    return 0.5;
+}
+
+Supervisor *
+create_simulated_supervisor(SimulatedBackend *sim, int service_count, SupervisorPolicy policy)
+{
+    *sim = (SimulatedBackend){0};
+    sim->wake = -1;
+    sim->attempt_timeout = policy.attempt_timeout;
+    for (int i = 0; i < SIMULATED_SERVICE_COUNT; ++i) {
+        sim->attempt_ends[i] = -1;
+    }
+    
+    SupervisorBackend backend = {simulated_connect, simulated_wake_at, simulated_now, simulated_random, sim};
+    return create_supervisor(service_count, policy, backend);
+}
+
+/* Moves the clock forward, running the scheduler at every wake time on
+ * the way. */
+void
+advance_simulation(SimulatedBackend *sim, Supervisor *supervisor, double time)
+{
+    for (int i = 0; i < 100 && sim->wake >= 0 && sim->wake <= time; ++i) {
+        sim->now = sim->wake;
+        run_supervisor(supervisor);
+    }
+    sim->now = time;
+}
+
+/* Reports the outcome of a service's connection, as the backend would. */
+void
+report_simulated_status(SimulatedBackend *sim, Supervisor *supervisor, int service, Boolean up)
+{
+    sim->attempt_ends[service] = -1;
+    if (up) {
+        supervisor_service_up(supervisor, service);
+    } else {
+        supervisor_service_down(supervisor, service);
+    }
+    run_supervisor(supervisor);
+}
+
+Boolean
+attempt_matches(SimulatedBackend *sim, int index, double time, int service, int attempt)
+{
+    if (index >= sim->attempt_count) {
+        return FALSE;
+    }
+    
+    SimulatedAttempt *recorded = &sim->attempts[index];
+    return fabs(recorded->time - time) < 0.001 && recorded->service == service && recorded->attempt == attempt;
+}
+
+/* Attempts that fail at once double the delay each time, up to the limit. */
+void
+test_backoff_is_capped(void)
+{
+    SupervisorPolicy policy = {1000, 4000, 2000, 0};
+    SimulatedBackend sim;
+    Supervisor *supervisor = create_simulated_supervisor(&sim, 1, policy);
+    sim.refuse = TRUE;
+    
+    report_simulated_status(&sim, supervisor, 0, FALSE);
+    advance_simulation(&sim, supervisor, 9000);
+    
+    /* 750 after the drop, then 1500, 3000 and 3000 after each failure */
+    CHECK(sim.attempt_count == 4);
+    CHECK(attempt_matches(&sim, 0, 750, 0, 1));
+    CHECK(attempt_matches(&sim, 1, 2250, 0, 2));
+    CHECK(attempt_matches(&sim, 2, 5250, 0, 3));
+    CHECK(attempt_matches(&sim, 3, 8250, 0, 4));
+    
+    SupervisedServiceStats stats;
+    get_supervised_service_stats(supervisor, 0, &stats);
+    CHECK(!stats.is_up);
+    CHECK(stats.attempts == 4);
+    CHECK(stats.reconnects == 0);
+    CHECK(fabs(stats.downtime - 9000) < 0.001);
+    
+    free_supervisor(supervisor);
+}
+
+/* Three services drop together with room for two attempts at a time. The
+ * third waits for a slot, the ones that time out back off, and one that
+ * connects after timing out still counts as reconnected. */
+void
+test_concurrency_cap(void)
+{
+    SupervisorPolicy policy = {1000, 4000, 2000, 2};
+    SimulatedBackend sim;
+    Supervisor *supervisor = create_simulated_supervisor(&sim, SIMULATED_SERVICE_COUNT, policy);
+    
+    for (int i = 0; i < SIMULATED_SERVICE_COUNT; ++i) {
+        report_simulated_status(&sim, supervisor, i, FALSE);
+    }
+    
+    advance_simulation(&sim, supervisor, 1000);
+    CHECK(sim.attempt_count == 2);
+    CHECK(attempt_matches(&sim, 0, 750, 0, 1));
+    CHECK(attempt_matches(&sim, 1, 750, 1, 1));
+    
+    /* Service 0 connects, freeing a slot for service 2 */
+    report_simulated_status(&sim, supervisor, 0, TRUE);
+    CHECK(attempt_matches(&sim, 2, 1000, 2, 1));
+    
+    /* Services 1 and 2 time out at 2750 and 3000, then service 2 connects
+     * late while waiting to retry */
+    advance_simulation(&sim, supervisor, 4000);
+    CHECK(sim.attempt_count == 3);
+    report_simulated_status(&sim, supervisor, 2, TRUE);
+    
+    advance_simulation(&sim, supervisor, 5000);
+    CHECK(sim.attempt_count == 4);
+    CHECK(attempt_matches(&sim, 3, 4250, 1, 2));
+    CHECK(sim.max_in_progress == 2);
+    
+    SupervisedServiceStats stats;
+    get_supervised_service_stats(supervisor, 0, &stats);
+    CHECK(stats.is_up && stats.attempts == 1 && stats.reconnects == 1);
+    CHECK(fabs(stats.downtime - 1000) < 0.001);
+    
+    get_supervised_service_stats(supervisor, 1, &stats);
+    CHECK(!stats.is_up && stats.attempts == 2 && stats.reconnects == 0);
+    CHECK(fabs(stats.downtime - 5000) < 0.001);
+    
+    get_supervised_service_stats(supervisor, 2, &stats);
+    CHECK(stats.is_up && stats.attempts == 1 && stats.reconnects == 1);
+    CHECK(fabs(stats.downtime - 4000) < 0.001);
+    
+    free_supervisor(supervisor);
+}
+
+void
+run_supervisor_tests(void)
+{
+    test_backoff_is_capped();
+    test_concurrency_cap();
+}
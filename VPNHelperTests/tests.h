@@ -0,0 +1,31 @@
+#ifndef VPNHELPER_TESTS_H
+#define VPNHELPER_TESTS_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/* Checks a condition, printing it with its location if it doesn't hold.
+ * A failed check doesn't stop the test it is in. */
+#define CHECK(condition) check_condition((condition), #condition, __FILE__, __LINE__)
+
+/* Records the outcome of a check.
+ * @param condition Whether the check passed.
+ * @param text The source text of the condition.
+ * @param file The file the check is in.
+ * @param line The line the check is on.
+ */
+void check_condition(Boolean condition, const char *text, const char *file, int line);
+
+/* Runs the keychain tests against a fake keychain that counts calls. */
+void run_keychain_tests(void);
+
+/* Runs the probe tests against responders on loopback addresses. */
+void run_probe_tests(void);
+
+/* Runs the supervisor tests against a simulated backend with a virtual
+ * clock. */
+void run_supervisor_tests(void);
+
+/* Runs the watch tests against a scripted event source. */
+void run_watch_tests(void);
+
+#endif
@@ -0,0 +1,158 @@
+#include "tests.h"
+#include "watch.h"
+#include "json.h"
+#include <string.h>
+
+/* A status event for the scripted source to deliver. */
+typedef struct {
+    CFStringRef service_id;
+    SCNetworkConnectionStatus status;
+    int last_cause;
+} ScriptedEvent;
+
+/* What a scripted source delivers, and where to. A ConnectionEventSource
+ * has no pointer of its own, so the script being played is global. */
+typedef struct {
+    const ScriptedEvent *events;
+    CFIndex count;
+    ConnectionEventCallback callback;
+    void *info;
+} EventScript;
+
+EventScript event_script;
+
+void
+play_event_script(void *info)
+{
+    EventScript *script = info;
+    for (CFIndex i = 0; i < script->count; ++i) {
+        const ScriptedEvent *event = &script->events[i];
+        script->callback(event->service_id, event->status, event->last_cause, script->info);
+    }
+}
+
+Boolean
+scripted_connection_events(CFArrayRef service_ids, dispatch_queue_t queue, ConnectionEventCallback callback, void *info)
+{
+    event_script.callback = callback;
+    event_script.info = info;
+    dispatch_async_f(queue, &event_script, play_event_script);
+    return TRUE;
+}
+
+Boolean
+failing_connection_events(CFArrayRef service_ids, dispatch_queue_t queue, ConnectionEventCallback callback, void *info)
+{
+    return FALSE;
+}
+
+void
+drain_queue(void *info)
+{
+}
+
+Boolean
+values_equal(CFTypeRef value, CFTypeRef expected)
+{
+    return value != NULL && CFEqual(value, expected);
+}
+
+/* Checks one line of watch output against the transition it should hold.
+ * @param previous The expected previous state, or NULL if there should be
+ *     none. */
+void
+check_transition(FILE *file, CFStringRef service_id, CFStringRef state, CFStringRef previous, int last_cause)
+{
+    char line[512];
+    CHECK(fgets(line, sizeof(line), file) != NULL);
+    
+    CFTypeRef event = create_json_value(line, strlen(line));
+    Boolean is_object = event != NULL && CFGetTypeID(event) == CFDictionaryGetTypeID();
+    CHECK(is_object);
+    if (!is_object) {
+        if (event != NULL) {
+            CFRelease(event);
+        }
+        return;
+    }
+    
+    CFTypeRef cause = CFDictionaryGetValue(event, CFSTR("last_cause"));
+    int cause_value = -1;
+    if (cause != NULL && CFGetTypeID(cause) == CFNumberGetTypeID()) {
+        CFNumberGetValue(cause, kCFNumberIntType, &cause_value);
+    }
+    
+    CFTypeRef previous_value = CFDictionaryGetValue(event, CFSTR("previous"));
+    CHECK(CFDictionaryContainsKey(event, CFSTR("time")));
+    CHECK(values_equal(CFDictionaryGetValue(event, CFSTR("id")), service_id));
+    CHECK(values_equal(CFDictionaryGetValue(event, CFSTR("state")), state));
+    CHECK(previous == NULL ? previous_value == NULL : values_equal(previous_value, previous));
+    CHECK(cause_value == last_cause);
+    
+    CFRelease(event);
+}
+
+/* A connection that drops and comes back, with a repeated status and a
+ * second connection reporting in between. Repeats are not transitions,
+ * and each connection has its own previous state. */
+void
+test_flap_sequence(void)
+{
+    const ScriptedEvent events[] = {
+        {CFSTR("A"), kSCNetworkConnectionConnected, 0},
+        {CFSTR("A"), kSCNetworkConnectionConnected, 0},
+        {CFSTR("A"), kSCNetworkConnectionDisconnected, 5},
+        {CFSTR("A"), kSCNetworkConnectionConnecting, 0},
+        {CFSTR("B"), kSCNetworkConnectionDisconnected, 0},
+        {CFSTR("A"), kSCNetworkConnectionConnected, 0},
+        {CFSTR("A"), kSCNetworkConnectionDisconnecting, 0},
+        {CFSTR("A"), kSCNetworkConnectionDisconnected, 0}
+    };
+    event_script.events = events;
+    event_script.count = sizeof(events) / sizeof(events[0]);
+    
+    const void *raw_ids[2] = {CFSTR("A"), CFSTR("B")};
+    CFArrayRef service_ids = CFArrayCreate(NULL, raw_ids, 2, &kCFTypeArrayCallBacks);
+    FILE *output = tmpfile();
+    dispatch_queue_t queue = dispatch_queue_create("VPNHelperTests.watch", DISPATCH_QUEUE_SERIAL);
+    
+    CHECK(start_watch(service_ids, scripted_connection_events, output, queue));
+    dispatch_sync_f(queue, NULL, drain_queue);
+    rewind(output);
+    
+    check_transition(output, CFSTR("A"), CFSTR("connected"), NULL, 0);
+    check_transition(output, CFSTR("A"), CFSTR("disconnected"), CFSTR("connected"), 5);
+    check_transition(output, CFSTR("A"), CFSTR("connecting"), CFSTR("disconnected"), 0);
+    check_transition(output, CFSTR("B"), CFSTR("disconnected"), NULL, 0);
+    check_transition(output, CFSTR("A"), CFSTR("connected"), CFSTR("connecting"), 0);
+    check_transition(output, CFSTR("A"), CFSTR("disconnecting"), CFSTR("connected"), 0);
+    check_transition(output, CFSTR("A"), CFSTR("disconnected"), CFSTR("disconnecting"), 0);
+    
+    char line[512];
+    CHECK(fgets(line, sizeof(line), output) == NULL);
+    
+    dispatch_release(queue);
+    fclose(output);
+    CFRelease(service_ids);
+}
+
+/* A source that can't watch every connection stops the watch. */
+void
+test_failing_source(void)
+{
+    const void *raw_ids[1] = {CFSTR("A")};
+    CFArrayRef service_ids = CFArrayCreate(NULL, raw_ids, 1, &kCFTypeArrayCallBacks);
+    dispatch_queue_t queue = dispatch_queue_create("VPNHelperTests.watch", DISPATCH_QUEUE_SERIAL);
+    
+    CHECK(!start_watch(service_ids, failing_connection_events, stdout, queue));
+    
+    dispatch_release(queue);
+    CFRelease(service_ids);
+}
+
+void
+run_watch_tests(void)
+{
+    test_flap_sequence();
+    test_failing_source();
+}